@@ -0,0 +1,252 @@
+/*
+Audio - the buzzer, a square wave while the sound timer is non-zero
+
+The emulation thread is the producer: at the end of every frame it pushes a
+gate (was the sound timer running) into a ring of AUDIO_RING_SIZE bytes, and
+publishes it by storing head with release ordering. The consumer loads head
+with acquire ordering, plays each gate for rate / 60 samples, and hands the
+slot back by storing tail. Nothing else is shared, so neither side ever takes a
+lock, and the producer never waits: if the ring is full the consumer has
+stopped, and the gate is dropped.
+
+Frames arrive at the emulation's 60hz while samples leave at the device's rate,
+so the consumer keeps itself within `latency` samples of the newest gate by
+cutting the gate playing short and skipping gates it's behind on, and holds
+the last gate for a frame when it runs dry. The SDL front end sets latency to
+one device buffer. A WAV file is written on the emulation thread instead, a
+frame at a time right after each push, so it never runs dry or falls behind
+and holds exactly what the ROM asked for, frame for frame.
+*/
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "includes/audio.h"
+
+
+#define WAV_HEADER_SIZE 0x2c
+
+
+/*
+    Creates a silent buzzer for a consumer taking samples at rate, keeping the
+    newest gate at most latency samples away.
+*/
+audio_t* audio_new(uint32_t rate, uint32_t latency)
+{
+    size_t size = (sizeof(audio_t) + AUDIO_CACHE_LINE - 1) / AUDIO_CACHE_LINE * AUDIO_CACHE_LINE;
+    audio_t* audio = aligned_alloc(AUDIO_CACHE_LINE, size);
+    if (audio == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for audio\n");
+        return NULL;
+    }
+    memset(audio, 0, size);
+    audio_set_format(audio, rate, latency);
+    return audio;
+}
+
+/*
+    Changes the consumer's rate and latency. Only call it while the consumer
+    isn't running, before an audio device is unpaused.
+*/
+void audio_set_format(audio_t* audio, uint32_t rate, uint32_t latency)
+{
+    audio->rate = rate;
+    audio->frame_samples = rate / TIMER_HZ;
+    audio->latency = latency;
+    audio->phase_step = ((uint64_t) AUDIO_TONE_HZ << 32) / rate;
+}
+
+static void put_u16(uint8_t* bytes, uint16_t value)
+{
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+}
+
+static void put_u32(uint8_t* bytes, uint32_t value)
+{
+    put_u16(bytes, value);
+    put_u16(&(bytes[2]), value >> 16);
+}
+
+/*
+    The header of a 16-bit mono PCM WAV file holding samples samples.
+*/
+static void wav_header(uint8_t* header, uint32_t rate, uint64_t samples)
+{
+    uint32_t data_size = samples * 2 > UINT32_MAX - WAV_HEADER_SIZE ? UINT32_MAX - WAV_HEADER_SIZE : samples * 2;
+    memcpy(header, "RIFF", 4);
+    put_u32(&(header[0x04]), WAV_HEADER_SIZE - 8 + data_size);
+    memcpy(&(header[0x08]), "WAVEfmt ", 8);
+    put_u32(&(header[0x10]), 16); // fmt chunk size
+    put_u16(&(header[0x14]), 1);  // PCM
+    put_u16(&(header[0x16]), 1);  // mono
+    put_u32(&(header[0x18]), rate);
+    put_u32(&(header[0x1c]), rate * 2); // bytes per second
+    put_u16(&(header[0x20]), 2);  // bytes per sample
+    put_u16(&(header[0x22]), 16); // bits per sample
+    memcpy(&(header[0x24]), "data", 4);
+    put_u32(&(header[0x28]), data_size);
+}
+
+/*
+    Creates a buzzer that writes itself to a WAV file at AUDIO_RATE, for
+    listening to or comparing headless runs.
+*/
+audio_t* audio_open_wav(const char* filename)
+{
+    audio_t* audio = audio_new(AUDIO_RATE, AUDIO_LATENCY_UNBOUNDED);
+    if (audio == NULL) {
+        return NULL;
+    }
+    audio->wav = fopen(filename, "wb");
+    if (audio->wav == NULL) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        free(audio);
+        return NULL;
+    }
+    uint8_t header[WAV_HEADER_SIZE];
+    wav_header(header, audio->rate, 0); // sizes are filled in by audio_close
+    audio->failed = fwrite(header, 1, sizeof(header), audio->wav) != sizeof(header);
+    return audio;
+}
+
+/*
+    Pushes the buzzer's state at the end of every frame the scheduler runs from now on.
+*/
+void audio_attach(audio_t* audio, scheduler_t* scheduler)
+{
+    scheduler->audio = audio;
+}
+
+/*
+    Producer side: publishes a frame's gate, or drops it if the consumer has
+    fallen a whole ring behind.
+*/
+static void audio_push(audio_t* audio, bool gate)
+{
+    uint32_t head = audio->head; // only this thread stores it
+    if (head - __atomic_load_n(&(audio->tail), __ATOMIC_ACQUIRE) == AUDIO_RING_SIZE) {
+        return;
+    }
+    audio->ring[head % AUDIO_RING_SIZE] = gate;
+    __atomic_store_n(&(audio->head), head + 1, __ATOMIC_RELEASE);
+}
+
+static void audio_write_frame(audio_t* audio)
+{
+    int16_t samples[AUDIO_RATE / TIMER_HZ];
+    uint8_t bytes[sizeof(samples)];
+    audio_render(audio, samples, audio->frame_samples);
+    for (uint32_t i = 0; i < audio->frame_samples; i++) {
+        put_u16(&(bytes[i * 2]), samples[i]);
+    }
+    audio->failed |= fwrite(bytes, 2, audio->frame_samples, audio->wav) != audio->frame_samples;
+    audio->wav_samples += audio->frame_samples;
+}
+
+/*
+    Records the sound timer at the end of a frame, before it ticks.
+*/
+void audio_frame(audio_t* audio, emu_state_t* state)
+{
+    audio_push(audio, state->sound_timer > 0);
+    if (audio->wav != NULL) {
+        audio_write_frame(audio);
+    }
+}
+
+/*
+    Records frames the scheduler skipped over without running (idle loops),
+    given the sound timer before the first of them. A ring with a live consumer
+    only takes the last AUDIO_RING_SIZE of them; the rest would be dropped anyway.
+*/
+void audio_repeat(audio_t* audio, uint8_t sound_timer, uint64_t frames)
+{
+    uint64_t frame = audio->wav == NULL && frames > AUDIO_RING_SIZE ? frames - AUDIO_RING_SIZE : 0;
+    for (; frame < frames; frame++) {
+        audio_push(audio, sound_timer > frame);
+        if (audio->wav != NULL) {
+            audio_write_frame(audio);
+        }
+    }
+}
+
+/*
+    Moves on to the next gate, holding the current one for a frame if there
+    isn't one yet (the emulation thread is a little late) and going quiet if
+    there still isn't (it has stopped, or is rewinding).
+*/
+static void audio_next_gate(audio_t* audio, uint32_t head)
+{
+    if (audio->tail == head) {
+        audio->gate = audio->gate && !audio->stale;
+        audio->stale = true;
+    } else {
+        bool gate = audio->ring[audio->tail % AUDIO_RING_SIZE];
+        if (gate && !audio->gate) {
+            audio->phase = 0; // every beep starts on the same edge
+        }
+        audio->gate = gate;
+        audio->stale = false;
+        __atomic_store_n(&(audio->tail), audio->tail + 1, __ATOMIC_RELEASE);
+    }
+    audio->frame_left = audio->frame_samples;
+}
+
+/*
+    Consumer side: fills samples with signed 16-bit mono audio. Safe to call
+    from an audio callback thread while the emulation thread pushes.
+*/
+void audio_render(audio_t* audio, int16_t* samples, uint32_t count)
+{
+    uint32_t head = __atomic_load_n(&(audio->head), __ATOMIC_ACQUIRE);
+    uint32_t queued = head - audio->tail;
+    if (audio->latency != AUDIO_LATENCY_UNBOUNDED && queued > 0) {
+        // start the newest gate no more than latency samples from now
+        if (audio->frame_left + (uint64_t)(queued - 1) * audio->frame_samples > audio->latency) {
+            audio->frame_left = 0;
+        }
+        for (; (uint64_t)(queued - 1) * audio->frame_samples > audio->latency; queued--) {
+            __atomic_store_n(&(audio->tail), audio->tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (audio->frame_left == 0) {
+            audio_next_gate(audio, head);
+        }
+        audio->frame_left--;
+        if (!audio->gate) {
+            samples[i] = 0;
+        } else {
+            samples[i] = (audio->phase & 0x80000000) ? -AUDIO_AMPLITUDE : AUDIO_AMPLITUDE;
+        }
+        audio->phase += audio->phase_step;
+    }
+}
+
+/*
+    Frees the buzzer, first finishing its WAV file if it has one. Returns false
+    if any of the file failed to write. A consumer must already be stopped.
+*/
+bool audio_close(audio_t* audio)
+{
+    if (audio == NULL) {
+        return true;
+    }
+    bool written = true;
+    if (audio->wav != NULL) {
+        uint8_t header[WAV_HEADER_SIZE];
+        wav_header(header, audio->rate, audio->wav_samples);
+        written = !audio->failed && fseek(audio->wav, 0, SEEK_SET) == 0 &&
+            fwrite(header, 1, sizeof(header), audio->wav) == sizeof(header);
+        written &= fclose(audio->wav) == 0;
+        if (!written) {
+            fprintf(stderr, "error: unable to write the WAV file\n");
+        }
+    }
+    free(audio);
+    return written;
+}
@@ -0,0 +1,721 @@
+
+/*
+Batch CHIP-8 runner - many independent instances across all cores
+
+usage: emu_batch [options] <rom file>...
+
+    --cycles N          stop each instance after N instructions
+    --frames N          stop each instance after N 60hz frames
+    --ipf N             instructions per frame (default DEFAULT_IPF)
+    --seeds N           run every ROM N times, with seeds first-seed .. first-seed + N - 1
+    --first-seed S      seed of the first instance of each ROM (default 1)
+    --random-keys       drive the keypad from each instance's seed, so runs get past Fx0A
+    --threads N         worker threads (default: one per core)
+    --list FILE         read ROM paths from FILE, one per line, as well as the arguments
+    --lockstep          run the seeds of each ROM LOCKSTEP_LANES at a time on the lockstep engine,
+                        going on one at a time if too little of a batch runs as vectors
+    --json              one JSON object per instance on stdout instead of a table
+    --quirks NAME       quirk profile for every ROM: default, chip8, chip48 or schip
+                        (default: each ROM's entry in QUIRKS_DATABASE)
+    --pack FILE         take the ROMs from a pack built by emu_pack: the arguments and --list
+                        name them (by name or hash), or with neither every ROM in it runs;
+                        each one's quirk profile and instructions per frame apply unless
+                        given as flags, and --frames counts its frames at its own rate
+
+At least one of --cycles or --frames is required. Instances are independent: each gets
+its own state and RND seed, so results don't depend on thread count or scheduling.
+Per-instance results are printed in ROM/seed order; totals go to stderr.
+With --lockstep, results are the same except that each instance's seconds are its
+share of its lockstep batch.
+*/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "includes/cli.h"
+#include "includes/decode.h"
+#include "includes/emu.h"
+#include "includes/jit.h"
+#include "includes/lockstep.h"
+#include "includes/pack.h"
+#include "includes/pool.h"
+#include "includes/quirks.h"
+#include "includes/rng.h"
+#include "includes/scheduler.h"
+
+
+#define RANDOM_KEY_RATE 8 // on average, the random keypad changes once every this many frames
+#define INPUT_BYTES 64 // random keypad bytes drawn ahead at a time
+#define INPUT_SEED_MIX 0x9e3779b97f4a7c15ull // keeps an instance's input independent of its RND stream
+#define LOCKSTEP_PROBE_FRAMES 60 // frames between checks on how much of a lockstep batch runs as vectors
+#define LOCKSTEP_MIN_VECTOR_SHARE 50 // percent; below it a lockstep batch is slower than running its instances alone
+
+/*
+    An instance's random keypad input: a generator of its own, drawn from in
+    bulk with rng_fill rather than a call per byte.
+*/
+typedef struct batch_input {
+    rng_t rng;
+    uint8_t bytes[INPUT_BYTES];
+    size_t next;
+} batch_input_t;
+
+typedef struct batch_rom {
+    const char* path; // or its name in the pack
+    const uint8_t* data; // points into the pack's mapping with --pack
+    size_t size;
+    quirk_profile_t profile;
+    uint32_t instructions_per_frame;
+} batch_rom_t;
+
+typedef struct batch_options {
+    uint64_t cycles;
+    uint64_t frames;
+    uint32_t instructions_per_frame;
+    bool ipf_set; // given with --ipf, rather than taken from the pack
+    uint32_t seeds;
+    uint32_t first_seed;
+    bool random_keys;
+    int threads;
+    bool lockstep;
+    bool json;
+    bool quirks_set; // profile given with --quirks, rather than looked up per ROM
+    quirk_profile_t profile;
+    char* pack;
+} batch_options_t;
+
+typedef struct batch_instance {
+    size_t rom;
+    uint32_t seed;
+    int status;
+    uint64_t cycles;
+    uint64_t frames;
+    uint64_t idle_cycles;
+    uint16_t pc;
+    uint64_t display_hash;
+    double seconds;
+} batch_instance_t;
+
+typedef struct batch_worker {
+    emu_state_t* state; // reused for every instance the worker runs
+#ifdef JIT
+    jit_t* jit;
+#endif
+    lockstep_t* lockstep; // with --lockstep, reused for every group of seeds
+    uint64_t vector_cycles;
+    uint64_t scalar_cycles;
+    uint64_t idle_cycles;
+    size_t handed_over; // lockstep batches that went on one instance at a time
+} batch_worker_t;
+
+typedef struct batch {
+    batch_options_t options;
+    rom_pack_t* pack;
+    batch_rom_t* roms;
+    size_t rom_count;
+    batch_instance_t* instances;
+    size_t instance_count;
+    batch_worker_t* workers;
+} batch_t;
+
+
+static void usage(char* program)
+{
+    fprintf(stderr, "usage: %s [--cycles N] [--frames N] [--ipf N] [--seeds N] [--first-seed S] [--random-keys] "
+        "[--threads N] [--list FILE] [--lockstep] [--json] [--quirks NAME] [--pack FILE] <rom file>...\n", program);
+    exit(1);
+}
+
+static double elapsed_seconds(struct timespec start, struct timespec end)
+{
+    return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void add_rom(batch_t* batch, const char* path)
+{
+    batch_rom_t* roms = realloc(batch->roms, (batch->rom_count + 1) * sizeof(batch_rom_t));
+    if (roms == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for rom list\n");
+        exit(1);
+    }
+    batch->roms = roms;
+    batch->roms[batch->rom_count].path = path;
+    batch->roms[batch->rom_count].data = NULL;
+    batch->rom_count++;
+}
+
+static void add_rom_list(batch_t* batch, const char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        exit(1);
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#') {
+            add_rom(batch, strdup(line));
+        }
+    }
+    fclose(fp);
+}
+
+static void parse_options(batch_t* batch, int argc, char** argv)
+{
+    enum { OPT_CYCLES = 0x100, OPT_FRAMES, OPT_IPF, OPT_SEEDS, OPT_FIRST_SEED, OPT_RANDOM_KEYS,
+        OPT_THREADS, OPT_LIST, OPT_LOCKSTEP, OPT_JSON, OPT_QUIRKS, OPT_PACK };
+    static const struct option long_options[] = {
+        { "cycles",      required_argument, NULL, OPT_CYCLES },
+        { "frames",      required_argument, NULL, OPT_FRAMES },
+        { "ipf",         required_argument, NULL, OPT_IPF },
+        { "seeds",       required_argument, NULL, OPT_SEEDS },
+        { "first-seed",  required_argument, NULL, OPT_FIRST_SEED },
+        { "random-keys", no_argument,       NULL, OPT_RANDOM_KEYS },
+        { "threads",     required_argument, NULL, OPT_THREADS },
+        { "list",        required_argument, NULL, OPT_LIST },
+        { "lockstep",    no_argument,       NULL, OPT_LOCKSTEP },
+        { "json",        no_argument,       NULL, OPT_JSON },
+        { "quirks",      required_argument, NULL, OPT_QUIRKS },
+        { "pack",        required_argument, NULL, OPT_PACK },
+        { NULL, 0, NULL, 0 }
+    };
+    batch_options_t* options = &(batch->options);
+    *options = (batch_options_t) {
+        .cycles = UINT64_MAX,
+        .frames = UINT64_MAX,
+        .instructions_per_frame = DEFAULT_IPF,
+        .ipf_set = false,
+        .seeds = 1,
+        .first_seed = 1,
+        .random_keys = false,
+        .threads = pool_default_threads(),
+        .lockstep = false,
+        .json = false,
+        .quirks_set = false,
+        .profile = PROFILE_DEFAULT,
+        .pack = NULL
+    };
+    bool limited = false;
+    uint64_t count;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case OPT_CYCLES:
+                options->cycles = min(options->cycles, cli_parse_count(optarg, usage, argv[0]));
+                limited = true;
+                break;
+            case OPT_FRAMES:
+                options->frames = min(options->frames, cli_parse_count(optarg, usage, argv[0]));
+                limited = true;
+                break;
+            case OPT_IPF:
+                count = cli_parse_count(optarg, usage, argv[0]);
+                if (count == 0 || count > UINT32_MAX) {
+                    fprintf(stderr, "error: --ipf must be between 1 and %u\n", UINT32_MAX);
+                    usage(argv[0]);
+                }
+                options->instructions_per_frame = count;
+                options->ipf_set = true;
+                break;
+            case OPT_SEEDS:
+                count = cli_parse_count(optarg, usage, argv[0]);
+                if (count == 0 || count > UINT32_MAX) {
+                    fprintf(stderr, "error: --seeds must be between 1 and %u\n", UINT32_MAX);
+                    usage(argv[0]);
+                }
+                options->seeds = count;
+                break;
+            case OPT_FIRST_SEED:
+                options->first_seed = cli_parse_count(optarg, usage, argv[0]);
+                break;
+            case OPT_RANDOM_KEYS:
+                options->random_keys = true;
+                break;
+            case OPT_THREADS:
+                count = cli_parse_count(optarg, usage, argv[0]);
+                if (count == 0 || count > 0x1000) {
+                    fprintf(stderr, "error: --threads must be between 1 and 4096\n");
+                    usage(argv[0]);
+                }
+                options->threads = count;
+                break;
+            case OPT_LIST:
+                add_rom_list(batch, optarg);
+                break;
+            case OPT_LOCKSTEP:
+                options->lockstep = true;
+                break;
+            case OPT_JSON:
+                options->json = true;
+                break;
+            case OPT_QUIRKS:
+                if (!quirks_parse(optarg, &(options->profile))) {
+                    fprintf(stderr, "error: unknown quirk profile %s\n", optarg);
+                    usage(argv[0]);
+                }
+                options->quirks_set = true;
+                break;
+            case OPT_PACK:
+                options->pack = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    for (int arg = optind; arg < argc; arg++) {
+        add_rom(batch, argv[arg]);
+    }
+    if ((batch->rom_count == 0 && options->pack == NULL) || !limited) {
+        usage(argv[0]);
+    }
+}
+
+/*
+    Finds the ROMs in the pack, or lists all of it when none were named.
+*/
+static void load_pack(batch_t* batch)
+{
+    batch_options_t* options = &(batch->options);
+    batch->pack = pack_open(options->pack);
+    if (batch->pack == NULL) {
+        exit(1);
+    }
+    bool everything = batch->rom_count == 0;
+    if (everything) {
+        batch->roms = malloc(max(batch->pack->count, 1u) * sizeof(batch_rom_t));
+        if (batch->roms == NULL) {
+            fprintf(stderr, "error: unable to allocate memory for rom list\n");
+            exit(1);
+        }
+        batch->rom_count = batch->pack->count;
+    }
+    for (size_t rom = 0; rom < batch->rom_count; rom++) {
+        batch_rom_t* item = &(batch->roms[rom]);
+        pack_entry_t entry;
+        if (everything) {
+            pack_entry(batch->pack, rom, &entry);
+            item->path = entry.name;
+        } else if (!pack_lookup(batch->pack, item->path, &entry)) {
+            exit(1);
+        }
+        item->data = entry.data;
+        item->size = entry.size;
+        item->profile = options->quirks_set ? options->profile : entry.profile;
+        item->instructions_per_frame = options->ipf_set || entry.instructions_per_frame == 0
+            ? options->instructions_per_frame : entry.instructions_per_frame;
+    }
+}
+
+/*
+    How many instructions each instance of rom runs: --cycles, or --frames at the ROM's rate if that's fewer.
+*/
+static uint64_t rom_cycles(batch_options_t* options, batch_rom_t* rom)
+{
+    return min(options->cycles, cli_frame_cycles(options->frames, rom->instructions_per_frame));
+}
+
+static uint64_t hash_display(emu_state_t* state)
+{
+    uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a over the packed rows
+    for (int row = 0; row < DISPLAY_ROWS; row++) {
+        hash = (hash ^ state->display[row]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static void input_init(batch_input_t* input, uint64_t seed)
+{
+    rng_seed(&(input->rng), seed ^ INPUT_SEED_MIX);
+    input->next = INPUT_BYTES;
+}
+
+static uint8_t input_byte(batch_input_t* input)
+{
+    if (input->next == INPUT_BYTES) {
+        rng_fill(&(input->rng), input->bytes, INPUT_BYTES);
+        input->next = 0;
+    }
+    return input->bytes[input->next++];
+}
+
+/*
+    Picks the keypad change at a frame boundary from the instance's own input:
+    press a random key when none is held, release it otherwise.
+    Returns false if the keypad stays as it is this frame.
+*/
+static bool random_key(batch_input_t* input, uint8_t* held, uint8_t* key, bool* down)
+{
+    if (input_byte(input) % RANDOM_KEY_RATE != 0) {
+        return false;
+    }
+    if (*held == KEY_NONE) {
+        *held = input_byte(input) & 0xf;
+        *key = *held;
+        *down = true;
+    } else {
+        *key = *held;
+        *down = false;
+        *held = KEY_NONE;
+    }
+    return true;
+}
+
+/*
+    Runs an instance's state from the start of the given frame to the end of its
+    run, with its random keypad input where that's on, then records the result.
+    Frame 0 is a fresh start; the lockstep engine hands over later ones.
+*/
+static void run_scalar(batch_options_t* options, batch_rom_t* rom, batch_instance_t* instance,
+    emu_state_t* state, scheduler_t* scheduler, batch_input_t* input, uint8_t* held, uint64_t first_frame)
+{
+    uint64_t cycles = rom_cycles(options, rom);
+    int status = CYCLE_SUCCESS;
+    if (options->random_keys) {
+        uint8_t key;
+        bool down;
+        uint64_t frames = cycles / rom->instructions_per_frame;
+        // frame by frame, so keys change between frames; a frame parked at Fx0A still ticks the timers
+        for (uint64_t frame = first_frame; frame < frames && status != CYCLE_ERROR; frame++) {
+            status = scheduler_run_frame(scheduler, state);
+            if (random_key(input, held, &key, &down)) {
+                state_set_key(state, key, down);
+            }
+        }
+        if (status != CYCLE_ERROR) {
+            status = scheduler_run(scheduler, state, cycles % rom->instructions_per_frame);
+        }
+    } else {
+        status = scheduler_run(scheduler, state, cycles - first_frame * rom->instructions_per_frame);
+    }
+
+    instance->status = status;
+    instance->cycles = scheduler->cycles;
+    instance->frames = scheduler->frames;
+    instance->idle_cycles = state->idle_cycles;
+    instance->pc = state->pc;
+    instance->display_hash = hash_display(state);
+}
+
+/*
+    Pool task: runs one instance start to finish on the worker's state.
+*/
+static void run_instance(void* context, size_t task, int worker_id)
+{
+    batch_t* batch = context;
+    batch_options_t* options = &(batch->options);
+    batch_instance_t* instance = &(batch->instances[task]);
+    batch_worker_t* worker = &(batch->workers[worker_id]);
+    batch_rom_t* rom = &(batch->roms[instance->rom]);
+    emu_state_t* state = worker->state;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    state_init(state);
+    state_seed(state, instance->seed);
+    state_set_profile(state, rom->profile);
+    if (rom->data == NULL || !rom_to_mem(state, rom->data, rom->size, ROM_START)) {
+        instance->status = CYCLE_ERROR;
+        return;
+    }
+    decode_fuse(state, ROM_START, MEM_SIZE);
+
+    scheduler_t scheduler;
+    scheduler_init(&scheduler, rom->instructions_per_frame, false);
+    batch_input_t input;
+    input_init(&input, instance->seed);
+    uint8_t held = KEY_NONE;
+    run_scalar(options, rom, instance, state, &scheduler, &input, &held, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    instance->seconds = elapsed_seconds(start, end);
+}
+
+/*
+    Pool task: runs a group of up to LOCKSTEP_LANES seeds of one ROM on the worker's
+    lockstep batch, following run_instance's frame and status bookkeeping lane by
+    lane so every instance reports what run_instance would have.
+*/
+static void run_lockstep(void* context, size_t task, int worker_id)
+{
+    batch_t* batch = context;
+    batch_options_t* options = &(batch->options);
+    batch_worker_t* worker = &(batch->workers[worker_id]);
+    lockstep_t* lockstep = worker->lockstep;
+    size_t groups = (options->seeds + LOCKSTEP_LANES - 1) / LOCKSTEP_LANES;
+    size_t first_lane = task % groups * LOCKSTEP_LANES;
+    size_t lanes = min((size_t) LOCKSTEP_LANES, options->seeds - first_lane);
+    batch_instance_t* instances = &(batch->instances[task / groups * options->seeds + first_lane]);
+    batch_rom_t* rom = &(batch->roms[instances[0].rom]);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    lockstep_init(lockstep, lanes);
+    lockstep_set_profile(lockstep, rom->profile);
+    if (rom->data == NULL || !lockstep_load(lockstep, rom->data, rom->size)) {
+        for (size_t lane = 0; lane < lanes; lane++) {
+            instances[lane].status = CYCLE_ERROR;
+        }
+        return;
+    }
+    batch_input_t inputs[LOCKSTEP_LANES];
+    uint8_t held[LOCKSTEP_LANES];
+    bool stopped[LOCKSTEP_LANES] = { false };
+    for (size_t lane = 0; lane < lanes; lane++) {
+        lockstep_seed(lockstep, lane, instances[lane].seed);
+        input_init(&(inputs[lane]), instances[lane].seed);
+        held[lane] = KEY_NONE;
+        instances[lane].status = CYCLE_SUCCESS;
+    }
+
+    uint32_t per_frame = rom->instructions_per_frame;
+    uint64_t cycles = rom_cycles(options, rom);
+    uint64_t frames = cycles / per_frame;
+    uint64_t rest = cycles % per_frame;
+    uint64_t next_probe = LOCKSTEP_PROBE_FRAMES, probe_vector = 0, probe_scalar = 0;
+    uint64_t frame;
+    for (frame = 0; frame < frames; frame++) {
+        if (frame >= next_probe) {
+            // vector steps only pay for the slower lane by lane steps when they do most of the work
+            uint64_t vector = lockstep->vector_cycles - probe_vector;
+            uint64_t scalar = lockstep->scalar_cycles - probe_scalar;
+            if (100 * vector < LOCKSTEP_MIN_VECTOR_SHARE * (vector + scalar)) {
+                break;
+            }
+            probe_vector = lockstep->vector_cycles;
+            probe_scalar = lockstep->scalar_cycles;
+            next_probe = frame + LOCKSTEP_PROBE_FRAMES;
+        }
+        if (!options->random_keys) {
+            // like scheduler_run, frames every lane would idle through go at once
+            uint64_t skipped = lockstep_skip_idle_frames(lockstep, frames - frame, per_frame);
+            if (skipped > 0) {
+                for (size_t lane = 0; lane < lanes; lane++) {
+                    instances[lane].frames += stopped[lane] ? 0 : skipped;
+                }
+                frame += skipped - 1;
+                continue;
+            }
+            lockstep_rest_idle_lanes(lockstep, per_frame); // and so do the frames of lanes idling alone
+        }
+        lockstep_run(lockstep, per_frame);
+        lockstep_tick_timers(lockstep);
+        for (size_t lane = 0; lane < lanes; lane++) {
+            batch_instance_t* instance = &(instances[lane]);
+            if (stopped[lane]) {
+                continue;
+            }
+            bool waiting = lockstep_waiting(lockstep, lane);
+            if (options->random_keys) {
+                // a frame parked at Fx0A still ends, and the keys may release it
+                instance->frames++;
+                instance->status = waiting ? CYCLE_KEY_WAIT : CYCLE_SUCCESS;
+                uint8_t key;
+                bool down;
+                if (random_key(&(inputs[lane]), &(held[lane]), &key, &down)) {
+                    lockstep_set_key(lockstep, lane, key, down);
+                }
+            } else if (waiting) {
+                instance->status = CYCLE_KEY_WAIT; // stops mid-frame, like scheduler_run
+                stopped[lane] = true;
+            } else {
+                instance->frames++;
+            }
+        }
+    }
+    bool handed_over = frame < frames;
+    if (!handed_over && rest > 0) {
+        lockstep_run(lockstep, rest);
+    }
+    for (size_t lane = 0; lane < lanes; lane++) {
+        batch_instance_t* instance = &(instances[lane]);
+        lockstep_extract(lockstep, lane, worker->state);
+        if (handed_over && !stopped[lane]) {
+            // the rest of the run goes one instance at a time, as run_instance would have run it
+            decode_fuse(worker->state, ROM_START, MEM_SIZE);
+            scheduler_t scheduler;
+            scheduler_init(&scheduler, per_frame, false);
+            scheduler.cycles = lockstep->retired[lane];
+            scheduler.frames = instance->frames;
+            run_scalar(options, rom, instance, worker->state, &scheduler, &(inputs[lane]), &(held[lane]), frame);
+            continue;
+        }
+        instance->cycles = lockstep->retired[lane];
+        if (!stopped[lane]) {
+            instance->status = rest > 0 && lockstep_waiting(lockstep, lane) ? CYCLE_KEY_WAIT : CYCLE_SUCCESS;
+        }
+        instance->idle_cycles = worker->state->idle_cycles;
+        instance->pc = worker->state->pc;
+        instance->display_hash = hash_display(worker->state);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = elapsed_seconds(start, end);
+    for (size_t lane = 0; lane < lanes; lane++) {
+        instances[lane].seconds = seconds / lanes;
+    }
+    worker->handed_over += handed_over;
+    worker->vector_cycles += lockstep->vector_cycles;
+    worker->scalar_cycles += lockstep->scalar_cycles;
+    worker->idle_cycles += lockstep->idle_cycles;
+}
+
+static const char* status_name(int status)
+{
+    switch (status) {
+        case CYCLE_SUCCESS:
+            return "ok";
+        case CYCLE_KEY_WAIT:
+            return "key_wait";
+        default:
+            return "error";
+    }
+}
+
+static void print_instance(batch_t* batch, batch_instance_t* instance)
+{
+    const char* path = batch->roms[instance->rom].path;
+    if (batch->options.json) {
+        printf("{\"rom\": ");
+        cli_print_json_string(path, stdout);
+        printf(", \"seed\": %u, \"status\": \"%s\", \"cycles\": %llu, \"frames\": %llu, \"idle_cycles\": %llu",
+            instance->seed, status_name(instance->status), (unsigned long long) instance->cycles,
+            (unsigned long long) instance->frames, (unsigned long long) instance->idle_cycles);
+        printf(", \"pc\": %u, \"display_hash\": \"%016llx\", \"seconds\": %.6f}\n",
+            instance->pc, (unsigned long long) instance->display_hash, instance->seconds);
+    } else {
+        printf("%-32s %10u %-8s %12llu %12llu  %03x  %016llx %10.6f\n",
+            path, instance->seed, status_name(instance->status), (unsigned long long) instance->cycles,
+            (unsigned long long) instance->idle_cycles, instance->pc,
+            (unsigned long long) instance->display_hash, instance->seconds);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    batch_t batch = { 0 };
+    parse_options(&batch, argc, argv);
+    batch_options_t* options = &(batch.options);
+
+    if (options->pack != NULL) {
+        load_pack(&batch);
+    } else {
+        for (size_t rom = 0; rom < batch.rom_count; rom++) {
+            batch_rom_t* entry = &(batch.roms[rom]);
+            entry->data = read_rom((char*) entry->path, &(entry->size));
+            entry->profile = options->profile;
+            entry->instructions_per_frame = options->instructions_per_frame;
+            if (entry->data != NULL && !options->quirks_set) {
+                quirks_lookup(QUIRKS_DATABASE, entry->data, entry->size, &(entry->profile));
+            }
+        }
+    }
+    batch.instance_count = batch.rom_count * options->seeds;
+    batch.instances = calloc(batch.instance_count, sizeof(batch_instance_t));
+    batch.workers = calloc(options->threads, sizeof(batch_worker_t));
+    if (batch.instances == NULL || batch.workers == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for %zu instances\n", batch.instance_count);
+        exit(1);
+    }
+    for (size_t task = 0; task < batch.instance_count; task++) {
+        batch.instances[task].rom = task / options->seeds;
+        batch.instances[task].seed = options->first_seed + task % options->seeds;
+    }
+    for (int worker = 0; worker < options->threads; worker++) {
+        batch.workers[worker].state = state_new();
+        if (batch.workers[worker].state == NULL) {
+            exit(1);
+        }
+        #ifdef JIT
+            batch.workers[worker].jit = jit_new();
+            if (batch.workers[worker].jit == NULL) {
+                exit(1);
+            }
+            jit_attach(batch.workers[worker].jit, batch.workers[worker].state);
+        #endif
+        if (options->lockstep) {
+            batch.workers[worker].lockstep = lockstep_new(LOCKSTEP_LANES);
+            if (batch.workers[worker].lockstep == NULL) {
+                exit(1);
+            }
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status;
+    if (options->lockstep) {
+        size_t groups = (options->seeds + LOCKSTEP_LANES - 1) / LOCKSTEP_LANES;
+        status = pool_run(batch.rom_count * groups, options->threads, run_lockstep, &batch);
+    } else {
+        status = pool_run(batch.instance_count, options->threads, run_instance, &batch);
+    }
+    if (status != 0) {
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t total_cycles = 0, total_idle = 0;
+    size_t failed = 0;
+    if (!options->json) {
+        printf("%-32s %10s %-8s %12s %12s  %3s  %16s %10s\n",
+            "rom", "seed", "status", "cycles", "idle", "pc", "display", "seconds");
+    }
+    for (size_t task = 0; task < batch.instance_count; task++) {
+        print_instance(&batch, &(batch.instances[task]));
+        total_cycles += batch.instances[task].cycles;
+        total_idle += batch.instances[task].idle_cycles;
+        failed += batch.instances[task].status == CYCLE_ERROR;
+    }
+    double seconds = elapsed_seconds(start, end);
+    fprintf(stderr, "Instances: %zu on %d threads (%zu failed)\n", batch.instance_count, options->threads, failed);
+    fprintf(stderr, "Cycles: %llu (%llu interpreted)\n", (unsigned long long) total_cycles,
+        (unsigned long long) (total_cycles - total_idle));
+    fprintf(stderr, "Seconds: %.6f\n", seconds);
+    if (seconds > 0) {
+        // like emu_headless, the rate leaves out fast-forwarded idle loops
+        fprintf(stderr, "Instances/sec: %.1f\n", batch.instance_count / seconds);
+        fprintf(stderr, "Instructions/sec: %.0f\n", (total_cycles - total_idle) / seconds);
+    }
+    if (options->lockstep) {
+        uint64_t vector_cycles = 0, scalar_cycles = 0, idle_cycles = 0;
+        size_t handed_over = 0;
+        for (int worker = 0; worker < options->threads; worker++) {
+            vector_cycles += batch.workers[worker].vector_cycles;
+            scalar_cycles += batch.workers[worker].scalar_cycles;
+            idle_cycles += batch.workers[worker].idle_cycles;
+            handed_over += batch.workers[worker].handed_over;
+        }
+        if (vector_cycles + scalar_cycles > 0) {
+            fprintf(stderr, "Lockstep: %.1f%% of instructions ran as vectors, %llu idle cycles skipped\n",
+                100.0 * vector_cycles / (vector_cycles + scalar_cycles), (unsigned long long) idle_cycles);
+        }
+        fprintf(stderr, "Lockstep: %zu of %zu batches went on one instance at a time\n",
+            handed_over, batch.rom_count * ((options->seeds + LOCKSTEP_LANES - 1) / LOCKSTEP_LANES));
+    }
+
+    for (int worker = 0; worker < options->threads; worker++) {
+        state_delete(batch.workers[worker].state);
+        lockstep_delete(batch.workers[worker].lockstep);
+        #ifdef JIT
+            jit_delete(batch.workers[worker].jit);
+        #endif
+    }
+    if (batch.pack == NULL) {
+        for (size_t rom = 0; rom < batch.rom_count; rom++) {
+            free((void*) batch.roms[rom].data);
+        }
+    }
+    pack_close(batch.pack);
+    free(batch.roms);
+    free(batch.instances);
+    free(batch.workers);
+    return failed > 0;
+}
@@ -0,0 +1,232 @@
+/*
+Capture - the display once per 60hz frame, as a compact stream
+
+A capture is a header ("C8FB", version, width 64, height 32) and then one
+record per distinct picture:
+    length of the delta (LEB128 varint)
+    the delta: the picture XORed with the one before it (blank for the first),
+        in the snapshot RLE; bytes run down the display a column of 8 pixels
+        at a time (all 32 rows of pixels 0-7, then 8-15...), the leftmost
+        pixel in the top bit, so a sprite's rows are next to each other
+    frames the picture stayed on screen (LEB128 varint, at least 1)
+The frame count is written when the picture changes again or the capture is
+closed. Pixels a frame didn't touch XOR to zero runs, so a moving sprite costs a
+few bytes and a picture that stays up for an hour costs a record.
+
+Captures are deterministic like the runs they record, so two of them can be
+compared byte for byte. emu_capture turns one into PBM images.
+*/
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "includes/capture.h"
+#include "includes/snapshot.h"
+
+
+static void put_count(capture_t* capture, uint64_t count)
+{
+    while (count >= 0x80) {
+        capture->failed |= fputc((count & 0x7f) | 0x80, capture->fp) == EOF;
+        count >>= 7;
+    }
+    capture->failed |= fputc(count, capture->fp) == EOF;
+}
+
+/*
+    Creates the capture file and writes its header.
+*/
+capture_t* capture_open(const char* filename)
+{
+    capture_t* capture = calloc(1, sizeof(capture_t));
+    if (capture == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for capture\n");
+        return NULL;
+    }
+    capture->fp = fopen(filename, "wb");
+    if (capture->fp == NULL) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        free(capture);
+        return NULL;
+    }
+    uint8_t header[CAPTURE_HEADER_SIZE] = { 0, 0, 0, 0, CAPTURE_VERSION, CAPTURE_WIDTH, DISPLAY_ROWS };
+    memcpy(header, CAPTURE_MAGIC, 4);
+    capture->failed = fwrite(header, 1, sizeof(header), capture->fp) != sizeof(header);
+    return capture;
+}
+
+/*
+    Records every frame the scheduler ends from now on.
+*/
+void capture_attach(capture_t* capture, scheduler_t* scheduler)
+{
+    scheduler->capture = capture;
+}
+
+/*
+    Records the display as it is at the end of a frame.
+*/
+void capture_frame(capture_t* capture, emu_state_t* state)
+{
+    capture->frames++;
+    if (capture->shown > 0 && memcmp(state->display, capture->previous, sizeof(capture->previous)) == 0) {
+        capture->shown++;
+        return;
+    }
+    if (capture->shown > 0) {
+        put_count(capture, capture->shown);
+    }
+    for (int row = 0; row < DISPLAY_ROWS; row++) {
+        uint64_t changed = state->display[row] ^ capture->previous[row];
+        for (int byte = 0; byte < 8; byte++) {
+            capture->delta[byte * DISPLAY_ROWS + row] = changed >> (56 - 8 * byte);
+        }
+    }
+    size_t length = snapshot_rle_encode(capture->delta, CAPTURE_FRAME_BYTES, capture->encoded, 0, CAPTURE_DELTA_MAX);
+    put_count(capture, length);
+    capture->failed |= fwrite(capture->encoded, 1, length, capture->fp) != length;
+    memcpy(capture->previous, state->display, sizeof(capture->previous));
+    capture->shown = 1;
+    capture->changes++;
+}
+
+/*
+    Records frames the scheduler skipped over without running (idle loops),
+    which repeat the last one. Skipping can't change the display, so when the
+    capture starts with skipped frames (a ROM or snapshot parked in an idle
+    loop) the first of them is recorded from state as it is now.
+*/
+void capture_repeat(capture_t* capture, emu_state_t* state, uint64_t frames)
+{
+    if (frames == 0) {
+        return;
+    }
+    if (capture->shown == 0) {
+        capture_frame(capture, state);
+        frames--;
+    }
+    capture->frames += frames;
+    capture->shown += frames;
+}
+
+/*
+    Ends the last record and closes the file. Returns false if any of the
+    capture failed to write.
+*/
+bool capture_close(capture_t* capture)
+{
+    if (capture == NULL) {
+        return true;
+    }
+    if (capture->shown > 0) {
+        put_count(capture, capture->shown);
+    }
+    bool written = !capture->failed;
+    written &= fclose(capture->fp) == 0;
+    if (!written) {
+        fprintf(stderr, "error: unable to write the capture\n");
+    }
+    free(capture);
+    return written;
+}
+
+
+
+/*
+======================
+| Reader             |
+======================
+*/
+
+/*
+    Opens a capture and checks its header.
+*/
+bool capture_reader_open(capture_reader_t* reader, const char* filename)
+{
+    reader->fp = fopen(filename, "rb");
+    if (reader->fp == NULL) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        return false;
+    }
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), reader->fp) != sizeof(header) || memcmp(header, CAPTURE_MAGIC, 4) != 0) {
+        fprintf(stderr, "error: %s is not a capture\n", filename);
+        fclose(reader->fp);
+        return false;
+    }
+    if (header[4] != CAPTURE_VERSION || header[5] != CAPTURE_WIDTH || header[6] != DISPLAY_ROWS) {
+        fprintf(stderr, "error: %s is capture version %d of a %dx%d display, expected %d of %dx%d\n",
+            filename, header[4], header[5], header[6], CAPTURE_VERSION, CAPTURE_WIDTH, DISPLAY_ROWS);
+        fclose(reader->fp);
+        return false;
+    }
+    memset(reader->display, 0, sizeof(reader->display));
+    reader->remaining = 0;
+    reader->frame = 0;
+    reader->changed = false;
+    return true;
+}
+
+static bool read_count(capture_reader_t* reader, uint64_t* count)
+{
+    *count = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(reader->fp);
+        if (byte == EOF) {
+            return false;
+        }
+        *count |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int capture_truncated(capture_reader_t* reader)
+{
+    fprintf(stderr, "error: capture cut off or corrupt after frame %llu\n", (unsigned long long) reader->frame);
+    return -1;
+}
+
+/*
+    Advances reader->display to the next frame. Returns 1 for a frame, 0 at the
+    end of the capture and -1, after reporting it, if the capture is cut off or corrupt.
+*/
+int capture_read(capture_reader_t* reader)
+{
+    reader->changed = reader->remaining == 0;
+    if (reader->remaining == 0) {
+        int first = fgetc(reader->fp);
+        if (first == EOF) {
+            return 0;
+        }
+        ungetc(first, reader->fp);
+        uint64_t length;
+        size_t used = 0;
+        if (!read_count(reader, &length) || length > CAPTURE_DELTA_MAX ||
+            fread(reader->encoded, 1, length, reader->fp) != length ||
+            !snapshot_rle_decode(reader->encoded, length, &used, reader->delta, CAPTURE_FRAME_BYTES) || used != length ||
+            !read_count(reader, &(reader->remaining)) || reader->remaining == 0) {
+            return capture_truncated(reader);
+        }
+        for (int row = 0; row < DISPLAY_ROWS; row++) {
+            uint64_t changed = 0;
+            for (int byte = 0; byte < 8; byte++) {
+                changed = (changed << 8) | reader->delta[byte * DISPLAY_ROWS + row];
+            }
+            reader->display[row] ^= changed;
+        }
+    }
+    reader->remaining--;
+    reader->frame++;
+    return 1;
+}
+
+void capture_reader_close(capture_reader_t* reader)
+{
+    fclose(reader->fp);
+}
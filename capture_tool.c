@@ -0,0 +1,175 @@
+/*
+Capture converter - turns a capture written by --capture into PBM images
+
+usage: emu_capture [options] <capture file> <output prefix>
+
+    --scale N       make each pixel N by N (default 1)
+    --frames A-B    only frames A to B, counting the first as 0
+    --changes       only frames that put up a new picture
+
+Frame N is written to <output prefix>NNNNNN.pbm, so with --changes the file
+names still give the frame each picture went up on. PBM (netpbm P4) is read by
+most image tools; `ffmpeg -i frame%06d.pbm` makes a video of a full sequence.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "includes/capture.h"
+
+
+typedef struct convert_options {
+    uint32_t scale;
+    uint64_t first_frame;
+    uint64_t last_frame;
+    bool changes;
+    char* capture;
+    char* prefix;
+} convert_options_t;
+
+
+static void usage(char* program)
+{
+    fprintf(stderr, "usage: %s [--scale N] [--frames A-B] [--changes] <capture file> <output prefix>\n", program);
+    exit(1);
+}
+
+static uint64_t parse_number(char* program, const char* text, char** end)
+{
+    unsigned long long value = strtoull(text, end, 0);
+    if (*end == text) {
+        fprintf(stderr, "error: expected a number, got '%s'\n", text);
+        usage(program);
+    }
+    return value;
+}
+
+static convert_options_t parse_options(int argc, char** argv)
+{
+    enum { OPT_SCALE = 0x100, OPT_FRAMES, OPT_CHANGES };
+    static const struct option long_options[] = {
+        { "scale",   required_argument, NULL, OPT_SCALE },
+        { "frames",  required_argument, NULL, OPT_FRAMES },
+        { "changes", no_argument,       NULL, OPT_CHANGES },
+        { NULL, 0, NULL, 0 }
+    };
+    convert_options_t options = {
+        .scale = 1,
+        .first_frame = 0,
+        .last_frame = UINT64_MAX,
+        .changes = false,
+        .capture = NULL,
+        .prefix = NULL
+    };
+    char* end;
+    uint64_t scale;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case OPT_SCALE:
+                scale = parse_number(argv[0], optarg, &end);
+                if (*end != '\0' || scale == 0 || scale > 0x40) {
+                    fprintf(stderr, "error: --scale must be between 1 and 64\n");
+                    usage(argv[0]);
+                }
+                options.scale = scale;
+                break;
+            case OPT_FRAMES:
+                options.first_frame = parse_number(argv[0], optarg, &end);
+                if (*end != '-') {
+                    fprintf(stderr, "error: expected a frame range A-B, got '%s'\n", optarg);
+                    usage(argv[0]);
+                }
+                options.last_frame = parse_number(argv[0], end + 1, &end);
+                break;
+            case OPT_CHANGES:
+                options.changes = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2) {
+        usage(argv[0]);
+    }
+    options.capture = argv[optind];
+    options.prefix = argv[optind + 1];
+    return options;
+}
+
+/*
+    Writes one frame as a P4 PBM: set pixels are black, and each row of bits
+    is packed MSB first, which a scale of 1 makes a straight copy of the display.
+*/
+static bool write_pbm(const char* filename, const uint64_t* display, uint32_t scale)
+{
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        return false;
+    }
+    uint32_t width = CAPTURE_WIDTH * scale;
+    uint8_t row_bytes[CAPTURE_WIDTH * 0x40 / 8];
+    size_t length = width / 8;
+    fprintf(fp, "P4\n%u %u\n", width, DISPLAY_ROWS * scale);
+    for (int row = 0; row < DISPLAY_ROWS; row++) {
+        memset(row_bytes, 0, length);
+        for (uint32_t x = 0; x < width; x++) {
+            if ((display[row] >> (CAPTURE_WIDTH - 1 - x / scale)) & 1) {
+                row_bytes[x / 8] |= 0x80 >> (x % 8);
+            }
+        }
+        for (uint32_t repeat = 0; repeat < scale; repeat++) {
+            fwrite(row_bytes, 1, length, fp);
+        }
+    }
+    if (ferror(fp) | (fclose(fp) != 0)) {
+        fprintf(stderr, "error: unable to write %s\n", filename);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    convert_options_t options = parse_options(argc, argv);
+    capture_reader_t* reader = malloc(sizeof(capture_reader_t));
+    if (reader == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for capture\n");
+        exit(1);
+    }
+    if (!capture_reader_open(reader, options.capture)) {
+        exit(1);
+    }
+    size_t name_size = strlen(options.prefix) + 0x20;
+    char* filename = malloc(name_size);
+    if (filename == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for capture\n");
+        exit(1);
+    }
+    uint64_t written = 0;
+    int status;
+    while ((status = capture_read(reader)) == 1) {
+        uint64_t frame = reader->frame - 1;
+        if (frame > options.last_frame) {
+            break;
+        }
+        if (frame < options.first_frame || (options.changes && !reader->changed && frame != options.first_frame)) {
+            continue;
+        }
+        snprintf(filename, name_size, "%s%06llu.pbm", options.prefix, (unsigned long long) frame);
+        if (!write_pbm(filename, reader->display, options.scale)) {
+            exit(1);
+        }
+        written++;
+    }
+    fprintf(stderr, "Wrote %llu images\n", (unsigned long long) written);
+    capture_reader_close(reader);
+    free(reader);
+    free(filename);
+    return status < 0;
+}
@@ -0,0 +1,52 @@
+/*
+Command line helpers shared by emu_headless and emu_batch
+*/
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "includes/cli.h"
+
+
+/*
+    Parses a whole argument as an unsigned number (decimal, 0x hex or 0 octal),
+    or reports it and calls usage, which exits.
+*/
+uint64_t cli_parse_count(const char* text, cli_usage_fn usage, char* program)
+{
+    char* end;
+    unsigned long long value = strtoull(text, &end, 0);
+    if (*text == '\0' || *end != '\0') {
+        fprintf(stderr, "error: expected a number, got '%s'\n", text);
+        usage(program);
+    }
+    return value;
+}
+
+/*
+    Instructions in the given number of frames, or UINT64_MAX where that doesn't
+    fit: that many frames run forever anyway, so saturate rather than wrap.
+*/
+uint64_t cli_frame_cycles(uint64_t frames, uint32_t instructions_per_frame)
+{
+    if (instructions_per_frame != 0 && frames > UINT64_MAX / instructions_per_frame) {
+        return UINT64_MAX;
+    }
+    return frames * instructions_per_frame;
+}
+
+/*
+    Writes text as a JSON string, quotes and backslashes escaped.
+*/
+void cli_print_json_string(const char* text, FILE* out)
+{
+    fputc('"', out);
+    for (; *text != '\0'; text++) {
+        if (*text == '"' || *text == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*text, out);
+    }
+    fputc('"', out);
+}
@@ -0,0 +1,231 @@
+
+/*
+Instruction decoding and the predecoded instruction cache
+*/
+
+
+#include <stdint.h>
+#include <string.h>
+#include "includes/decode.h"
+#include "includes/jit.h"
+#include "includes/state.h"
+
+
+/*
+    Decodes a raw instruction into its op id and operands.
+    Unknown instructions decode to OP_NOP, matching the old switch falling through.
+*/
+decoded_instr_t decode_instruction(uint16_t instruction)
+{
+    decoded_instr_t decoded = {
+        .op = OP_NOP,
+        .x = (instruction & 0xf00) >> 8,
+        .y = (instruction & 0xf0) >> 4,
+        .kk = instruction & 0xff
+    };
+    uint8_t first_nibble = (instruction & 0xf000) >> 12;
+    uint8_t fourth_nibble = (instruction & 0xf);
+
+    switch (first_nibble) {
+        case 0x0:
+            switch (instruction) {
+                case 0x00E0:
+                    decoded.op = OP_CLS;
+                    break;
+                case 0x00EE:
+                    decoded.op = OP_RET;
+                    break;
+            }
+            break;
+        case 0x1:
+            decoded.op = OP_JP;
+            break;
+        case 0x2:
+            decoded.op = OP_CALL;
+            break;
+        case 0x3:
+            decoded.op = OP_SE_BYTE;
+            break;
+        case 0x4:
+            decoded.op = OP_SNE_BYTE;
+            break;
+        case 0x5:
+            decoded.op = OP_SE_REG;
+            break;
+        case 0x6:
+            decoded.op = OP_LD_BYTE;
+            break;
+        case 0x7:
+            decoded.op = OP_ADD_BYTE;
+            break;
+        case 0x8:
+            switch (fourth_nibble) {
+                case 0x0:
+                    decoded.op = OP_LD_REG;
+                    break;
+                case 0x1:
+                    decoded.op = OP_OR;
+                    break;
+                case 0x2:
+                    decoded.op = OP_AND;
+                    break;
+                case 0x3:
+                    decoded.op = OP_XOR;
+                    break;
+                case 0x4:
+                    decoded.op = OP_ADD_REG;
+                    break;
+                case 0x5:
+                    decoded.op = OP_SUB;
+                    break;
+                case 0x6:
+                    decoded.op = OP_SHR;
+                    break;
+                case 0x7:
+                    decoded.op = OP_SUBN;
+                    break;
+                case 0xE:
+                    decoded.op = OP_SHL;
+                    break;
+            }
+            break;
+        case 0x9:
+            decoded.op = OP_SNE_REG;
+            break;
+        case 0xA:
+            decoded.op = OP_LD_I;
+            break;
+        case 0xB:
+            decoded.op = OP_JP_V0;
+            break;
+        case 0xC:
+            decoded.op = OP_RND;
+            break;
+        case 0xD:
+            decoded.op = OP_DRW;
+            break;
+        case 0xE:
+            switch (decoded.y) {
+                case 0x9:
+                    decoded.op = OP_SKP;
+                    break;
+                case 0xA:
+                    decoded.op = OP_SKNP;
+                    break;
+            }
+            break;
+        case 0xF:
+            switch (decoded.kk) {
+                case 0x07:
+                    decoded.op = OP_LD_VX_DT;
+                    break;
+                case 0x0A:
+                    decoded.op = OP_LD_VX_K;
+                    break;
+                case 0x15:
+                    decoded.op = OP_LD_DT_VX;
+                    break;
+                case 0x18:
+                    decoded.op = OP_LD_ST_VX;
+                    break;
+                case 0x1E:
+                    decoded.op = OP_ADD_I_VX;
+                    break;
+                case 0x29:
+                    decoded.op = OP_LD_F_VX;
+                    break;
+                case 0x33:
+                    decoded.op = OP_LD_B_VX;
+                    break;
+                case 0x55:
+                    decoded.op = OP_LD_MEM_VX;
+                    break;
+                case 0x65:
+                    decoded.op = OP_LD_VX_MEM;
+                    break;
+            }
+            break;
+    }
+    return decoded;
+}
+
+/*
+    Drops cached decodes covering memory[address, address + length).
+    Must be called after anything writes to memory so self-modifying ROMs stay correct.
+*/
+void decode_invalidate(emu_state_t* state, uint16_t address, uint16_t length)
+{
+    if (length == 0 || address > MEMORY_MASK) {
+        return;
+    }
+    if ((uint32_t)address + length > MEMORY_MASK + 1) {
+        // the write wrapped past the end of memory, drop the wrapped part too
+        decode_invalidate(state, 0, address + length - (MEMORY_MASK + 1));
+        length = MEMORY_MASK + 1 - address;
+    }
+#ifdef JIT
+    if (state->jit != NULL) {
+        jit_invalidate(state->jit, address, length);
+    }
+#endif
+    uint32_t first = address >> 1;
+    uint32_t last = ((uint32_t)address + length - 1) >> 1;
+    if (first >= DECODE_CACHE_SIZE) {
+        return;
+    }
+    if (last >= DECODE_CACHE_SIZE) {
+        last = DECODE_CACHE_SIZE - 1;
+    }
+    memset(&(state->decode_cache[first]), OP_UNDECODED, (last - first + 1) * sizeof(decoded_instr_t));
+    // a superinstruction just before the range may have lost its second half
+    if (first > 0 && state->decode_cache[first - 1].op >= OP_FUSED_FIRST) {
+        state->decode_cache[first - 1].op = OP_UNDECODED;
+    }
+}
+
+static const char* fusion_names[FUSION_KINDS] = {
+    "6xkk+Dxyn",
+    "Annn+Dxyn",
+    "Fx07+3xkk",
+    "7xkk+3xkk"
+};
+
+/*
+    Scans memory[start, end) for instruction pairs that have a fused handler
+    and rewrites their cache slots. Meant to run once after a ROM is loaded.
+*/
+void decode_fuse(emu_state_t* state, uint16_t start, uint16_t end)
+{
+    if (end > DECODE_CACHE_SIZE * 2) {
+        end = DECODE_CACHE_SIZE * 2;
+    }
+    for (uint16_t address = start & ~1; address + 4 <= end; address += 2) {
+        decoded_instr_t first = decode_fetch(state, address);
+        decoded_instr_t second = decode_fetch(state, address + 2);
+        uint8_t fused = OP_UNDECODED;
+
+        if (first.op == OP_LD_BYTE && second.op == OP_DRW) {
+            fused = OP_LD_BYTE_DRW;
+        } else if (first.op == OP_LD_I && second.op == OP_DRW) {
+            fused = OP_LD_I_DRW;
+        } else if (first.op == OP_LD_VX_DT && second.op == OP_SE_BYTE) {
+            fused = OP_LD_DT_SE;
+        } else if (first.op == OP_ADD_BYTE && second.op == OP_SE_BYTE) {
+            fused = OP_ADD_BYTE_SE;
+        }
+        if (fused != OP_UNDECODED) {
+            state->decode_cache[address >> 1].op = fused;
+        }
+    }
+}
+
+/*
+    Prints how many times each superinstruction ran fused.
+*/
+void decode_report_fusions(emu_state_t* state, FILE* out)
+{
+    fprintf(out, "Fusions:\n");
+    for (int kind = 0; kind < FUSION_KINDS; kind++) {
+        fprintf(out, "%s: %llu\n", fusion_names[kind], (unsigned long long) state->fusions[kind]);
+    }
+}
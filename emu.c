@@ -19,8 +19,10 @@ Memory Notes:
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "includes/decode.h"
 #include "includes/opcodes.h"
 #include "includes/emu.h"
+#include "includes/pack.h"
 
 
 /*
@@ -30,30 +32,86 @@ Memory Notes:
 */
 
 /*
-    reads bytes from file into memory starting at given address
-    (adapted from code in my 8080 emu which was adapted from an Emulator101 tutorial)
+    copies a rom image into memory starting at given address
+    returns false (leaving memory untouched) if it doesn't fit
 */
-void file_to_mem(emu_state_t* state, char* filename, uint16_t address)
+bool rom_to_mem(emu_state_t* state, const uint8_t* rom, size_t size, uint16_t address)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return false;
+    }
+    if (address > MEM_SIZE || size > (size_t)(MEM_SIZE - address)) {
+        fprintf(stderr, "error: rom of %zu bytes doesn't fit at %03x\n", size, address);
+        return false;
     }
+    memcpy(&(state->memory[address]), rom, size);
+    decode_invalidate(state, address, size);
+    return true;
+}
+
+/*
+    reads a whole rom file into a new buffer, storing its length in size
+    the caller frees the buffer; returns NULL on failure
+    (adapted from code in my 8080 emu which was adapted from an Emulator101 tutorial)
+*/
+uint8_t* read_rom(char* filename, size_t* size)
+{
     if (filename == NULL) {
         fprintf(stderr, "erorr: null filename ptr\n");
-        exit(1);
+        return NULL;
     }
     FILE* fp = fopen(filename, "rb");
     if (fp == NULL) {
         fprintf(stderr, "error: unable to open %s\n", filename);
-        exit(1);
+        return NULL;
     }
     fseek(fp, 0L, SEEK_END);
-    int fsize = ftell(fp);
+    long fsize = ftell(fp);
     fseek(fp, 0L, SEEK_SET);
-    uint8_t* mem_buffer = &(state->memory[address]);
-    fread(mem_buffer, fsize, 1, fp);
+    uint8_t* rom = malloc(fsize > 0 ? fsize : 1);
+    if (fsize < 0 || rom == NULL || fread(rom, 1, fsize, fp) != (size_t)fsize) {
+        fprintf(stderr, "error: unable to read %s\n", filename);
+        free(rom);
+        fclose(fp);
+        return NULL;
+    }
     fclose(fp);
+    *size = fsize;
+    return rom;
+}
+
+/*
+    reads bytes from file into memory starting at given address
+    returns false if the file can't be read or doesn't fit
+*/
+bool file_to_mem(emu_state_t* state, char* filename, uint16_t address)
+{
+    size_t size;
+    uint8_t* rom = read_rom(filename, &size);
+    if (rom == NULL) {
+        return false;
+    }
+    bool loaded = rom_to_mem(state, rom, size, address);
+    free(rom);
+    return loaded;
+}
+
+/*
+    prints the 64x32 screen to out, one text row per pixel row
+*/
+void dump_framebuffer(emu_state_t* state, FILE* out)
+{
+    if (state == NULL) {
+        fprintf(stderr, "error: null state\n");
+        return;
+    }
+    for (int row = 0; row < DISPLAY_HEIGHT; row++) {
+        for (int col = 0; col < DISPLAY_WIDTH; col++) {
+            fputc(DISPLAY_PIXEL(state, row, col) ? '#' : '.', out);
+        }
+        fputc('\n', out);
+    }
 }
 
 /*
@@ -70,7 +128,7 @@ void debug_mem(emu_state_t* state, uint16_t start, uint16_t end)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     printf("Memory:");
     for (int i = start; i < end; i++) {
@@ -97,12 +155,12 @@ void debug_graphics(emu_state_t* state)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     printf("Graphics:\n");
     for (int row = 0; row < DISPLAY_HEIGHT; row++) {
         for (int col = 0; col < DISPLAY_WIDTH; col++) {
-            if (state->display[row * DISPLAY_WIDTH + col]) {
+            if (DISPLAY_PIXEL(state, row, col)) {
                 printf("#");
             } else {
                 printf(" ");
@@ -119,7 +177,7 @@ void debug_state(emu_state_t* state)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     printf("Opcode: %02x%02x\n", state->memory[state->pc], state->memory[state->pc+1]);
     printf("Registers:\n");
@@ -161,13 +219,16 @@ void curse_graphics(emu_state_t* state)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
-    curse_clearlines(0, DISPLAY_HEIGHT, 0);
+    uint32_t dirty = state_take_dirty_rows(state);
     attron(COLOR_PAIR('#'));
     for (int row = 0; row < DISPLAY_HEIGHT; row++) {
+        if (!(dirty & (1u << row))) {
+            continue; // unchanged since last draw
+        }
         for (int col = 0; col < DISPLAY_WIDTH; col++) {
-            if (state->display[row * DISPLAY_WIDTH + col]) {
+            if (DISPLAY_PIXEL(state, row, col)) {
                 mvaddch(row, col, '#');
             } else {
                 mvaddch(row, col, ' ');
@@ -189,7 +250,7 @@ void curse_state(emu_state_t* state)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     int row_offset = DISPLAY_HEIGHT;
     curse_clearlines(row_offset, row_offset + 8, 0);
@@ -212,7 +273,12 @@ void curse_state(emu_state_t* state)
         mvprintw(row_offset + 7, (stack_index-8) * 9, "0x%02x:%02x ", stack_index, state->memory[STACK_OFFSET + stack_index]);
     }
     attron(COLOR_PAIR('#'));
-    mvprintw(row_offset + 8, 0, "Hit m to scroll down memory, n to scroll up, and other key for next instruction.");
+    if (state_waiting_for_key(state)) {
+        // a terminal has no key releases, so a keypad key typed here is pressed and released at once
+        mvprintw(row_offset + 8, 0, "Waiting for a key (Fx0A): type a keypad key to press it, m or n to scroll memory.");
+    } else {
+        mvprintw(row_offset + 8, 0, "Hit m to scroll down memory, n to scroll up, and other key for next instruction.");
+    }
     attroff(COLOR_PAIR('#'));
     attron(COLOR_PAIR('M'));
     mvprintw(row_offset + 9, 0, "PC is highlighted as green in memory.");
@@ -220,11 +286,29 @@ void curse_state(emu_state_t* state)
     // TODO - also highlight stackp
 }
 
+/*
+    Maps a typed character to its keypad key, or KEY_NONE when unmapped, in the
+    SDL front end's layout (see sdl_keypad_key); keymap is a ROM pack's, all 0
+    for the default.
+*/
+uint8_t curse_keypad_key(int c, const char* keymap)
+{
+    static const char default_keys[PACK_KEYS] = { '1', '2', '3', '4', 'q', 'w', 'e', 'r', 'a', 's', 'd', 'f', 'z', 'x', 'c', 'v' };
+    static const uint8_t layout[PACK_KEYS] = { 0x1, 0x2, 0x3, 0xC, 0x4, 0x5, 0x6, 0xD, 0x7, 0x8, 0x9, 0xE, 0xA, 0x0, 0xB, 0xF };
+    const char* keys = keymap[0] != 0 ? keymap : default_keys;
+    for (int key = 0; key < PACK_KEYS; key++) {
+        if (c == keys[key]) {
+            return layout[key];
+        }
+    }
+    return KEY_NONE;
+}
+
 void curse_memory(emu_state_t* state, int start_offset)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     const int width_offset = DISPLAY_WIDTH + 12;
     curse_clearlines(0, DISPLAY_HEIGHT, width_offset);
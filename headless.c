@@ -0,0 +1,448 @@
+
+/*
+Headless CHIP-8 runner - no SDL, no ncurses
+
+usage: emu_headless [options] <rom file>
+
+    --cycles N          stop after N instructions
+    --frames N          stop after N 60hz frames
+    --ipf N             instructions per frame (default DEFAULT_IPF); the timers tick once per frame
+    --dump-framebuffer  print the screen to stdout when done
+    --stats             print cycle count, timing, peak RSS, idle cycles skipped and fusion counts to stderr;
+                        instructions/sec counts interpreted instructions, not skipped idle ones
+    --no-fuse           skip superinstruction fusion (compare against plain dispatch)
+    --no-idle           interpret idle loops instead of fast-forwarding through them
+    --json              print the run's stats as one JSON object on stdout
+    --load-state FILE   start from a snapshot saved by --save-state instead of power-on,
+                        under the quirk profile it was saved with
+    --save-state FILE   save a snapshot of the machine when done
+    --seed N            seed the RND generator (default: the time)
+    --quirks NAME       quirk profile: default, chip8, chip48 or schip (default: from QUIRKS_DATABASE)
+    --profile FILE      write a per-opcode and per-address profile to FILE, and folded
+                        call stacks for flame graphs to FILE.folded (needs PROFILER=1)
+    --trace FILE        record every instruction to FILE, read it with emu_trace (needs TRACE=1)
+    --pack FILE         run a ROM from a pack built by emu_pack, named by its name or hash; its
+                        quirk profile and instructions per frame apply unless given as flags
+    --capture FILE      record the display at the end of every frame to FILE, turn it into
+                        images with emu_capture
+    --wav FILE          write the buzzer to FILE as 16-bit mono WAV, a frame of samples per frame
+
+At least one of --cycles or --frames is required; with both, the smaller budget wins.
+Frames are counted in instructions, not wall time, so runs are reproducible.
+There is no keyboard, so a ROM reaching Fx0A (wait for key) ends the run early.
+A loaded snapshot brings its own RND state, so a run continued from one matches
+the run it was saved from.
+*/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "includes/audio.h"
+#include "includes/capture.h"
+#include "includes/cli.h"
+#include "includes/decode.h"
+#include "includes/emu.h"
+#include "includes/jit.h"
+#include "includes/pack.h"
+#include "includes/profiler.h"
+#include "includes/quirks.h"
+#include "includes/scheduler.h"
+#include "includes/snapshot.h"
+#include "includes/trace.h"
+
+
+#if defined(JIT)
+    #define ENGINE_NAME "jit"
+#elif defined(DISPATCH_THREADED)
+    #define ENGINE_NAME "threaded"
+#else
+    #define ENGINE_NAME "switch"
+#endif
+
+typedef struct headless_options {
+    uint64_t cycles;
+    uint64_t frames;
+    uint32_t instructions_per_frame;
+    bool ipf_set; // given with --ipf, rather than taken from the pack
+    bool dump_framebuffer;
+    bool stats;
+    bool fuse;
+    bool skip_idle;
+    bool json;
+    char* load_state;
+    char* save_state;
+    uint64_t seed;
+    char* quirks;
+    char* profile;
+    char* trace;
+    char* pack;
+    char* capture;
+    char* wav;
+    char* rom;
+} headless_options_t;
+
+typedef struct headless_result {
+    uint64_t rom_hash; // as listed in QUIRKS_DATABASE
+    double seconds;
+    uint64_t cycles; // retired, which Fx0A may leave short of the budget
+    uint64_t idle_cycles; // of those, fast-forwarded rather than interpreted
+    uint64_t frames;
+    bool key_wait; // stopped early at Fx0A
+    long peak_rss_kb;
+} headless_result_t;
+
+
+static void usage(char* program)
+{
+    fprintf(stderr, "usage: %s [--cycles N] [--frames N] [--ipf N] [--dump-framebuffer] [--stats] [--no-fuse] [--no-idle] [--json] "
+        "[--load-state FILE] [--save-state FILE] [--seed N] [--quirks NAME] [--profile FILE] [--trace FILE] [--pack FILE] [--capture FILE] [--wav FILE] <rom file>\n",
+        program);
+    exit(1);
+}
+
+static headless_options_t parse_options(int argc, char** argv)
+{
+    enum { OPT_CYCLES = 0x100, OPT_FRAMES, OPT_IPF, OPT_DUMP, OPT_STATS, OPT_NO_FUSE, OPT_NO_IDLE, OPT_JSON,
+        OPT_LOAD_STATE, OPT_SAVE_STATE, OPT_SEED, OPT_QUIRKS, OPT_PROFILE, OPT_TRACE, OPT_PACK, OPT_CAPTURE, OPT_WAV };
+    static const struct option long_options[] = {
+        { "cycles",           required_argument, NULL, OPT_CYCLES },
+        { "frames",           required_argument, NULL, OPT_FRAMES },
+        { "ipf",              required_argument, NULL, OPT_IPF },
+        { "dump-framebuffer", no_argument,       NULL, OPT_DUMP },
+        { "stats",            no_argument,       NULL, OPT_STATS },
+        { "no-fuse",          no_argument,       NULL, OPT_NO_FUSE },
+        { "no-idle",          no_argument,       NULL, OPT_NO_IDLE },
+        { "json",             no_argument,       NULL, OPT_JSON },
+        { "load-state",       required_argument, NULL, OPT_LOAD_STATE },
+        { "save-state",       required_argument, NULL, OPT_SAVE_STATE },
+        { "seed",             required_argument, NULL, OPT_SEED },
+        { "quirks",           required_argument, NULL, OPT_QUIRKS },
+        { "profile",          required_argument, NULL, OPT_PROFILE },
+        { "trace",            required_argument, NULL, OPT_TRACE },
+        { "pack",             required_argument, NULL, OPT_PACK },
+        { "capture",          required_argument, NULL, OPT_CAPTURE },
+        { "wav",              required_argument, NULL, OPT_WAV },
+        { NULL, 0, NULL, 0 }
+    };
+    headless_options_t options = {
+        .cycles = UINT64_MAX,
+        .frames = UINT64_MAX,
+        .instructions_per_frame = DEFAULT_IPF,
+        .ipf_set = false,
+        .dump_framebuffer = false,
+        .stats = false,
+        .fuse = true,
+        .skip_idle = true,
+        .json = false,
+        .load_state = NULL,
+        .save_state = NULL,
+        .seed = time(NULL),
+        .quirks = NULL,
+        .profile = NULL,
+        .trace = NULL,
+        .pack = NULL,
+        .capture = NULL,
+        .wav = NULL,
+        .rom = NULL
+    };
+    bool limited = false;
+    uint64_t count;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case OPT_CYCLES:
+                count = cli_parse_count(optarg, usage, argv[0]);
+                options.cycles = min(options.cycles, count);
+                limited = true;
+                break;
+            case OPT_FRAMES:
+                options.frames = min(options.frames, cli_parse_count(optarg, usage, argv[0]));
+                limited = true;
+                break;
+            case OPT_IPF:
+                count = cli_parse_count(optarg, usage, argv[0]);
+                if (count == 0 || count > UINT32_MAX) {
+                    fprintf(stderr, "error: --ipf must be between 1 and %u\n", UINT32_MAX);
+                    usage(argv[0]);
+                }
+                options.instructions_per_frame = count;
+                options.ipf_set = true;
+                break;
+            case OPT_DUMP:
+                options.dump_framebuffer = true;
+                break;
+            case OPT_STATS:
+                options.stats = true;
+                break;
+            case OPT_NO_FUSE:
+                options.fuse = false;
+                break;
+            case OPT_NO_IDLE:
+                options.skip_idle = false;
+                break;
+            case OPT_JSON:
+                options.json = true;
+                break;
+            case OPT_LOAD_STATE:
+                options.load_state = optarg;
+                break;
+            case OPT_SAVE_STATE:
+                options.save_state = optarg;
+                break;
+            case OPT_SEED:
+                options.seed = cli_parse_count(optarg, usage, argv[0]);
+                break;
+            case OPT_QUIRKS:
+                options.quirks = optarg;
+                break;
+            case OPT_PROFILE:
+                #ifndef PROFILER
+                    fprintf(stderr, "error: --profile needs a build with PROFILER=1\n");
+                    exit(1);
+                #endif
+                options.profile = optarg;
+                break;
+            case OPT_TRACE:
+                #ifndef TRACE
+                    fprintf(stderr, "error: --trace needs a build with TRACE=1\n");
+                    exit(1);
+                #endif
+                options.trace = optarg;
+                break;
+            case OPT_PACK:
+                options.pack = optarg;
+                break;
+            case OPT_CAPTURE:
+                options.capture = optarg;
+                break;
+            case OPT_WAV:
+                options.wav = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || !limited) {
+        usage(argv[0]);
+    }
+    options.rom = argv[optind];
+    return options;
+}
+
+static double elapsed_seconds(struct timespec start, struct timespec end)
+{
+    return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static long peak_rss_kb()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+    return usage.ru_maxrss; // kilobytes on linux
+}
+
+static void print_stats(emu_state_t* state, headless_options_t* options, headless_result_t* result)
+{
+    fprintf(stderr, "ROM: %s (%s engine)\n", options->rom, ENGINE_NAME);
+    fprintf(stderr, "ROM hash: %016llx, quirks: %s\n", (unsigned long long) result->rom_hash, quirks_name(state->profile));
+    fprintf(stderr, "Cycles: %llu\n", (unsigned long long) result->cycles);
+    fprintf(stderr, "Frames: %llu (%u instructions each)\n",
+        (unsigned long long) result->frames, options->instructions_per_frame);
+    fprintf(stderr, "Seconds: %.6f\n", result->seconds);
+    // rates count interpreted instructions only, a skipped idle loop costs next to nothing
+    uint64_t interpreted = result->cycles - result->idle_cycles;
+    fprintf(stderr, "Interpreted: %llu\n", (unsigned long long) interpreted);
+    if (result->seconds > 0 && interpreted > 0) {
+        fprintf(stderr, "Instructions/sec: %.0f\n", interpreted / result->seconds);
+        fprintf(stderr, "ns/instruction: %.3f\n", result->seconds * 1e9 / interpreted);
+    }
+    fprintf(stderr, "Peak RSS: %ld KB\n", result->peak_rss_kb);
+    fprintf(stderr, "Idle cycles skipped: %llu\n", (unsigned long long) result->idle_cycles);
+    if (result->key_wait) {
+        fprintf(stderr, "Stopped early: waiting for a key at %03x\n", state->pc - 2);
+    }
+    decode_report_fusions(state, stderr);
+}
+
+static void print_json(emu_state_t* state, headless_options_t* options, headless_result_t* result)
+{
+    uint64_t interpreted = result->cycles - result->idle_cycles;
+    double ips = result->seconds > 0 ? interpreted / result->seconds : 0;
+    double ns = interpreted > 0 ? result->seconds * 1e9 / interpreted : 0;
+    printf("{\"rom\": ");
+    cli_print_json_string(options->rom, stdout);
+    printf(", \"engine\": \"%s\", \"quirks\": \"%s\", \"fused\": %s, \"cycles\": %llu, \"seconds\": %.6f",
+        ENGINE_NAME, quirks_name(state->profile), options->fuse ? "true" : "false", (unsigned long long) result->cycles, result->seconds);
+    printf(", \"interpreted_cycles\": %llu, \"frames\": %llu, \"instructions_per_frame\": %u",
+        (unsigned long long) interpreted, (unsigned long long) result->frames, options->instructions_per_frame);
+    printf(", \"instructions_per_second\": %.0f, \"ns_per_instruction\": %.3f, \"peak_rss_kb\": %ld",
+        ips, ns, result->peak_rss_kb);
+    printf(", \"idle_cycles\": %llu, \"key_wait\": %s",
+        (unsigned long long) result->idle_cycles, result->key_wait ? "true" : "false");
+    printf(", \"fusions\": [");
+    for (int kind = 0; kind < FUSION_KINDS; kind++) {
+        printf("%s%llu", kind ? ", " : "", (unsigned long long) state->fusions[kind]);
+    }
+    printf("]}\n");
+}
+
+int main(int argc, char** argv)
+{
+    headless_options_t options = parse_options(argc, argv);
+
+    emu_state_t* state = state_new();
+    if (state == NULL) {
+        exit(1);
+    }
+    state_init(state);
+    state_seed(state, options.seed); // seed rng for RND instruction
+    size_t rom_size;
+    const uint8_t* rom;
+    uint8_t* rom_file = NULL;
+    rom_pack_t* pack = NULL;
+    pack_entry_t entry;
+    if (options.pack != NULL) {
+        pack = pack_open(options.pack);
+        if (pack == NULL || !pack_lookup(pack, options.rom, &entry)) {
+            exit(1);
+        }
+        rom = entry.data;
+        rom_size = entry.size;
+        if (!options.ipf_set && entry.instructions_per_frame != 0) {
+            options.instructions_per_frame = entry.instructions_per_frame;
+        }
+    } else {
+        rom_file = read_rom(options.rom, &rom_size);
+        rom = rom_file;
+    }
+    if (rom == NULL || !rom_to_mem(state, rom, rom_size, ROM_START)) {
+        exit(1);
+    }
+    options.cycles = min(options.cycles, cli_frame_cycles(options.frames, options.instructions_per_frame));
+    // an explicit profile wins over the pack, which wins over the ROM database
+    quirk_profile_t profile = PROFILE_DEFAULT;
+    if (options.quirks != NULL && !quirks_parse(options.quirks, &profile)) {
+        fprintf(stderr, "error: unknown quirk profile %s\n", options.quirks);
+        usage(argv[0]);
+    } else if (options.quirks == NULL && pack != NULL) {
+        profile = entry.profile;
+    } else if (options.quirks == NULL) {
+        quirks_lookup(QUIRKS_DATABASE, rom, rom_size, &profile);
+    }
+    state_set_profile(state, profile);
+    uint64_t rom_hash = quirks_rom_hash(rom, rom_size);
+    free(rom_file);
+    pack_close(pack);
+    state_snapshot_t snapshot;
+    if (options.load_state != NULL) {
+        if (!snapshot_load(&snapshot, options.load_state)) {
+            exit(1);
+        }
+        if (options.quirks != NULL && snapshot.profile != profile) {
+            fprintf(stderr, "error: %s was saved with --quirks %s\n", options.load_state, quirks_name(snapshot.profile));
+            exit(1);
+        }
+        state_restore(state, &snapshot); // runs under the snapshot's profile
+    }
+    state->skip_idle = options.skip_idle;
+    if (options.fuse) {
+        decode_fuse(state, ROM_START, MEM_SIZE);
+    }
+    #ifdef JIT
+        jit_t* jit = jit_new();
+        if (jit == NULL) {
+            exit(1);
+        }
+        jit_attach(jit, state);
+    #endif
+    profiler_t* profiler = NULL;
+    if (options.profile != NULL) {
+        profiler = profiler_new();
+        if (profiler == NULL) {
+            exit(1);
+        }
+        profiler_attach(profiler, state);
+    }
+    trace_t* trace = NULL;
+    if (options.trace != NULL) {
+        trace = trace_open(options.trace);
+        if (trace == NULL) {
+            exit(1);
+        }
+        trace_attach(trace, state);
+    }
+
+    scheduler_t scheduler;
+    scheduler_init(&scheduler, options.instructions_per_frame, false);
+    capture_t* capture = NULL;
+    if (options.capture != NULL) {
+        capture = capture_open(options.capture);
+        if (capture == NULL) {
+            exit(1);
+        }
+        capture_attach(capture, &scheduler);
+    }
+    audio_t* audio = NULL;
+    if (options.wav != NULL) {
+        audio = audio_open_wav(options.wav);
+        if (audio == NULL) {
+            exit(1);
+        }
+        audio_attach(audio, &scheduler);
+    }
+
+    uint64_t idle_before = state->idle_cycles;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = scheduler_run(&scheduler, state, options.cycles);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!trace_close(trace)) {
+        exit(1);
+    }
+    state->trace = NULL;
+    if (!capture_close(capture) || !audio_close(audio)) {
+        exit(1);
+    }
+
+    if (options.dump_framebuffer) {
+        dump_framebuffer(state, stdout);
+    }
+    if (options.save_state != NULL) {
+        state_snapshot(state, &snapshot);
+        if (!snapshot_save(&snapshot, options.save_state)) {
+            exit(1);
+        }
+    }
+    headless_result_t result = {
+        .rom_hash = rom_hash,
+        .seconds = elapsed_seconds(start, end),
+        .cycles = scheduler.cycles,
+        .idle_cycles = state->idle_cycles - idle_before,
+        .frames = scheduler.frames,
+        .key_wait = status == CYCLE_KEY_WAIT,
+        .peak_rss_kb = peak_rss_kb()
+    };
+    if (options.stats) {
+        print_stats(state, &options, &result);
+    }
+    if (options.json) {
+        print_json(state, &options, &result);
+    }
+    if (profiler != NULL && !profiler_save(profiler, state, options.profile)) {
+        exit(1);
+    }
+
+    state_delete(state);
+    profiler_delete(profiler);
+    #ifdef JIT
+        jit_delete(jit);
+    #endif
+    return status == CYCLE_KEY_WAIT ? 0 : status;
+}
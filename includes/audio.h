@@ -0,0 +1,56 @@
+#ifndef __AUDIO_H
+#define __AUDIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "scheduler.h"
+#include "state.h"
+
+
+#define AUDIO_RATE       48000 // samples per second asked of the device, and written to WAV files
+#define AUDIO_BUFFER     512   // samples per device callback, ~10.7ms at AUDIO_RATE, under a frame
+#define AUDIO_TONE_HZ    440
+#define AUDIO_AMPLITUDE  0x1800 // of the square wave, well clear of clipping
+#define AUDIO_RING_SIZE  0x40  // frames of gate events, a power of two
+#define AUDIO_CACHE_LINE 0x40
+#define AUDIO_LATENCY_UNBOUNDED UINT32_MAX // play every frame in full however far behind (WAV files)
+
+/*
+    Turns the sound timer into a square wave. The emulation thread pushes one
+    gate (sound timer non-zero) per frame into a single-producer single-consumer
+    ring, and whoever wants samples (the SDL audio callback, or the WAV writer
+    on the emulation thread itself) plays each gate for a frame's worth of them.
+    Neither side locks or waits: a full ring drops the gate and an empty one
+    holds the last for a frame, then goes quiet.
+*/
+typedef struct audio {
+    uint8_t ring[AUDIO_RING_SIZE];
+    // written by the producer only, on its own line so the consumer's stores don't bounce it
+    uint32_t head __attribute__((aligned(AUDIO_CACHE_LINE)));
+    // everything below belongs to the consumer
+    uint32_t tail __attribute__((aligned(AUDIO_CACHE_LINE)));
+    uint32_t rate;
+    uint32_t frame_samples; // samples a gate plays for
+    uint32_t latency;       // samples of queued gates allowed ahead of the one playing
+    uint32_t frame_left;    // samples the current gate has left
+    uint32_t phase;         // of the square wave, a full period is 2^32
+    uint32_t phase_step;
+    bool gate;
+    bool stale;             // the current gate is being held through an underrun
+    FILE* wav;              // NULL unless writing a WAV file, which consumes on the emulation thread
+    uint64_t wav_samples;
+    bool failed;            // a WAV write went wrong, reported at audio_close
+} audio_t;
+
+audio_t* audio_new(uint32_t rate, uint32_t latency);
+audio_t* audio_open_wav(const char* filename);
+void audio_set_format(audio_t* audio, uint32_t rate, uint32_t latency);
+void audio_attach(audio_t* audio, scheduler_t* scheduler);
+void audio_frame(audio_t* audio, emu_state_t* state);
+void audio_repeat(audio_t* audio, uint8_t sound_timer, uint64_t frames);
+void audio_render(audio_t* audio, int16_t* samples, uint32_t count);
+bool audio_close(audio_t* audio);
+
+
+#endif // __AUDIO_H
@@ -0,0 +1,58 @@
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "scheduler.h"
+#include "snapshot.h"
+#include "state.h"
+
+
+#define CAPTURE_MAGIC       "C8FB"
+#define CAPTURE_VERSION     1
+#define CAPTURE_HEADER_SIZE 7 // magic, version, width, height
+#define CAPTURE_WIDTH       0x40 // a display row is one 64-bit word
+#define CAPTURE_FRAME_BYTES (DISPLAY_ROWS * 8) // a frame, 8 pixels wide columns of DISPLAY_ROWS bytes
+#define CAPTURE_DELTA_MAX   (CAPTURE_FRAME_BYTES + CAPTURE_FRAME_BYTES / SNAPSHOT_RUN_MAX + 1) // worst case, all literals
+
+/*
+    Records the display once per frame. Each time the picture changes, the XOR
+    of it against the previous picture is written RLE-encoded, followed later by
+    the number of frames it stayed on screen, so unchanged frames cost nothing.
+*/
+typedef struct capture {
+    FILE* fp;
+    uint64_t previous[DISPLAY_ROWS]; // the picture on screen, blank before the first frame
+    uint64_t shown;   // frames it has been on screen, 0 before the first frame
+    uint64_t frames;  // all frames recorded
+    uint64_t changes; // pictures written
+    bool failed;      // a write went wrong, reported at capture_close
+    uint8_t delta[CAPTURE_FRAME_BYTES];
+    uint8_t encoded[CAPTURE_DELTA_MAX];
+} capture_t;
+
+/*
+    Plays a capture back frame by frame.
+*/
+typedef struct capture_reader {
+    FILE* fp;
+    uint64_t display[DISPLAY_ROWS];
+    uint64_t remaining; // frames the current picture has left
+    uint64_t frame;     // frames read so far
+    bool changed;       // the last frame read put up a new picture
+    uint8_t delta[CAPTURE_FRAME_BYTES];
+    uint8_t encoded[CAPTURE_DELTA_MAX];
+} capture_reader_t;
+
+capture_t* capture_open(const char* filename);
+void capture_attach(capture_t* capture, scheduler_t* scheduler);
+void capture_frame(capture_t* capture, emu_state_t* state);
+void capture_repeat(capture_t* capture, emu_state_t* state, uint64_t frames);
+bool capture_close(capture_t* capture);
+bool capture_reader_open(capture_reader_t* reader, const char* filename);
+int capture_read(capture_reader_t* reader);
+void capture_reader_close(capture_reader_t* reader);
+
+
+#endif // __CAPTURE_H
@@ -0,0 +1,18 @@
+#ifndef __CLI_H
+#define __CLI_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+
+/*
+    Prints a program's usage and exits, as each command line tool defines it.
+*/
+typedef void (*cli_usage_fn)(char* program);
+
+uint64_t cli_parse_count(const char* text, cli_usage_fn usage, char* program);
+uint64_t cli_frame_cycles(uint64_t frames, uint32_t instructions_per_frame);
+void cli_print_json_string(const char* text, FILE* out);
+
+
+#endif // __CLI_H
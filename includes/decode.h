@@ -0,0 +1,92 @@
+#ifndef __DECODE_H
+#define __DECODE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "state.h"
+
+
+/*
+    Operand accessors for a predecoded instruction.
+    kk holds the low byte of the instruction, so n and nnn can be rebuilt from it.
+*/
+#define DECODED_N(instr)   ((instr).kk & 0xf)
+#define DECODED_NNN(instr) ((uint16_t)(((instr).x << 8) | (instr).kk))
+
+typedef enum opcode_id {
+    OP_UNDECODED = 0, // empty cache slot, must stay zero so memset invalidates
+    OP_NOP,
+    OP_CLS,       // 00E0
+    OP_RET,       // 00EE
+    OP_JP,        // 1nnn
+    OP_CALL,      // 2nnn
+    OP_SE_BYTE,   // 3xkk
+    OP_SNE_BYTE,  // 4xkk
+    OP_SE_REG,    // 5xy0
+    OP_LD_BYTE,   // 6xkk
+    OP_ADD_BYTE,  // 7xkk
+    OP_LD_REG,    // 8xy0
+    OP_OR,        // 8xy1
+    OP_AND,       // 8xy2
+    OP_XOR,       // 8xy3
+    OP_ADD_REG,   // 8xy4
+    OP_SUB,       // 8xy5
+    OP_SHR,       // 8xy6
+    OP_SUBN,      // 8xy7
+    OP_SHL,       // 8xyE
+    OP_SNE_REG,   // 9xy0
+    OP_LD_I,      // Annn
+    OP_JP_V0,     // Bnnn
+    OP_RND,       // Cxkk
+    OP_DRW,       // Dxyn
+    OP_SKP,       // Ex9E
+    OP_SKNP,      // ExA1
+    OP_LD_VX_DT,  // Fx07
+    OP_LD_VX_K,   // Fx0A
+    OP_LD_DT_VX,  // Fx15
+    OP_LD_ST_VX,  // Fx18
+    OP_ADD_I_VX,  // Fx1E
+    OP_LD_F_VX,   // Fx29
+    OP_LD_B_VX,   // Fx33
+    OP_LD_MEM_VX, // Fx55
+    OP_LD_VX_MEM, // Fx65
+
+    // superinstructions, built by decode_fuse; the second half is the plain op in the next slot
+    OP_LD_BYTE_DRW, // 6xkk + Dxyn
+    OP_LD_I_DRW,    // Annn + Dxyn
+    OP_LD_DT_SE,    // Fx07 + 3xkk
+    OP_ADD_BYTE_SE, // 7xkk + 3xkk
+    OP_COUNT
+} opcode_id_t;
+
+#define OP_FUSED_FIRST OP_LD_BYTE_DRW
+
+_Static_assert(OP_COUNT - OP_FUSED_FIRST == FUSION_KINDS, "FUSION_KINDS out of sync with opcode_id_t");
+
+decoded_instr_t decode_instruction(uint16_t instruction);
+void decode_invalidate(emu_state_t* state, uint16_t address, uint16_t length);
+void decode_fuse(emu_state_t* state, uint16_t start, uint16_t end);
+void decode_report_fusions(emu_state_t* state, FILE* out);
+
+/*
+    Returns the predecoded instruction at address, filling its cache slot on a miss.
+    Odd or out of range addresses bypass the cache and are decoded every time;
+    out of range ones wrap around memory.
+*/
+static inline decoded_instr_t decode_fetch(emu_state_t* state, uint16_t address)
+{
+    uint16_t slot = address >> 1;
+    if ((address & 1) == 0 && slot < DECODE_CACHE_SIZE) {
+        decoded_instr_t cached = state->decode_cache[slot];
+        if (__builtin_expect(cached.op != OP_UNDECODED, 1)) {
+            return cached;
+        }
+        cached = decode_instruction((state->memory[address] << 8) | state->memory[address + 1]);
+        state->decode_cache[slot] = cached;
+        return cached;
+    }
+    address &= MEMORY_MASK;
+    return decode_instruction((state->memory[address] << 8) | state->memory[(address + 1) & MEMORY_MASK]);
+}
+
+#endif // __DECODE_H
@@ -0,0 +1,247 @@
+/*
+One copy of the interpreter, included by state.c once per quirk profile with
+    QUIRKS    the profile's QUIRK_* flags, a constant
+    RUN_NAME  the name of the run function to define
+No include guard, on purpose. It uses state.c's handlers, so it only builds there.
+Callers have already checked the state and that no key wait is pending.
+The instructions actually retired go to *executed, which is short of cycles when
+Fx0A stops the run (the Fx0A itself counts).
+PROFILE_* and TRACE_* are the profiler's and tracer's hooks, empty unless built with them.
+*/
+
+#ifdef DISPATCH_THREADED
+
+/*
+    Direct-threaded engine: every handler ends with its own indirect jump to the next
+    handler (GCC labels-as-values), so each op gets its own branch history instead of
+    sharing one switch dispatch.
+*/
+static int RUN_NAME(emu_state_t* state, uint64_t cycles, uint64_t* executed)
+{
+    static void* const dispatch_table[OP_COUNT] = {
+        [OP_UNDECODED]   = &&op_nop,
+        [OP_NOP]         = &&op_nop,
+        [OP_CLS]         = &&op_cls,
+        [OP_RET]         = &&op_ret,
+        [OP_JP]          = &&op_jp,
+        [OP_CALL]        = &&op_call,
+        [OP_SE_BYTE]     = &&op_se_byte,
+        [OP_SNE_BYTE]    = &&op_sne_byte,
+        [OP_SE_REG]      = &&op_se_reg,
+        [OP_LD_BYTE]     = &&op_ld_byte,
+        [OP_ADD_BYTE]    = &&op_add_byte,
+        [OP_LD_REG]      = &&op_ld_reg,
+        [OP_OR]          = &&op_or,
+        [OP_AND]         = &&op_and,
+        [OP_XOR]         = &&op_xor,
+        [OP_ADD_REG]     = &&op_add_reg,
+        [OP_SUB]         = &&op_sub,
+        [OP_SHR]         = &&op_shr,
+        [OP_SUBN]        = &&op_subn,
+        [OP_SHL]         = &&op_shl,
+        [OP_SNE_REG]     = &&op_sne_reg,
+        [OP_LD_I]        = &&op_ld_i,
+        [OP_JP_V0]       = &&op_jp_v0,
+        [OP_RND]         = &&op_rnd,
+        [OP_DRW]         = &&op_drw,
+        [OP_SKP]         = &&op_skp,
+        [OP_SKNP]        = &&op_sknp,
+        [OP_LD_VX_DT]    = &&op_ld_vx_dt,
+        [OP_LD_VX_K]     = &&op_ld_vx_k,
+        [OP_LD_DT_VX]    = &&op_ld_dt_vx,
+        [OP_LD_ST_VX]    = &&op_ld_st_vx,
+        [OP_ADD_I_VX]    = &&op_add_i_vx,
+        [OP_LD_F_VX]     = &&op_ld_f_vx,
+        [OP_LD_B_VX]     = &&op_ld_b_vx,
+        [OP_LD_MEM_VX]   = &&op_ld_mem_vx,
+        [OP_LD_VX_MEM]   = &&op_ld_vx_mem,
+        [OP_LD_BYTE_DRW] = &&op_fused,
+        [OP_LD_I_DRW]    = &&op_fused,
+        [OP_LD_DT_SE]    = &&op_fused,
+        [OP_ADD_BYTE_SE] = &&op_fused,
+    };
+    decoded_instr_t instr;
+    uint64_t budget = cycles;
+
+    #define DISPATCH() \
+        do { \
+            if (cycles-- == 0) { \
+                PROFILE_STOP(state); \
+                TRACE_STOP(state); \
+                *executed = budget; \
+                return CYCLE_SUCCESS; \
+            } \
+            instr = decode_fetch(state, state->pc); \
+            PROFILE_STEP(state, state->pc, instr); \
+            TRACE_STEP(state, state->pc, instr); \
+            state->pc += 2; \
+            goto *dispatch_table[instr.op]; \
+        } while (0)
+
+    DISPATCH();
+
+    op_nop:
+        exec_nop(state, instr);
+        DISPATCH();
+    op_cls:
+        exec_cls(state, instr);
+        DISPATCH();
+    op_ret:
+        exec_ret(state, instr);
+        DISPATCH();
+    op_jp:
+        cycles -= skip_idle(state, state->pc - 2, DECODED_NNN(instr), cycles);
+        exec_jp(state, instr);
+        DISPATCH();
+    op_call:
+        exec_call(state, instr);
+        DISPATCH();
+    op_se_byte:
+        exec_se_byte(state, instr);
+        DISPATCH();
+    op_sne_byte:
+        exec_sne_byte(state, instr);
+        DISPATCH();
+    op_se_reg:
+        exec_se_reg(state, instr);
+        DISPATCH();
+    op_ld_byte:
+        exec_ld_byte(state, instr);
+        DISPATCH();
+    op_add_byte:
+        exec_add_byte(state, instr);
+        DISPATCH();
+    op_ld_reg:
+        exec_ld_reg(state, instr);
+        DISPATCH();
+    op_or:
+        exec_or(state, instr, QUIRKS);
+        DISPATCH();
+    op_and:
+        exec_and(state, instr, QUIRKS);
+        DISPATCH();
+    op_xor:
+        exec_xor(state, instr, QUIRKS);
+        DISPATCH();
+    op_add_reg:
+        exec_add_reg(state, instr);
+        DISPATCH();
+    op_sub:
+        exec_sub(state, instr);
+        DISPATCH();
+    op_shr:
+        exec_shr(state, instr, QUIRKS);
+        DISPATCH();
+    op_subn:
+        exec_subn(state, instr);
+        DISPATCH();
+    op_shl:
+        exec_shl(state, instr, QUIRKS);
+        DISPATCH();
+    op_sne_reg:
+        exec_sne_reg(state, instr);
+        DISPATCH();
+    op_ld_i:
+        exec_ld_i(state, instr);
+        DISPATCH();
+    op_jp_v0:
+        exec_jp_v0(state, instr, QUIRKS);
+        DISPATCH();
+    op_rnd:
+        exec_rnd(state, instr);
+        DISPATCH();
+    op_drw:
+        exec_drw(state, instr);
+        DISPATCH();
+    op_skp:
+        exec_skp(state, instr);
+        DISPATCH();
+    op_sknp:
+        exec_sknp(state, instr);
+        DISPATCH();
+    op_ld_vx_dt:
+        exec_ld_vx_dt(state, instr);
+        DISPATCH();
+    op_ld_vx_k:
+        exec_ld_vx_k(state, instr);
+        PROFILE_STOP(state);
+        TRACE_STOP(state);
+        *executed = budget - cycles; // DISPATCH already took this instruction's cycle
+        return CYCLE_KEY_WAIT;
+    op_ld_dt_vx:
+        exec_ld_dt_vx(state, instr);
+        DISPATCH();
+    op_ld_st_vx:
+        exec_ld_st_vx(state, instr);
+        DISPATCH();
+    op_add_i_vx:
+        exec_add_i_vx(state, instr);
+        DISPATCH();
+    op_ld_f_vx:
+        exec_ld_f_vx(state, instr);
+        DISPATCH();
+    op_ld_b_vx:
+        exec_ld_b_vx(state, instr);
+        DISPATCH();
+    op_ld_mem_vx:
+        exec_ld_mem_vx(state, instr, QUIRKS);
+        DISPATCH();
+    op_ld_vx_mem:
+        exec_ld_vx_mem(state, instr, QUIRKS);
+        DISPATCH();
+    op_fused:
+        if (cycles == 0) {
+            exec_decoded(state, instr, QUIRKS);
+            DISPATCH();
+        }
+        cycles--;
+        exec_fused(state, instr, QUIRKS);
+        DISPATCH();
+
+    #undef DISPATCH
+}
+
+#else
+
+/*
+    Switch engine: one switch over predecoded instructions, taking superinstructions
+    whole when at least two cycles remain.
+*/
+static int RUN_NAME(emu_state_t* state, uint64_t cycles, uint64_t* executed)
+{
+    uint64_t budget = cycles;
+    while (cycles > 0) {
+        uint16_t pc = state->pc;
+        decoded_instr_t instr = decode_fetch(state, pc);
+        PROFILE_STEP(state, pc, instr);
+        TRACE_STEP(state, pc, instr);
+        state->pc = pc + 2;
+        if (instr.op == OP_JP) {
+            cycles -= 1 + skip_idle(state, pc, DECODED_NNN(instr), cycles - 1);
+            exec_jp(state, instr);
+            continue;
+        }
+        if (instr.op >= OP_FUSED_FIRST && cycles >= 2) {
+            exec_fused(state, instr, QUIRKS);
+            cycles -= 2;
+            continue;
+        }
+        exec_decoded(state, instr, QUIRKS);
+        if (instr.op == OP_LD_VX_K) {
+            PROFILE_STOP(state);
+            TRACE_STOP(state);
+            *executed = budget - cycles + 1;
+            return CYCLE_KEY_WAIT;
+        }
+        cycles--;
+    }
+    PROFILE_STOP(state);
+    TRACE_STOP(state);
+    *executed = budget;
+    return CYCLE_SUCCESS;
+}
+
+#endif // DISPATCH_THREADED
+
+#undef QUIRKS
+#undef RUN_NAME
@@ -1,7 +1,10 @@
 #ifndef __EMU_H
 #define __EMU_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include "state.h"
 #ifdef DEBUG
     #include <ncurses.h>
@@ -14,11 +17,11 @@
 #define BYTES_PER_LINE 0x10
 #define DISPLAY_HEIGHT 0x20
 #define DISPLAY_WIDTH  0x40
-#define CYCLE_DELAY    0x00
 #define KRED  "\x1B[31m"
 #define RESET "\033[0m"
 #define MESSAGE_DELAY 5000 // milliseconds
 #define SDL_SCALE 10
+#define KEY_WAIT_IDLE_MS 1000 // longest the front end sleeps in Fx0A before checking in
 
 
 #define max(a,b) \
@@ -33,7 +36,10 @@
 
 
 
-void file_to_mem(emu_state_t* state, char* filename, uint16_t address);
+bool rom_to_mem(emu_state_t* state, const uint8_t* rom, size_t size, uint16_t address);
+uint8_t* read_rom(char* filename, size_t* size);
+bool file_to_mem(emu_state_t* state, char* filename, uint16_t address);
+void dump_framebuffer(emu_state_t* state, FILE* out);
 
 #ifdef DEBUG
 	void debug_mem(emu_state_t* state, uint16_t start, uint16_t end);
@@ -43,6 +49,7 @@ void file_to_mem(emu_state_t* state, char* filename, uint16_t address);
 	void curse_graphics(emu_state_t* state);
 	void curse_state(emu_state_t* state);
 	void curse_memory(emu_state_t* state, int start_offset);
+	uint8_t curse_keypad_key(int c, const char* keymap);
 	void curse_clearlines(int start_row, int inclusive_end_row, int column);
 #endif
 
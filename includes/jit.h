@@ -0,0 +1,21 @@
+#ifndef __JIT_H
+#define __JIT_H
+
+#include <stdint.h>
+#include "state.h"
+
+
+#define JIT_CODE_SIZE     0x100000 // bytes of executable memory per jit
+#define JIT_BLOCK_MAX     0x20     // instructions per translated block
+#define JIT_HOT_THRESHOLD 0x10     // executions of a pc before it is translated
+
+typedef struct jit jit_t;
+
+jit_t* jit_new();
+void jit_attach(jit_t* jit, emu_state_t* state);
+int jit_run(jit_t* jit, emu_state_t* state, uint64_t cycles, uint64_t* executed);
+void jit_invalidate(jit_t* jit, uint16_t address, uint16_t length);
+void jit_delete(jit_t* jit);
+
+
+#endif // __JIT_H
@@ -0,0 +1,85 @@
+#ifndef __LOCKSTEP_H
+#define __LOCKSTEP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "state.h"
+
+
+#define LOCKSTEP_VECTOR 32 // lanes per vector step, one AVX2 register of 8-bit registers
+#define LOCKSTEP_LANES  64 // lanes per batch emu_batch --lockstep uses
+#define LOCKSTEP_MIN_GROUP 16 // fewer lanes at one pc run scalar instead; narrower vector steps cost more than they save
+
+/*
+    Many instances of one ROM stored as a structure of arrays: register r of lane l
+    is registers[r * stride + l], so one register of every lane is contiguous and a
+    whole row of lanes runs one instruction as a vector operation.
+    Each run starts with the lanes at the most common pc as the group, which steps
+    as vectors. Lanes elsewhere, or that split off the group on the way, park
+    where they are and join the group again if it gets to their pc; whatever is
+    left over runs one by one once the group is done. Every lane counts down its
+    own share of the run, so joining late changes nothing. Idle loops are skipped
+    for the group as a whole, for lanes on their own one by one, and for whole
+    frames at once by lockstep_skip_idle_frames, or lane by lane by
+    lockstep_rest_idle_lanes; each lane skips exactly what it would in a normal
+    run, and counts it in idle. Dirty rows and fusions aren't tracked,
+    so lockstep_extract marks the whole display dirty.
+*/
+typedef struct lockstep {
+    size_t capacity; // lanes allocated, a multiple of LOCKSTEP_VECTOR
+    size_t lanes;    // lanes in use since lockstep_init, the rest stay parked
+    size_t stride;   // lanes per row of the arrays below, capacity
+    uint8_t* registers; // [0x10][stride]
+    uint16_t* index;
+    uint16_t* pc;
+    uint16_t* sp;
+    uint8_t* delay_timer;
+    uint8_t* sound_timer;
+    uint8_t* keys; // [0x10][stride]
+    rng_t* rng;
+    uint8_t* key_wait_register;
+    uint8_t* key_wait_key;
+    uint64_t* display; // [DISPLAY_ROWS][stride]
+    uint8_t* memory;   // [capacity][0x1000], lane by lane; only scalar ops touch it
+    uint8_t* runnable; // 0xFF for lanes in use and not waiting at Fx0A, else 0
+    uint8_t* group;    // 0xFF for the lanes stepping as vectors in the current run
+    size_t group_size; // lanes in group
+    bool converged;    // every lane in group is at group_pc
+    uint16_t group_pc;
+    uint8_t image[0x1000]; // memory every lane starts from
+    uint64_t written[0x1000 / 64]; // bit per address some lane wrote since lockstep_load
+    decoded_instr_t decode_cache[DECODE_CACHE_SIZE]; // of image, valid where no lane wrote
+    uint32_t tally[0x1000]; // lanes per pc while regrouping, zero otherwise
+    uint64_t vector_cycles; // lane instructions run by vector steps
+    uint64_t scalar_cycles; // lane instructions run one lane at a time
+    uint64_t idle_cycles;   // lane instructions skipped in idle loops, see state.c
+    uint64_t* retired;      // [stride] instructions each lane retired since lockstep_init, as scheduler_t counts cycles
+    uint64_t* idle;         // [stride] of those, instructions each lane skipped in idle loops, as emu_state_t counts idle_cycles
+    uint8_t* resting;       // [stride] 0xFF for lanes lockstep_rest_idle_lanes lets skip the next run
+    uint64_t* left;         // [stride] instructions a lane outside the group has left in the current run
+    uint64_t* stop;         // [stride] clock at which a group lane's share of the current run ends
+    uint64_t clock;         // instructions the group ran or skipped in the current run
+    uint64_t next_stop;     // earliest stop in the group
+    uint8_t parked[0x1000]; // lanes outside the group waiting at each pc for it, zero otherwise
+    size_t busy_lane;       // lane last found outside an idle loop by lockstep_skip_idle_frames
+    quirk_profile_t profile;
+    uint32_t quirks; // QUIRK_* flags of profile
+} lockstep_t;
+
+lockstep_t* lockstep_new(size_t lanes);
+void lockstep_init(lockstep_t* batch, size_t lanes);
+bool lockstep_load(lockstep_t* batch, const uint8_t* rom, size_t size);
+void lockstep_delete(lockstep_t* batch);
+void lockstep_seed(lockstep_t* batch, size_t lane, uint64_t seed);
+void lockstep_set_profile(lockstep_t* batch, quirk_profile_t profile);
+void lockstep_set_key(lockstep_t* batch, size_t lane, uint8_t key, bool down);
+bool lockstep_waiting(lockstep_t* batch, size_t lane);
+int lockstep_run(lockstep_t* batch, uint64_t cycles);
+uint64_t lockstep_skip_idle_frames(lockstep_t* batch, uint64_t frames, uint32_t instructions_per_frame);
+void lockstep_rest_idle_lanes(lockstep_t* batch, uint32_t instructions_per_frame);
+void lockstep_tick_timers(lockstep_t* batch);
+void lockstep_extract(lockstep_t* batch, size_t lane, emu_state_t* state);
+
+
+#endif // __LOCKSTEP_H
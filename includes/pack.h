@@ -0,0 +1,67 @@
+#ifndef __PACK_H
+#define __PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "quirks.h"
+#include "state.h"
+
+
+#define PACK_MAGIC       "C8PK"
+#define PACK_VERSION     1
+#define PACK_HEADER_SIZE 0x10 // magic, version, entry size, count, reserved
+#define PACK_ENTRY_SIZE  0x28 // see pack_entry_t for the fields
+#define PACK_ROM_MAX     (MEMORY_MASK + 1 - ROM_START) // largest ROM that fits in memory
+#define PACK_NAME_MAX    0x100 // longest name, NUL included
+#define PACK_KEYS        0x10
+#define PACK_KEYMAP_DEFAULT "1234qwerasdfzxcv" // host keys, in keypad layout order: 123C 456D 789E A0BF
+
+/*
+    One ROM in a pack. A pack file is a header, an index of PACK_ENTRY_SIZE
+    entries sorted by hash, their numbers sorted by name, then the ROM images
+    and names the entries point at.
+    All numbers are little-endian:
+        0x00  hash     8  FNV-1a 64 of the image, as in QUIRKS_DATABASE
+        0x08  offset   4  of the image in the file
+        0x0c  size     2
+        0x0e  profile  1  quirk_profile_t
+        0x0f           1  reserved, 0
+        0x10  ipf      4  instructions per frame, 0 for the front end's default
+        0x14  name     4  offset of the NUL-terminated name
+        0x18  keymap  16  host key (a lowercase letter or digit) for each keypad
+                          key, in PACK_KEYMAP_DEFAULT's order; all 0 for that default
+*/
+typedef struct pack_entry {
+    uint64_t hash;
+    const uint8_t* data; // inside the mapping, valid until pack_close
+    size_t size;
+    quirk_profile_t profile;
+    uint32_t instructions_per_frame;
+    const char* name;
+    char keymap[PACK_KEYS]; // all 0 for the default layout
+} pack_entry_t;
+
+/*
+    A pack mapped read-only. Every entry is checked when it's opened, so reading
+    one is a few loads and loading its ROM a single memcpy.
+*/
+typedef struct rom_pack {
+    const uint8_t* data;
+    size_t size;
+    uint32_t count;
+    const uint8_t* names; // entry numbers in name order
+} rom_pack_t;
+
+rom_pack_t* pack_open(const char* filename);
+void pack_close(rom_pack_t* pack);
+void pack_entry(const rom_pack_t* pack, uint32_t index, pack_entry_t* entry);
+bool pack_find(const rom_pack_t* pack, uint64_t hash, pack_entry_t* entry);
+bool pack_find_name(const rom_pack_t* pack, const char* name, pack_entry_t* entry);
+bool pack_lookup(const rom_pack_t* pack, const char* rom, pack_entry_t* entry);
+bool pack_keymap_valid(const char* keymap);
+bool pack_load(emu_state_t* state, const pack_entry_t* entry);
+bool pack_write(const char* filename, pack_entry_t* entries, uint32_t count);
+
+
+#endif // __PACK_H
@@ -0,0 +1,17 @@
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <stddef.h>
+
+
+/*
+    Runs one task of a pool_run call; worker is the index of the thread running it,
+    for tasks that keep per-thread scratch (an emu_state_t to reuse, say).
+*/
+typedef void (*pool_task_fn)(void* context, size_t task, int worker);
+
+int pool_default_threads();
+int pool_run(size_t tasks, int threads, pool_task_fn fn, void* context);
+
+
+#endif // __POOL_H
@@ -0,0 +1,42 @@
+#ifndef __PRESENT_H
+#define __PRESENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "state.h"
+
+
+#define PRESENT_BUFFERS 3
+#define PRESENT_FRESH   0x4  // on the shared index while the consumer hasn't taken its frame
+#define PRESENT_INDEX   0x3
+
+/*
+    A finished frame as the emulation thread handed it over.
+*/
+typedef struct present_frame {
+    uint64_t display[DISPLAY_ROWS];
+    uint32_t dirty_rows; // rows changed since the last frame the consumer took
+    uint64_t frame;      // scheduler frame it was taken at
+} present_frame_t;
+
+/*
+    Triple buffer between the emulation thread, which publishes a frame every
+    60hz tick, and the render thread, which takes the newest whenever it's
+    ready to draw. Each side owns one buffer and they swap the third through
+    a single atomic index, so neither ever waits on the other.
+*/
+typedef struct present {
+    present_frame_t frames[PRESENT_BUFFERS];
+    uint32_t back;   // the emulation thread's, written next
+    uint32_t shared; // the latest finished frame, plus PRESENT_FRESH until it's taken
+    uint32_t front;  // the render thread's, being drawn
+    uint32_t unseen; // dirty rows of a published frame that may never be taken
+} present_t;
+
+void present_init(present_t* present);
+void present_publish(present_t* present, emu_state_t* state, uint64_t frame);
+bool present_fresh(present_t* present);
+const present_frame_t* present_take(present_t* present);
+
+
+#endif // __PRESENT_H
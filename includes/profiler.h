@@ -0,0 +1,148 @@
+#ifndef __PROFILER_H
+#define __PROFILER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
+#include "decode.h"
+#include "state.h"
+
+
+#define PROFILER_CLASSES    (OP_COUNT + 1) // opcode ids, plus translated blocks
+#define PROFILER_CLASS_JIT  OP_COUNT
+#define PROFILER_MAX_NODES  0x4000 // call paths tracked, calls past this are charged to the caller
+#define PROFILER_NO_NODE    UINT32_MAX
+#define PROFILER_REPORT_PCS 32 // hottest addresses listed in the report
+#define PROFILER_CALIBRATION_READS 0x100 // back-to-back timer reads to find what a read costs
+
+/*
+    One call path: the subroutines called to get here, innermost last.
+    Node 0 is the root, where the ROM started.
+*/
+typedef struct profiler_node {
+    uint16_t entry; // the subroutine's address
+    uint32_t parent;
+    uint32_t child;   // first callee, PROFILER_NO_NODE if none
+    uint32_t sibling; // next callee of parent
+    uint64_t ticks[PROFILER_CLASSES];
+} profiler_node_t;
+
+/*
+    Executions and host time per opcode class, per address and per call path.
+    Time is sampled once per dispatch: the ticks from one instruction's dispatch
+    to the next (or to leaving the engine) are charged to it, handler and
+    dispatch overhead together.
+*/
+typedef struct profiler {
+    uint64_t class_counts[PROFILER_CLASSES];
+    uint64_t class_ticks[PROFILER_CLASSES];
+    uint64_t pc_counts[MEMORY_MASK + 1];
+    uint64_t pc_ticks[MEMORY_MASK + 1];
+    uint64_t calls[MEMORY_MASK + 1]; // by subroutine address
+    profiler_node_t* nodes;
+    uint32_t node_count;
+    uint32_t node;      // current call path
+    uint32_t depth;     // calls from the root to node
+    uint32_t untracked; // calls below node that didn't get a node of their own
+    bool pending;       // an instruction is running, charged at the next step or stop
+    uint16_t pending_pc;
+    uint8_t pending_class;
+    uint32_t pending_node;
+    uint64_t started;
+    uint64_t overhead;    // ticks a timer read adds to every dispatch, for the report
+    uint64_t first_ticks; // with first_time, converts ticks to time in the report
+    struct timespec first_time;
+} profiler_t;
+
+profiler_t* profiler_new();
+void profiler_attach(profiler_t* profiler, emu_state_t* state);
+void profiler_call(profiler_t* profiler, emu_state_t* state, decoded_instr_t instr);
+void profiler_block(profiler_t* profiler, uint16_t pc, int length);
+void profiler_report(profiler_t* profiler, emu_state_t* state, FILE* out);
+void profiler_write_folded(profiler_t* profiler, FILE* out);
+bool profiler_save(profiler_t* profiler, emu_state_t* state, const char* filename);
+void profiler_delete(profiler_t* profiler);
+
+/*
+    Host time stamp: the TSC where there is one, nanoseconds otherwise.
+*/
+static inline uint64_t profiler_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+static inline void profiler_charge(profiler_t* profiler, uint64_t now)
+{
+    if (!profiler->pending) {
+        return;
+    }
+    uint64_t ticks = now - profiler->started;
+    profiler->class_ticks[profiler->pending_class] += ticks;
+    profiler->pc_ticks[profiler->pending_pc] += ticks;
+    profiler->nodes[profiler->pending_node].ticks[profiler->pending_class] += ticks;
+}
+
+/*
+    Called by the engines as each instruction is dispatched, before it runs;
+    class is its op id, or PROFILER_CLASS_JIT for a translated block.
+*/
+static inline void profiler_step(profiler_t* profiler, emu_state_t* state, uint16_t pc, decoded_instr_t instr, uint8_t class)
+{
+    if (profiler == NULL) {
+        return;
+    }
+    uint64_t now = profiler_ticks();
+    profiler_charge(profiler, now);
+    pc &= MEMORY_MASK;
+    profiler->class_counts[class]++;
+    profiler->pc_counts[pc]++;
+    profiler->pending = true;
+    profiler->pending_pc = pc;
+    profiler->pending_class = class;
+    profiler->pending_node = profiler->node; // a call is charged to its caller
+    profiler->started = now;
+    if (class == OP_CALL || class == OP_RET) {
+        profiler_call(profiler, state, instr);
+    }
+}
+
+/*
+    Called when an engine returns, so time outside it isn't charged to the last instruction.
+*/
+static inline void profiler_stop(profiler_t* profiler)
+{
+    if (profiler == NULL) {
+        return;
+    }
+    profiler_charge(profiler, profiler_ticks());
+    profiler->pending = false;
+}
+
+/*
+    Hooks for the engines, compiled out unless built with PROFILER=1.
+*/
+#ifdef PROFILER
+    #define PROFILE_STEP(state, pc, instr) profiler_step((state)->profiler, (state), (pc), (instr), (instr).op)
+    #define PROFILE_STOP(state)            profiler_stop((state)->profiler)
+    #define PROFILE_BLOCK(state, pc) \
+        profiler_step((state)->profiler, (state), (pc), (decoded_instr_t) { .op = OP_NOP }, PROFILER_CLASS_JIT)
+    #define PROFILE_BLOCK_DONE(state, pc, length) profiler_block((state)->profiler, (pc), (length))
+#else
+    #define PROFILE_STEP(state, pc, instr)
+    #define PROFILE_STOP(state)
+    #define PROFILE_BLOCK(state, pc)
+    #define PROFILE_BLOCK_DONE(state, pc, length)
+#endif
+
+
+#endif // __PROFILER_H
@@ -0,0 +1,44 @@
+#ifndef __QUIRKS_H
+#define __QUIRKS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define QUIRK_SHIFT_VY        0x01 // 8xy6/8xyE shift Vy into Vx, instead of shifting Vx in place
+#define QUIRK_INDEX_INCREMENT 0x02 // Fx55/Fx65 leave I past the last register, I += x + 1
+#define QUIRK_INDEX_ADD_X     0x04 // Fx55/Fx65 leave I one short of that, I += x
+#define QUIRK_JUMP_VX         0x08 // Bxnn jumps to xnn + Vx, instead of nnn + V0
+#define QUIRK_VF_RESET        0x10 // 8xy1/8xy2/8xy3 clear VF
+
+// what this emulator has always done: SUPER-CHIP shifts and memory, COSMAC jumps
+#define QUIRKS_DEFAULT 0
+#define QUIRKS_CHIP8   (QUIRK_SHIFT_VY | QUIRK_INDEX_INCREMENT | QUIRK_VF_RESET) // COSMAC VIP
+#define QUIRKS_CHIP48  (QUIRK_INDEX_ADD_X | QUIRK_JUMP_VX) // HP-48
+#define QUIRKS_SCHIP   (QUIRK_JUMP_VX) // SUPER-CHIP 1.1
+
+#define QUIRKS_DATABASE "roms/quirks.db" // ROM hash -> profile, see quirks.c
+#define QUIRKS_NAME_MAX 16
+
+/*
+    Platforms whose instructions behave differently. The interpreter is compiled
+    once per profile (state.c), so picking one costs nothing per instruction.
+*/
+typedef enum quirk_profile {
+    PROFILE_DEFAULT = 0,
+    PROFILE_CHIP8,
+    PROFILE_CHIP48,
+    PROFILE_SCHIP,
+    PROFILE_COUNT
+} quirk_profile_t;
+
+uint32_t quirks_flags(quirk_profile_t profile);
+const char* quirks_name(quirk_profile_t profile);
+bool quirks_parse(const char* name, quirk_profile_t* profile);
+uint64_t quirks_rom_hash(const uint8_t* rom, size_t size);
+bool quirks_lookup(const char* database, const uint8_t* rom, size_t size, quirk_profile_t* profile);
+bool quirks_lookup_file(const char* database, const char* rom_path, quirk_profile_t* profile);
+
+
+#endif // __QUIRKS_H
@@ -0,0 +1,54 @@
+#ifndef __REWIND_H
+#define __REWIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "snapshot.h"
+#include "state.h"
+
+
+#define REWIND_DEFAULT_SECONDS 300 // history the SDL front end keeps unless --rewind says otherwise
+#define REWIND_DEFAULT_BYTES   (4 << 20) // delta storage, the oldest frames go first when it fills
+#define REWIND_FRAME_BYTES     offsetof(state_snapshot_t, decode_cache) // machine fields a delta covers
+#define REWIND_DELTA_MAX       (REWIND_FRAME_BYTES + REWIND_FRAME_BYTES / SNAPSHOT_RUN_MAX + 1) // worst case, all literals
+
+/*
+    Where one frame's delta sits in the byte ring.
+*/
+typedef struct rewind_record {
+    uint32_t start;
+    uint32_t length;
+} rewind_record_t;
+
+/*
+    Fixed-size history of recorded frames, newest last. Only the newest frame is
+    kept whole; every other frame is stored as the XOR of itself and the frame
+    after it, run-length encoded, so XORing a delta into a frame gives the one
+    before it. Deltas go into a byte ring, and records hold where each one starts.
+*/
+typedef struct rewind {
+    uint8_t* ring;
+    size_t ring_size;
+    size_t ring_used;  // bytes of deltas held
+    size_t ring_head;  // where the next delta is written
+    rewind_record_t* records; // circular, first is the oldest
+    size_t max_frames;
+    size_t first;
+    size_t count;
+    bool primed;       // current holds a frame
+    state_snapshot_t* current; // newest frame, or the frame a rewind stopped at
+    state_snapshot_t* next;    // scratch for the frame being recorded
+    uint8_t delta[REWIND_FRAME_BYTES];
+    uint8_t encoded[REWIND_DELTA_MAX];
+} rewind_t;
+
+rewind_t* rewind_new(size_t max_frames, size_t ring_size);
+void rewind_delete(rewind_t* rewind);
+void rewind_clear(rewind_t* rewind);
+void rewind_record(rewind_t* rewind, emu_state_t* state);
+bool rewind_step(rewind_t* rewind, emu_state_t* state);
+size_t rewind_frames(rewind_t* rewind);
+
+
+#endif // __REWIND_H
@@ -0,0 +1,45 @@
+#ifndef __RNG_H
+#define __RNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define RNG_MULTIPLIER 6364136223846793005ull
+#define RNG_INCREMENT  1442695040888963407ull
+
+/*
+    PCG32 (XSH-RR): a 64-bit LCG whose output is permuted down to 32 bits.
+    Eight bytes of state, so every emu_state_t carries its own generator and
+    copying or snapshotting a state copies its random stream with it.
+*/
+typedef struct rng {
+    uint64_t state;
+} rng_t;
+
+/*
+    Steps the generator and returns 32 random bits.
+    Inline, since RND draws one every time it runs.
+*/
+static inline uint32_t rng_next(rng_t* rng)
+{
+    uint64_t old = rng->state;
+    rng->state = old * RNG_MULTIPLIER + RNG_INCREMENT;
+    uint32_t shifted = ((old >> 18) ^ old) >> 27;
+    uint32_t rotation = old >> 59;
+    return (shifted >> rotation) | (shifted << ((-rotation) & 31));
+}
+
+/*
+    One random byte, the top of an output, where PCG's bits are strongest.
+*/
+static inline uint8_t rng_byte(rng_t* rng)
+{
+    return rng_next(rng) >> 24;
+}
+
+void rng_seed(rng_t* rng, uint64_t seed);
+void rng_fill(rng_t* rng, uint8_t* bytes, size_t count);
+
+
+#endif // __RNG_H
@@ -0,0 +1,47 @@
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "state.h"
+
+
+#define TIMER_HZ        60
+#define FRAME_NS        (1000000000ull / TIMER_HZ)
+#define DEFAULT_IPF     11    // instructions per frame, ~660 instructions per second
+#define IPF_UNLIMITED   0     // run flat out, timers still tick at 60hz of wall time
+#define UNLIMITED_SLICE 0x100 // instructions between clock checks when unlimited
+#define UNLIMITED_NS    FRAME_NS // an unlimited frame emulates until the next is due, presenting is on another thread
+#define MAX_FRAME_SKIP  5     // frames a realtime scheduler may fall behind before giving up on them
+
+struct audio;
+struct capture;
+
+/*
+    Splits execution into 60hz frames: a frame runs instructions_per_frame
+    instructions, then ticks the timers exactly once.
+    A realtime scheduler releases frames on the monotonic clock; otherwise
+    frames are counted purely in instructions (headless runs, the debugger).
+*/
+typedef struct scheduler {
+    uint32_t instructions_per_frame;
+    bool realtime;
+    uint64_t next_frame_ns; // monotonic time the next frame is due
+    uint64_t frame_cycles;  // instructions already run in the current frame
+    uint64_t frames;
+    uint64_t cycles;         // instructions retired, idle-loop skips included
+    struct audio* audio;     // set by audio_attach, NULL when silent
+    struct capture* capture; // set by capture_attach, NULL when not capturing
+} scheduler_t;
+
+void scheduler_init(scheduler_t* scheduler, uint32_t instructions_per_frame, bool realtime);
+uint64_t scheduler_now_ns();
+bool scheduler_frame_due(scheduler_t* scheduler);
+void scheduler_resync(scheduler_t* scheduler);
+void scheduler_wait(scheduler_t* scheduler);
+void scheduler_skip_frame(scheduler_t* scheduler);
+int scheduler_run_frame(scheduler_t* scheduler, emu_state_t* state);
+int scheduler_run(scheduler_t* scheduler, emu_state_t* state, uint64_t cycles);
+
+
+#endif // __SCHEDULER_H
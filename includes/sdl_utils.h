@@ -3,16 +3,42 @@
 
 #include <SDL2/SDL.h>
 #include <stdbool.h>
+#include "audio.h"
 #include "emu.h"
+#include "present.h"
 
 
-SDL_Window* sdl_create_window(char* rom_name);
+/*
+    Colours for lit and unlit pixels, ARGB8888.
+*/
+typedef struct sdl_palette {
+    uint32_t on;
+    uint32_t off;
+} sdl_palette_t;
+
+/*
+    64x32 streaming texture plus the CPU-side pixels it is uploaded from.
+    The renderer scales the texture to the window in one copy.
+*/
+typedef struct sdl_screen {
+    SDL_Texture* texture;
+    sdl_palette_t palette;
+    uint32_t pixels[DISPLAY_HEIGHT * DISPLAY_WIDTH];
+} sdl_screen_t;
+
+SDL_Window* sdl_create_window(char* rom_name, int scale);
+bool sdl_parse_palette(const char* name, sdl_palette_t* palette);
+sdl_screen_t* sdl_screen_new(SDL_Renderer* renderer, sdl_palette_t palette);
+void sdl_screen_delete(sdl_screen_t* screen);
 void sdl_clear_screen(SDL_Renderer* renderer);
-void sdl_draw_screen(SDL_Renderer* renderer, emu_state_t* state);
+void sdl_draw_screen(SDL_Renderer* renderer, sdl_screen_t* screen, const present_frame_t* frame);
 
+SDL_AudioDeviceID sdl_audio_open(audio_t* audio);
+void sdl_audio_close(SDL_AudioDeviceID device);
 void sdl_end(SDL_Window* window, SDL_Renderer* renderer);
 
-bool sdl_event_handler(SDL_Event e, emu_state_t* state);
+bool sdl_event_handler(SDL_Event e, emu_state_t* state, const char* keymap);
+bool sdl_rewind_held(void);
 
 
 #endif // __SDL_UTILS_H
\ No newline at end of file
@@ -0,0 +1,49 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "state.h"
+
+
+#define SNAPSHOT_MAGIC   "C8ST"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_RUN_MAX 0x80 // bytes per run in the serialized form's RLE
+// header and fixed fields, then display and memory at worst one control byte per run
+#define SNAPSHOT_SERIALIZED_MAX (0x30 + (DISPLAY_ROWS * 8 + 0x1000) / SNAPSHOT_RUN_MAX * (SNAPSHOT_RUN_MAX + 1))
+
+/*
+    Everything a ROM can observe, the quirk profile it runs under included, plus
+    the predecoded instructions that go with memory, so restoring doesn't throw
+    away fusions or decode work.
+    Threading state, the JIT and run statistics stay with the emu_state_t.
+*/
+typedef struct state_snapshot {
+    uint8_t registers[0x10];
+    uint8_t memory[0x1000];
+    uint16_t index;
+    uint16_t pc;
+    uint16_t sp;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint16_t keys; // bit n for key n
+    rng_t rng;
+    uint8_t key_wait_register;
+    uint8_t key_wait_key;
+    uint64_t display[DISPLAY_ROWS];
+    quirk_profile_t profile;
+    decoded_instr_t decode_cache[DECODE_CACHE_SIZE];
+} state_snapshot_t;
+
+void state_snapshot(emu_state_t* state, state_snapshot_t* snapshot);
+void state_restore(emu_state_t* state, const state_snapshot_t* snapshot);
+size_t snapshot_serialize(const state_snapshot_t* snapshot, uint8_t* buffer, size_t size);
+bool snapshot_deserialize(state_snapshot_t* snapshot, const uint8_t* buffer, size_t size);
+bool snapshot_save(const state_snapshot_t* snapshot, const char* filename);
+bool snapshot_load(state_snapshot_t* snapshot, const char* filename);
+size_t snapshot_rle_encode(const uint8_t* data, size_t length, uint8_t* out, size_t used, size_t size);
+bool snapshot_rle_decode(const uint8_t* in, size_t size, size_t* used, uint8_t* data, size_t length);
+
+
+#endif // __SNAPSHOT_H
@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include "quirks.h"
+#include "rng.h"
 
 
 #define ROM_START      0x200
@@ -11,6 +14,35 @@
 #define FONTSET_OFFSET 0x50
 #define FONT_SIZE      0x5
 #define CYCLE_SUCCESS  0x00
+#define CYCLE_KEY_WAIT 0x01 // stopped at Fx0A, nothing runs until a key is pressed and released
+#define CYCLE_ERROR    0x02 // bad arguments, nothing ran
+#define MEMORY_MASK    0xFFF // addresses wrap at 4 KB so a misbehaving ROM can't reach past memory
+#define KEY_NONE       0xFF
+#define DECODE_CACHE_SIZE 0x800 // one slot per even address
+#define FUSION_KINDS      0x4   // superinstructions, see decode.h
+#define DISPLAY_ROWS      0x20
+#define IDLE_SELF_JUMP    1 // instructions per idle loop iteration, see state.c
+#define IDLE_POLL_DT      3
+
+/*
+    The display is one 64-bit word per row, column 0 in the most significant bit.
+*/
+#define DISPLAY_PIXEL(state, row, col) ((((state)->display[(row)]) >> (63 - (col))) & 1)
+#define DISPLAY_ALL_ROWS 0xFFFFFFFFu
+
+/*
+    Predecoded form of one instruction, see decode.h for op ids.
+*/
+typedef struct decoded_instr {
+    uint8_t op;
+    uint8_t x;
+    uint8_t y;
+    uint8_t kk;
+} decoded_instr_t;
+
+struct jit;
+struct profiler;
+struct trace;
 
 typedef struct emu_state {
     uint8_t registers[0x10];
@@ -20,15 +52,59 @@ typedef struct emu_state {
     uint16_t sp;
     uint8_t delay_timer; // timer - if zero, stays zero; if >0, decrement at 60hz
     uint8_t sound_timer; // if 0, play sound; if >0, decrement at 60hz
-    uint8_t keys[0x10];
-    bool display[0x800];
+    uint16_t keys; // bit n set while key n is down, stored atomically by state_set_key from any thread
+    rng_t rng; // RND generator, per instance so states can run on any thread
+    uint8_t key_wait_register; // Fx0A destination, KEY_NONE when not waiting
+    uint8_t key_wait_key; // key pressed during the wait, KEY_NONE until one is
+    pthread_mutex_t key_lock; // guards the Fx0A fields while another thread feeds keys
+    pthread_cond_t key_released;
+    bool key_wake; // set by state_wake, ends the current state_wait_key early
+    uint64_t display[DISPLAY_ROWS]; // packed rows, see DISPLAY_PIXEL
+    uint32_t dirty_rows; // bit n set when row n changed since the front end last looked
+    struct jit* jit; // set by jit_attach, NULL when not recompiling
+    struct profiler* profiler; // set by profiler_attach, NULL when not profiling
+    struct trace* trace; // set by trace_attach, NULL when not tracing
+    decoded_instr_t decode_cache[DECODE_CACHE_SIZE]; // invalidated on memory writes
+    uint64_t fusions[FUSION_KINDS]; // times each superinstruction ran fused
+    bool skip_idle; // fast-forward idle loops, on unless turned off after state_init
+    quirk_profile_t profile; // which copy of the interpreter runs, see state_set_profile
+    uint32_t quirks; // QUIRK_* flags of profile
+    uint64_t idle_cycles; // instructions skipped by idle-loop fast-forward
 } emu_state_t;
 
-const uint8_t fontset[FONTSET_SIZE];
+extern const uint8_t fontset[FONTSET_SIZE];
 
 emu_state_t* state_new();
 void state_init(emu_state_t* state);
 int state_cycle(emu_state_t* state);
+int state_run(emu_state_t* state, uint64_t cycles, uint64_t* executed);
 void state_delete(emu_state_t* state);
+uint32_t state_take_dirty_rows(emu_state_t* state);
+void state_tick_timers(emu_state_t* state);
+void state_seed(emu_state_t* state, uint64_t seed);
+void state_set_profile(emu_state_t* state, quirk_profile_t profile);
+void state_set_key(emu_state_t* state, uint8_t key, bool down);
+bool state_wait_key(emu_state_t* state, uint32_t timeout_ms);
+void state_wake(emu_state_t* state);
+uint8_t state_idle_loop(emu_state_t* state, uint16_t* start);
+uint64_t state_skip_idle(emu_state_t* state, uint16_t jump_pc, uint64_t remaining);
+uint64_t state_skip_idle_frames(emu_state_t* state, uint64_t frames, uint32_t instructions_per_frame);
+
+/*
+    True while Fx0A is suspending the core. The engines stop as soon as this holds
+    and return CYCLE_KEY_WAIT; the flag may be cleared from another thread.
+*/
+static inline bool state_waiting_for_key(emu_state_t* state)
+{
+    return __atomic_load_n(&(state->key_wait_register), __ATOMIC_ACQUIRE) != KEY_NONE;
+}
+
+/*
+    True while keypad key (0-F) is held down.
+*/
+static inline bool state_key_down(emu_state_t* state, uint8_t key)
+{
+    return (__atomic_load_n(&(state->keys), __ATOMIC_RELAXED) >> (key & 0xF)) & 1;
+}
 
 #endif // __STATE_H
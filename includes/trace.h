@@ -0,0 +1,270 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "decode.h"
+#include "state.h"
+
+
+#define TRACE_MAGIC       "C8TR"
+#define TRACE_VERSION     1
+#define TRACE_HEADER_SIZE 0x17 // magic, version, V0-VF, I
+#define TRACE_BUFFER_SIZE (4 << 20) // bytes per buffer, one fills while the other is written
+#define TRACE_RECORD_MAX  0x40 // longest record, a buffer is handed off when less than this is left
+
+/*
+    Record flags, the first byte of every record. The fields they announce follow
+    in this order, multi-byte ones little-endian, counts as LEB128 varints:
+*/
+#define TRACE_JUMP    0x01 // pc (2 bytes): didn't follow on from the previous record
+#define TRACE_SKIPPED 0x02 // count: instructions fast-forwarded before this one
+                           // then always the opcode, 2 bytes big-endian as in memory
+#define TRACE_FUSED   0x04 // opcode of the second half: a superinstruction, two instructions
+#define TRACE_BLOCK   0x08 // count: a translated block of that many instructions, starting with opcode
+#define TRACE_REGS    0x10 // mask (2 bytes) of the V registers changed, then their new values in order
+#define TRACE_INDEX   0x20 // I (2 bytes): changed
+
+/*
+    Streams a record per executed instruction to a file. The engine appends to
+    one buffer while a background thread writes the other, so it only waits on
+    the disk when the writer has fallen a whole buffer behind.
+*/
+typedef struct trace {
+    FILE* fp;
+    uint8_t* buffers[2];
+    int filling;        // buffer the engine appends to
+    size_t used;        // bytes in it
+    size_t full;        // bytes of the other buffer waiting for the writer, 0 when it's free
+    bool closing;
+    bool failed;        // a write went wrong, reported once at trace_close
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    bool pending;       // an instruction is running, its record is written at the next step or stop
+    uint16_t pending_pc;
+    uint8_t pending_op;
+    uint16_t pending_opcode; // as it was in memory when dispatched
+    uint16_t pending_writes; // registers it can change, see trace_written
+    bool resync;        // registers may have changed outside the engine, compare them all
+    uint64_t pending_skipped; // fast-forwarded just before it
+    uint16_t next_pc;   // where the previous record's instructions fell through to
+    uint8_t registers[0x10]; // as of the last record, to find what changed
+    uint16_t index;
+    uint64_t idle_cycles;
+    uint64_t records;
+} trace_t;
+
+/*
+    One decoded record, see trace_read.
+*/
+typedef struct trace_record {
+    uint64_t cycle;  // instructions run before this one
+    uint16_t pc;
+    uint16_t opcodes[2]; // second only for fused records
+    uint32_t count;  // instructions the record covers: 1, 2 fused, or a block's length
+    uint64_t skipped; // fast-forwarded just before it
+    uint16_t changed; // mask of V registers written with new values
+    uint8_t registers[0x10]; // all of them, as of the end of the record
+    bool index_changed;
+    uint16_t index;
+} trace_record_t;
+
+/*
+    Reads a trace file back.
+*/
+typedef struct trace_reader {
+    FILE* fp;
+    uint64_t cycle;
+    uint16_t next_pc;
+    uint8_t registers[0x10];
+    uint16_t index;
+} trace_reader_t;
+
+trace_t* trace_open(const char* filename);
+void trace_attach(trace_t* trace, emu_state_t* state);
+void trace_handoff(trace_t* trace);
+bool trace_close(trace_t* trace);
+bool trace_reader_open(trace_reader_t* reader, const char* filename);
+int trace_read(trace_reader_t* reader, trace_record_t* record);
+void trace_reader_close(trace_reader_t* reader);
+
+static inline uint8_t* trace_put_count(uint8_t* out, uint64_t count)
+{
+    while (count >= 0x80) {
+        *out++ = (count & 0x7f) | 0x80;
+        count >>= 7;
+    }
+    *out++ = count;
+    return out;
+}
+
+/*
+    Registers each op can write, so a record only compares those: Vx, VF as a
+    flag, or V0 to Vx for Fx65. Fused ops combine both halves.
+*/
+#define TRACE_WRITES_X    0x1
+#define TRACE_WRITES_VF   0x2
+#define TRACE_WRITES_UPTO 0x4
+
+static const uint8_t trace_op_writes[OP_COUNT] = {
+    [OP_LD_BYTE]     = TRACE_WRITES_X,
+    [OP_ADD_BYTE]    = TRACE_WRITES_X,
+    [OP_LD_REG]      = TRACE_WRITES_X,
+    [OP_OR]          = TRACE_WRITES_X | TRACE_WRITES_VF, // VF only with the chip8 quirks
+    [OP_AND]         = TRACE_WRITES_X | TRACE_WRITES_VF,
+    [OP_XOR]         = TRACE_WRITES_X | TRACE_WRITES_VF,
+    [OP_ADD_REG]     = TRACE_WRITES_X | TRACE_WRITES_VF,
+    [OP_SUB]         = TRACE_WRITES_X | TRACE_WRITES_VF,
+    [OP_SHR]         = TRACE_WRITES_X | TRACE_WRITES_VF,
+    [OP_SUBN]        = TRACE_WRITES_X | TRACE_WRITES_VF,
+    [OP_SHL]         = TRACE_WRITES_X | TRACE_WRITES_VF,
+    [OP_RND]         = TRACE_WRITES_X,
+    [OP_DRW]         = TRACE_WRITES_VF,
+    [OP_LD_VX_DT]    = TRACE_WRITES_X,
+    [OP_LD_VX_K]     = TRACE_WRITES_X, // written when the key arrives, between runs
+    [OP_LD_VX_MEM]   = TRACE_WRITES_UPTO,
+    [OP_LD_BYTE_DRW] = TRACE_WRITES_X | TRACE_WRITES_VF,
+    [OP_LD_I_DRW]    = TRACE_WRITES_VF,
+    [OP_LD_DT_SE]    = TRACE_WRITES_X,
+    [OP_ADD_BYTE_SE] = TRACE_WRITES_X,
+};
+
+static inline uint16_t trace_written(decoded_instr_t instr)
+{
+    uint8_t writes = trace_op_writes[instr.op];
+    uint16_t x = 1 << (instr.x & 0xf);
+    return (writes & TRACE_WRITES_X ? x : 0) | (writes & TRACE_WRITES_VF ? 0x8000 : 0)
+        | (writes & TRACE_WRITES_UPTO ? (x << 1) - 1 : 0);
+}
+
+/*
+    Writes the pending record, now that its instructions have run. pc is where
+    execution went next, which tells a superinstruction that ran whole from
+    its first half stepped alone. The whole record is encoded in one pass.
+*/
+static inline void trace_finish(trace_t* trace, emu_state_t* state, uint16_t pc, uint32_t block)
+{
+    if (!trace->pending) {
+        return;
+    }
+    trace->pending = false;
+    if (trace->used > TRACE_BUFFER_SIZE - TRACE_RECORD_MAX) {
+        trace_handoff(trace);
+    }
+    uint8_t* buffer = trace->buffers[trace->filling];
+    uint8_t* flags = &(buffer[trace->used]);
+    uint8_t* out = flags + 1;
+    uint8_t kind = 0;
+    uint16_t start = trace->pending_pc;
+    if (start != trace->next_pc) {
+        kind |= TRACE_JUMP;
+        *out++ = start & 0xff;
+        *out++ = start >> 8;
+    }
+    if (trace->pending_skipped > 0) {
+        kind |= TRACE_SKIPPED;
+        out = trace_put_count(out, trace->pending_skipped);
+    }
+    *out++ = trace->pending_opcode >> 8;
+    *out++ = trace->pending_opcode & 0xff;
+    uint16_t next_pc = start + 2;
+    if (trace->pending_op >= OP_FUSED_FIRST && pc != next_pc) {
+        // the first halves never branch, so the second half ran too
+        kind |= TRACE_FUSED;
+        *out++ = state->memory[next_pc & MEMORY_MASK];
+        *out++ = state->memory[(next_pc + 1) & MEMORY_MASK];
+        next_pc += 2;
+    }
+    if (block > 0) {
+        kind |= TRACE_BLOCK;
+        out = trace_put_count(out, block);
+        next_pc = start + 2 * block;
+    }
+    // only the registers the instruction can write: comparing all 16 costs more than the rest of the record
+    uint32_t candidates = block > 0 || trace->resync ? 0xffff : trace->pending_writes;
+    trace->resync = false;
+    uint8_t* mask = out;
+    out += 2;
+    uint32_t changed = 0;
+    for (; candidates != 0; candidates &= candidates - 1) {
+        int i = __builtin_ctz(candidates);
+        if (state->registers[i] != trace->registers[i]) {
+            changed |= 1 << i;
+            *out++ = state->registers[i];
+            trace->registers[i] = state->registers[i];
+        }
+    }
+    if (changed != 0) {
+        kind |= TRACE_REGS;
+        mask[0] = changed & 0xff;
+        mask[1] = changed >> 8;
+    } else {
+        out = mask;
+    }
+    if (state->index != trace->index) {
+        kind |= TRACE_INDEX;
+        *out++ = state->index & 0xff;
+        *out++ = state->index >> 8;
+        trace->index = state->index;
+    }
+    *flags = kind;
+    trace->used = out - buffer;
+    trace->next_pc = next_pc;
+    trace->records++;
+}
+
+/*
+    Called by the engines as each instruction is dispatched, before it runs.
+    Writes the previous record and notes this one.
+*/
+static inline void trace_step(trace_t* trace, emu_state_t* state, uint16_t pc, decoded_instr_t instr)
+{
+    if (trace == NULL) {
+        return;
+    }
+    trace_finish(trace, state, pc, 0);
+    trace->pending = true;
+    trace->pending_pc = pc;
+    trace->pending_op = instr.op;
+    trace->pending_writes = trace_written(instr);
+    trace->pending_opcode = (state->memory[pc & MEMORY_MASK] << 8) | state->memory[(pc + 1) & MEMORY_MASK];
+    trace->pending_skipped = state->idle_cycles - trace->idle_cycles;
+    trace->idle_cycles = state->idle_cycles;
+}
+
+/*
+    Called when an engine returns, so the last record is complete on its own.
+*/
+static inline void trace_stop(trace_t* trace, emu_state_t* state)
+{
+    if (trace == NULL) {
+        return;
+    }
+    trace_finish(trace, state, state->pc, 0);
+    trace->resync = true; // a restore or a key ending Fx0A may change them before the next run
+}
+
+/*
+    Hooks for the engines, compiled out unless built with TRACE=1.
+*/
+#ifdef TRACE
+    #define TRACE_STEP(state, pc, instr) trace_step((state)->trace, (state), (pc), (instr))
+    #define TRACE_STOP(state)            trace_stop((state)->trace, (state))
+    #define TRACE_BLOCK_START(state, pc) \
+        trace_step((state)->trace, (state), (pc), (decoded_instr_t) { .op = OP_NOP })
+    #define TRACE_BLOCK_DONE(state, pc, length) \
+        do { if ((state)->trace != NULL) trace_finish((state)->trace, (state), (pc) + 2 * (length), (length)); } while (0)
+#else
+    #define TRACE_STEP(state, pc, instr)
+    #define TRACE_STOP(state)
+    #define TRACE_BLOCK_START(state, pc)
+    #define TRACE_BLOCK_DONE(state, pc, length)
+#endif
+
+
+#endif // __TRACE_H
@@ -0,0 +1,597 @@
+
+/*
+Basic-block recompiler to x86-64
+
+Straight-line runs of ALU instructions (6xkk, 7xkk, 8xyN, Annn, Fx1E) are translated
+into native code the first time a pc gets hot. A block loads the guest registers it
+touches into host registers, runs, writes back what it changed and returns the number
+of instructions it executed. Everything else (jumps, skips, DRW, keys, timers, memory)
+ends the block and goes through state_cycle.
+
+Register convention inside a block:
+    rdi      emu_state_t*
+    eax      scratch (flags, carries)
+    ecx, edx, esi, r8d-r11d  guest V registers, always zero-extended bytes
+*/
+
+#if defined(JIT) && defined(__x86_64__)
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include "includes/decode.h"
+#include "includes/jit.h"
+#include "includes/profiler.h"
+#include "includes/trace.h"
+#include "includes/state.h"
+
+
+#define HOST_REG_COUNT 7
+#define REG_EAX 0
+#define REG_EDI 7
+
+typedef int (*jit_block_fn)(emu_state_t* state);
+
+typedef enum jit_status {
+    JIT_COLD = 0,
+    JIT_TRANSLATED,
+    JIT_UNTRANSLATABLE
+} jit_status_t;
+
+typedef struct jit_block {
+    jit_block_fn code;
+    uint8_t length; // instructions in block
+    uint8_t heat;
+    uint8_t status;
+} jit_block_t;
+
+struct jit {
+    uint8_t* code;
+    uint32_t code_used;
+    jit_block_t blocks[DECODE_CACHE_SIZE];
+};
+
+typedef struct emitter {
+    uint8_t* buf;
+    uint32_t pos;
+    uint32_t cap;
+    bool overflow;
+} emitter_t;
+
+static const uint8_t host_regs[HOST_REG_COUNT] = { 1, 2, 6, 8, 9, 10, 11 };
+
+
+/*
+======================
+| x86-64 encoding    |
+======================
+*/
+
+static void emit8(emitter_t* e, uint8_t byte)
+{
+    if (e->pos >= e->cap) {
+        e->overflow = true;
+        return;
+    }
+    e->buf[e->pos++] = byte;
+}
+
+static void emit32(emitter_t* e, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        emit8(e, (value >> (i * 8)) & 0xff);
+    }
+}
+
+static void emit_rex(emitter_t* e, uint8_t reg, uint8_t rm, bool force)
+{
+    uint8_t rex = 0x40 | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40 || force) {
+        emit8(e, rex);
+    }
+}
+
+/* op r/m32, r32 with both operands registers (mov 89, add 01, or 09, and 21, sub 29, xor 31, cmp 39) */
+static void emit_rr(emitter_t* e, uint8_t opcode, uint8_t dst, uint8_t src)
+{
+    emit_rex(e, src, dst, false);
+    emit8(e, opcode);
+    emit8(e, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+/* 81 /digit id */
+static void emit_ri(emitter_t* e, uint8_t digit, uint8_t dst, uint32_t imm)
+{
+    emit_rex(e, 0, dst, false);
+    emit8(e, 0x81);
+    emit8(e, 0xC0 | (digit << 3) | (dst & 7));
+    emit32(e, imm);
+}
+
+/* C1 /digit ib, shl is /4 and shr is /5 */
+static void emit_shift(emitter_t* e, uint8_t digit, uint8_t dst, uint8_t amount)
+{
+    emit_rex(e, 0, dst, false);
+    emit8(e, 0xC1);
+    emit8(e, 0xC0 | (digit << 3) | (dst & 7));
+    emit8(e, amount);
+}
+
+static void emit_mov_imm(emitter_t* e, uint8_t dst, uint32_t imm)
+{
+    emit_rex(e, 0, dst, false);
+    emit8(e, 0xB8 | (dst & 7));
+    emit32(e, imm);
+}
+
+static void emit_neg(emitter_t* e, uint8_t dst)
+{
+    emit_rex(e, 0, dst, false);
+    emit8(e, 0xF7);
+    emit8(e, 0xD8 | (dst & 7));
+}
+
+/* movzx r32, byte [rdi + disp32] */
+static void emit_load_byte(emitter_t* e, uint8_t dst, uint32_t disp)
+{
+    emit_rex(e, dst, REG_EDI, false);
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emit8(e, 0x80 | ((dst & 7) << 3) | REG_EDI);
+    emit32(e, disp);
+}
+
+/* mov byte [rdi + disp32], r8 - always with a rex prefix so esi means sil */
+static void emit_store_byte(emitter_t* e, uint8_t src, uint32_t disp)
+{
+    emit_rex(e, src, REG_EDI, true);
+    emit8(e, 0x88);
+    emit8(e, 0x80 | ((src & 7) << 3) | REG_EDI);
+    emit32(e, disp);
+}
+
+/* eax = (flags say above or equal) */
+static void emit_setae_eax(emitter_t* e)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0x93);
+    emit8(e, 0xC0);
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emit8(e, 0xC0);
+}
+
+/* mov word [rdi + disp32], imm16 */
+static void emit_store_word_imm(emitter_t* e, uint32_t disp, uint16_t imm)
+{
+    emit8(e, 0x66);
+    emit8(e, 0xC7);
+    emit8(e, 0x80 | REG_EDI);
+    emit32(e, disp);
+    emit8(e, imm & 0xff);
+    emit8(e, imm >> 8);
+}
+
+/* add word [rdi + disp32], r16 */
+static void emit_add_word_reg(emitter_t* e, uint32_t disp, uint8_t src)
+{
+    emit8(e, 0x66);
+    emit_rex(e, src, REG_EDI, false);
+    emit8(e, 0x01);
+    emit8(e, 0x80 | ((src & 7) << 3) | REG_EDI);
+    emit32(e, disp);
+}
+
+
+/*
+======================
+| Translation        |
+======================
+*/
+
+/*
+    Guest registers an op reads or writes under the given QUIRK_* flags, as a
+    bitmask over V0-VF. Returns false for ops that must go through the interpreter.
+*/
+static bool jit_regs_used(decoded_instr_t instr, uint32_t quirks, uint16_t* used, uint16_t* written)
+{
+    uint16_t vx = 1 << instr.x;
+    uint16_t vy = 1 << instr.y;
+    uint16_t vf = 1 << 0xF;
+    switch (instr.op) {
+        case OP_NOP:
+        case OP_LD_I:
+            *used = 0;
+            *written = 0;
+            return true;
+        case OP_LD_BYTE:
+        case OP_ADD_BYTE:
+            *used = vx;
+            *written = vx;
+            return true;
+        case OP_LD_REG:
+            *used = vx | vy;
+            *written = vx;
+            return true;
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+            *used = vx | vy;
+            *written = vx;
+            if (quirks & QUIRK_VF_RESET) {
+                *used |= vf;
+                *written |= vf;
+            }
+            return true;
+        case OP_ADD_REG:
+        case OP_SUB:
+        case OP_SUBN:
+            *used = vx | vy | vf;
+            *written = vx | vf;
+            return true;
+        case OP_SHR:
+        case OP_SHL:
+            *used = vx | vf | ((quirks & QUIRK_SHIFT_VY) ? vy : 0);
+            *written = vx | vf;
+            return true;
+        case OP_ADD_I_VX:
+            *used = vx;
+            *written = 0;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+    Emits one op; quirks are settled here, so blocks never test them.
+*/
+static void jit_emit_op(emitter_t* e, decoded_instr_t instr, uint32_t quirks, const uint8_t* map)
+{
+    uint8_t rx = map[instr.x];
+    uint8_t ry = map[instr.y];
+    uint8_t rf = map[0xF];
+    uint32_t index_disp = offsetof(emu_state_t, index);
+
+    switch (instr.op) {
+        case OP_LD_BYTE:
+            emit_mov_imm(e, rx, instr.kk);
+            break;
+        case OP_ADD_BYTE:
+            emit_ri(e, 0, rx, instr.kk);
+            emit_ri(e, 4, rx, 0xff);
+            break;
+        case OP_LD_REG:
+            emit_rr(e, 0x89, rx, ry);
+            break;
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+            emit_rr(e, instr.op == OP_OR ? 0x09 : instr.op == OP_AND ? 0x21 : 0x31, rx, ry);
+            if (quirks & QUIRK_VF_RESET) {
+                emit_mov_imm(e, rf, 0);
+            }
+            break;
+        case OP_ADD_REG:
+            emit_rr(e, 0x01, rx, ry);
+            emit_rr(e, 0x89, REG_EAX, rx);
+            emit_shift(e, 5, REG_EAX, 8);
+            emit_ri(e, 4, rx, 0xff);
+            emit_rr(e, 0x89, rf, REG_EAX);
+            break;
+        case OP_SUB:
+            emit_rr(e, 0x39, rx, ry);
+            emit_setae_eax(e);
+            emit_rr(e, 0x29, rx, ry);
+            emit_ri(e, 4, rx, 0xff);
+            emit_rr(e, 0x89, rf, REG_EAX);
+            break;
+        case OP_SUBN:
+            emit_rr(e, 0x39, ry, rx);
+            emit_setae_eax(e);
+            emit_rr(e, 0x29, rx, ry);
+            emit_neg(e, rx);
+            emit_ri(e, 4, rx, 0xff);
+            emit_rr(e, 0x89, rf, REG_EAX);
+            break;
+        case OP_SHR:
+            if (quirks & QUIRK_SHIFT_VY) {
+                emit_rr(e, 0x89, rx, ry);
+            }
+            emit_rr(e, 0x89, REG_EAX, rx);
+            emit_ri(e, 4, REG_EAX, 1);
+            emit_shift(e, 5, rx, 1);
+            emit_rr(e, 0x89, rf, REG_EAX);
+            break;
+        case OP_SHL:
+            if (quirks & QUIRK_SHIFT_VY) {
+                emit_rr(e, 0x89, rx, ry);
+            }
+            emit_rr(e, 0x89, REG_EAX, rx);
+            emit_shift(e, 5, REG_EAX, 7);
+            emit_shift(e, 4, rx, 1);
+            emit_ri(e, 4, rx, 0xff);
+            emit_rr(e, 0x89, rf, REG_EAX);
+            break;
+        case OP_LD_I:
+            emit_store_word_imm(e, index_disp, DECODED_NNN(instr));
+            break;
+        case OP_ADD_I_VX:
+            emit_add_word_reg(e, index_disp, rx);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+    Drops every translated block and recycles the code buffer.
+*/
+static void jit_flush(jit_t* jit)
+{
+    jit->code_used = 0;
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+}
+
+/*
+    Switches the code buffer between writable and executable; it is never both,
+    so a bug in a block can't rewrite code and hosts that deny execmem are fine.
+*/
+static bool jit_protect(jit_t* jit, int protection)
+{
+    if (mprotect(jit->code, JIT_CODE_SIZE, protection) != 0) {
+        fprintf(stderr, "error: unable to change jit code buffer protection\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+    Translates the block starting at address, or marks it untranslatable.
+    The code buffer is writable only while the block is emitted.
+*/
+static void jit_translate(jit_t* jit, emu_state_t* state, uint16_t address)
+{
+    jit_block_t* block = &(jit->blocks[address >> 1]);
+    decoded_instr_t ops[JIT_BLOCK_MAX];
+    uint16_t used = 0;
+    uint16_t written = 0;
+    int count = 0;
+
+    for (uint16_t pc = address; count < JIT_BLOCK_MAX && (size_t)pc + 1 < sizeof(state->memory); pc += 2) {
+        decoded_instr_t instr = decode_instruction((state->memory[pc] << 8) | state->memory[pc + 1]);
+        uint16_t op_used, op_written;
+        if (!jit_regs_used(instr, state->quirks, &op_used, &op_written)) {
+            break;
+        }
+        if (__builtin_popcount(used | op_used) > HOST_REG_COUNT) {
+            break;
+        }
+        used |= op_used;
+        written |= op_written;
+        ops[count++] = instr;
+    }
+    if (count < 2) {
+        block->status = JIT_UNTRANSLATABLE;
+        return;
+    }
+
+    uint8_t map[0x10] = { 0 };
+    int next_host = 0;
+    for (int reg = 0; reg < 0x10; reg++) {
+        if (used & (1 << reg)) {
+            map[reg] = host_regs[next_host++];
+        }
+    }
+
+    if (!jit_protect(jit, PROT_READ | PROT_WRITE)) {
+        block->status = JIT_UNTRANSLATABLE;
+        return;
+    }
+    for (int attempt = 0; attempt < 2; attempt++) {
+        emitter_t e = {
+            .buf = jit->code + jit->code_used,
+            .pos = 0,
+            .cap = JIT_CODE_SIZE - jit->code_used,
+            .overflow = false
+        };
+        for (int reg = 0; reg < 0x10; reg++) {
+            if (used & (1 << reg)) {
+                emit_load_byte(&e, map[reg], offsetof(emu_state_t, registers) + reg);
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            jit_emit_op(&e, ops[i], state->quirks, map);
+        }
+        for (int reg = 0; reg < 0x10; reg++) {
+            if (written & (1 << reg)) {
+                emit_store_byte(&e, map[reg], offsetof(emu_state_t, registers) + reg);
+            }
+        }
+        emit_mov_imm(&e, REG_EAX, count);
+        emit8(&e, 0xC3); // ret
+
+        if (!e.overflow) {
+            block->code = (jit_block_fn) e.buf;
+            block->length = count;
+            block->status = JIT_TRANSLATED;
+            jit->code_used += e.pos;
+            break;
+        }
+        jit_flush(jit);
+    }
+    if (block->status != JIT_TRANSLATED || !jit_protect(jit, PROT_READ | PROT_EXEC)) {
+        block->status = JIT_UNTRANSLATABLE; // a buffer left writable can't run
+    }
+}
+
+
+/*
+======================
+| Public interface   |
+======================
+*/
+
+/*
+    Generates a new recompiler with its own code buffer, mapped writable and
+    turned executable once there's code in it, see jit_protect.
+*/
+jit_t* jit_new()
+{
+    jit_t* jit = malloc(sizeof(jit_t));
+    if (jit == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for jit\n");
+        return NULL;
+    }
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        fprintf(stderr, "error: unable to map memory for jit\n");
+        free(jit);
+        return NULL;
+    }
+    jit_flush(jit);
+    return jit;
+}
+
+/*
+    Ties the recompiler to a state so memory writes invalidate its blocks.
+*/
+void jit_attach(jit_t* jit, emu_state_t* state)
+{
+    if (state == NULL) {
+        fprintf(stderr, "error: null state\n");
+        return;
+    }
+    jit_flush(jit);
+    state->jit = jit;
+}
+
+/*
+    Runs the given number of cycles, executing translated blocks where they fit
+    in the remaining budget and interpreting everything else.
+    Sets *executed to the instructions retired, as state_run does.
+*/
+int jit_run(jit_t* jit, emu_state_t* state, uint64_t cycles, uint64_t* executed)
+{
+    uint64_t budget = cycles;
+    *executed = 0;
+    if (state == NULL) {
+        fprintf(stderr, "error: null state\n");
+        return CYCLE_ERROR;
+    }
+    if (state_waiting_for_key(state)) {
+        return CYCLE_KEY_WAIT;
+    }
+    while (cycles > 0) {
+        uint16_t pc = state->pc;
+        if ((pc & 1) == 0 && (pc >> 1) < DECODE_CACHE_SIZE) {
+            jit_block_t* block = &(jit->blocks[pc >> 1]);
+            if (block->status == JIT_COLD && ++block->heat >= JIT_HOT_THRESHOLD) {
+                jit_translate(jit, state, pc);
+            }
+            if (block->status == JIT_TRANSLATED && block->length <= cycles) {
+                PROFILE_BLOCK(state, pc);
+                TRACE_BLOCK_START(state, pc);
+                int executed = block->code(state);
+                PROFILE_BLOCK_DONE(state, pc, executed);
+                TRACE_BLOCK_DONE(state, pc, executed);
+                state->pc = pc + 2 * executed;
+                cycles -= executed;
+                continue;
+            }
+        }
+        int status = state_cycle(state);
+        cycles--; // an Fx0A that stops the run has still run
+        if (status != CYCLE_SUCCESS) {
+            *executed = budget - cycles;
+            return status;
+        }
+        if (state->pc == pc || state->pc + 4 == pc) {
+            // backward jump to itself or 3 instructions up, maybe an idle loop
+            cycles -= state_skip_idle(state, pc, cycles);
+        }
+    }
+    *executed = budget;
+    return CYCLE_SUCCESS;
+}
+
+/*
+    Drops blocks overlapping memory[address, address + length).
+    Blocks that gave up translating nearby are retried, since their code may have changed.
+*/
+void jit_invalidate(jit_t* jit, uint16_t address, uint16_t length)
+{
+    if (length == 0) {
+        return;
+    }
+    uint32_t end = (uint32_t)address + length;
+    uint32_t first = address > 2 * JIT_BLOCK_MAX ? (address - 2 * JIT_BLOCK_MAX) >> 1 : 0;
+    uint32_t last = (end - 1) >> 1;
+    if (last >= DECODE_CACHE_SIZE) {
+        last = DECODE_CACHE_SIZE - 1;
+    }
+    for (uint32_t slot = first; slot <= last; slot++) {
+        jit_block_t* block = &(jit->blocks[slot]);
+        uint32_t block_end = slot * 2 + 2 * JIT_BLOCK_MAX;
+        if (block->status == JIT_TRANSLATED) {
+            block_end = slot * 2 + 2 * block->length;
+        }
+        if (block->status != JIT_COLD && block_end > address) {
+            block->code = NULL;
+            block->length = 0;
+            block->heat = 0;
+            block->status = JIT_COLD;
+        }
+    }
+}
+
+/*
+    Deletes the recompiler and unmaps its code buffer.
+*/
+void jit_delete(jit_t* jit)
+{
+    if (jit == NULL) {
+        return;
+    }
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+#elif defined(JIT)
+
+/*
+    Other hosts build with JIT=1 but get no recompiler: jit_new fails, so
+    front ends report it and exit rather than failing to link.
+*/
+
+#include <stdio.h>
+#include "includes/jit.h"
+
+jit_t* jit_new()
+{
+    fprintf(stderr, "error: the jit only supports x86-64 hosts, rebuild without JIT=1\n");
+    return NULL;
+}
+
+void jit_attach(jit_t* jit, emu_state_t* state)
+{
+}
+
+int jit_run(jit_t* jit, emu_state_t* state, uint64_t cycles, uint64_t* executed)
+{
+    *executed = 0;
+    return CYCLE_ERROR;
+}
+
+void jit_invalidate(jit_t* jit, uint16_t address, uint16_t length)
+{
+}
+
+void jit_delete(jit_t* jit)
+{
+}
+
+#endif // JIT
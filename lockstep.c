@@ -0,0 +1,1215 @@
+
+/*
+Lockstep batch engine - one ROM, many instances, one instruction stream
+
+Every step runs one instruction on every runnable lane. Lanes at the group's pc
+run it as vector operations over the structure of arrays (see lockstep.h):
+arithmetic, loads, skips and jumps become a few operations per LOCKSTEP_VECTOR
+lanes. Everything that touches memory, the display, RND or the keys runs lane by
+lane even inside the group, exactly like state.c does it. Lanes that diverged
+(a skip that went differently, RND, a key) run their own instruction scalar until
+their pcs line up with the group again.
+
+state_cycle stays the reference: every lane ends up in the state the switch
+engine would have left the same instance in, which lockstep_extract hands back
+as an emu_state_t.
+*/
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "includes/decode.h"
+#include "includes/emu.h"
+#include "includes/lockstep.h"
+#include "includes/state.h"
+
+
+/*
+    GCC vector extensions rather than intrinsics, so the kernels build anywhere;
+    on x86-64 lockstep_run is cloned for AVX2 and picked at load time, with the
+    baseline SSE2 clone as the fallback.
+*/
+#if defined(__x86_64__) && !defined(__AVX2__)
+    #define LOCKSTEP_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+    #define LOCKSTEP_TARGETS
+#endif
+
+typedef uint8_t lanes8_t __attribute__((vector_size(LOCKSTEP_VECTOR), may_alias));
+typedef int8_t slanes8_t __attribute__((vector_size(LOCKSTEP_VECTOR), may_alias));
+typedef uint16_t lanes16_t __attribute__((vector_size(LOCKSTEP_VECTOR * 2), may_alias));
+typedef int16_t slanes16_t __attribute__((vector_size(LOCKSTEP_VECTOR * 2), may_alias));
+
+#define LOCKSTEP_ALIGN sizeof(lanes16_t)
+#define LANES8(array, lane)  (*(lanes8_t*)&((array)[(lane)]))
+#define LANES16(array, lane) (*(lanes16_t*)&((array)[(lane)]))
+#define BLEND(old, new, mask) (((new) & (mask)) | ((old) & ~(mask)))
+#define REGISTER(batch, r) (&((batch)->registers[(r) * (batch)->stride]))
+#define LANE_MEMORY(batch, lane) (&((batch)->memory[(lane) * (size_t)(MEMORY_MASK + 1)]))
+#define EACH_CHUNK(batch, chunk) for (size_t chunk = 0; chunk < (batch)->stride; chunk += LOCKSTEP_VECTOR)
+
+
+/*
+    Macros rather than functions: vectors wider than the baseline ABI's registers
+    can't be passed around without GCC warning about it.
+    WIDEN_MASK turns 0xFF / 0x00 lanes into 0xFFFF / 0x0000.
+*/
+#define WIDEN(lanes) __builtin_convertvector((lanes), lanes16_t)
+#define WIDEN_MASK(mask) ((lanes16_t) __builtin_convertvector((slanes8_t)(mask), slanes16_t))
+
+static inline bool lanes_any(const uint8_t* lanes, size_t count)
+{
+    uint64_t any = 0;
+    for (size_t lane = 0; lane < count; lane += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, &(lanes[lane]), sizeof(word));
+        any |= word;
+    }
+    return any != 0;
+}
+
+static void* lockstep_alloc(size_t size)
+{
+    size = (size + LOCKSTEP_ALIGN - 1) / LOCKSTEP_ALIGN * LOCKSTEP_ALIGN;
+    void* block = aligned_alloc(LOCKSTEP_ALIGN, size);
+    if (block != NULL) {
+        memset(block, 0, size);
+    }
+    return block;
+}
+
+static void lockstep_mark_written(lockstep_t* batch, uint16_t address, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; i++) {
+        uint16_t written = (address + i) & MEMORY_MASK;
+        batch->written[written >> 6] |= 1ull << (written & 63);
+    }
+}
+
+/*
+    How far Fx55/Fx65 move I under the batch's quirks, see state.c.
+*/
+static uint16_t lockstep_index_step(lockstep_t* batch, decoded_instr_t instr)
+{
+    if (batch->quirks & QUIRK_INDEX_INCREMENT) {
+        return instr.x + 1;
+    }
+    return batch->quirks & QUIRK_INDEX_ADD_X ? instr.x : 0;
+}
+
+static inline bool lockstep_was_written(lockstep_t* batch, uint16_t address)
+{
+    return (batch->written[address >> 6] >> (address & 63)) & 1;
+}
+
+/*
+    Decodes the instruction at address from the shared image, as long as no lane
+    has written either of its bytes, so every lane is sure to hold the same one.
+*/
+static inline bool lockstep_shared_fetch(lockstep_t* batch, uint16_t address, decoded_instr_t* instr)
+{
+    uint16_t high = address & MEMORY_MASK;
+    uint16_t low = (high + 1) & MEMORY_MASK;
+    if (lockstep_was_written(batch, high) || lockstep_was_written(batch, low)) {
+        return false;
+    }
+    uint16_t slot = address >> 1;
+    if ((address & 1) == 0 && slot < DECODE_CACHE_SIZE) {
+        if (batch->decode_cache[slot].op == OP_UNDECODED) {
+            batch->decode_cache[slot] = decode_instruction((batch->image[high] << 8) | batch->image[low]);
+        }
+        *instr = batch->decode_cache[slot];
+        return true;
+    }
+    *instr = decode_instruction((batch->image[high] << 8) | batch->image[low]);
+    return true;
+}
+
+static inline decoded_instr_t lockstep_fetch(lockstep_t* batch, size_t lane, uint16_t address)
+{
+    decoded_instr_t instr;
+    if (lockstep_shared_fetch(batch, address, &instr)) {
+        return instr;
+    }
+    uint8_t* memory = LANE_MEMORY(batch, lane);
+    address &= MEMORY_MASK;
+    return decode_instruction((memory[address] << 8) | memory[(address + 1) & MEMORY_MASK]);
+}
+
+
+/*
+======================
+| Scalar lanes       |
+======================
+*/
+
+/*
+    True if the lane's memory at start holds the Fx07 / 3x00 / 1nnn delay timer
+    poll, see is_delay_poll in state.c. Lanes never fuse, so Fx07 stands alone.
+*/
+static bool lockstep_lane_delay_poll(lockstep_t* batch, size_t lane, uint16_t start)
+{
+    if (start + 6 > DECODE_CACHE_SIZE * 2) {
+        return false;
+    }
+    decoded_instr_t poll = lockstep_fetch(batch, lane, start);
+    if (poll.op != OP_LD_VX_DT) {
+        return false; // most loops aren't polls, so this goes first
+    }
+    decoded_instr_t test = lockstep_fetch(batch, lane, start + 2);
+    decoded_instr_t jump = lockstep_fetch(batch, lane, start + 4);
+    return test.op == OP_SE_BYTE && test.x == poll.x && test.kk == 0 &&
+        jump.op == OP_JP && DECODED_NNN(jump) == start;
+}
+
+/*
+    One lane's counterpart of skip_idle in state.c: called after the lane took the
+    1nnn at jump_pc, with remaining instructions left in its run. Returns how many
+    of those are whole idle iterations it can skip. Kept out of line, so the ops
+    lockstep_exec_lane runs every step don't pay for its registers.
+*/
+static __attribute__((noinline)) uint64_t lockstep_lane_skip_idle(lockstep_t* batch, size_t lane, uint16_t jump_pc, uint64_t remaining)
+{
+    uint16_t target = batch->pc[lane];
+    uint8_t length;
+    if (target == jump_pc) {
+        length = IDLE_SELF_JUMP;
+    } else if (target + 4 == jump_pc && batch->delay_timer[lane] != 0 && lockstep_lane_delay_poll(batch, lane, target)) {
+        length = IDLE_POLL_DT;
+    } else {
+        return 0;
+    }
+    uint64_t skipped = remaining - remaining % length;
+    if (skipped > 0 && length == IDLE_POLL_DT) {
+        // the first skipped Fx07 might be the first to run since jumping in
+        batch->registers[lockstep_fetch(batch, lane, target).x * batch->stride + lane] = batch->delay_timer[lane];
+    }
+    batch->idle_cycles += skipped;
+    batch->idle[lane] += skipped;
+    return skipped;
+}
+
+/*
+    One lane's counterpart of state_idle_loop: the length of the idle loop the lane
+    is parked in, storing its first address in start, or 0 if it isn't idle.
+*/
+static uint8_t lockstep_lane_idle_loop(lockstep_t* batch, size_t lane, uint16_t* start)
+{
+    uint16_t pc = batch->pc[lane];
+    if (pc + 2 > DECODE_CACHE_SIZE * 2) {
+        return 0;
+    }
+    decoded_instr_t instr = lockstep_fetch(batch, lane, pc);
+    if (instr.op == OP_JP && DECODED_NNN(instr) == pc) {
+        *start = pc;
+        return IDLE_SELF_JUMP;
+    }
+    if (batch->delay_timer[lane] == 0) {
+        return 0;
+    }
+    for (uint16_t phase = 0; phase < IDLE_POLL_DT && phase * 2 <= pc; phase++) {
+        uint16_t base = pc - phase * 2;
+        if (lockstep_lane_delay_poll(batch, lane, base)) {
+            // parked on the 3x00 with a zero register, the jump back gets skipped
+            uint8_t x = lockstep_fetch(batch, lane, base).x;
+            if (phase == 1 && batch->registers[x * batch->stride + lane] == 0) {
+                return 0;
+            }
+            *start = base;
+            return IDLE_POLL_DT;
+        }
+    }
+    return 0;
+}
+
+/*
+    Moves a lane parked in the idle loop of the given start and length through
+    frames whole frames of it, as state_skip_idle_frames does, except for the timers.
+*/
+static void lockstep_lane_skip_frames(lockstep_t* batch, size_t lane, uint16_t start, uint8_t length,
+    uint64_t frames, uint32_t instructions_per_frame)
+{
+    if (length == IDLE_POLL_DT) {
+        batch->registers[lockstep_fetch(batch, lane, start).x * batch->stride + lane] =
+            batch->delay_timer[lane] - frames + 1;
+    }
+    uint64_t phase = (batch->pc[lane] - start) / 2;
+    batch->pc[lane] = start + 2 * ((phase + frames * instructions_per_frame) % length);
+    batch->retired[lane] += frames * instructions_per_frame;
+    batch->idle[lane] += frames * instructions_per_frame;
+}
+
+/*
+    Instructions the lane has left in the current run, the one it's about to run
+    included: group lanes count down on the group's clock, the others on their own.
+*/
+static inline uint64_t lockstep_lane_left(lockstep_t* batch, size_t lane)
+{
+    return batch->group[lane] ? batch->stop[lane] - batch->clock : batch->left[lane];
+}
+
+/*
+    Executes one instruction on one lane, pc already past it.
+    Mirrors the handlers in state.c and opcodes.c op for op; make test runs every
+    ROM in roms/ with and without --lockstep under each quirk profile to keep it so.
+*/
+static inline void lockstep_exec_lane(lockstep_t* batch, size_t lane, decoded_instr_t instr)
+{
+    size_t stride = batch->stride;
+    uint8_t* v = &(batch->registers[lane]);
+    uint8_t* memory = LANE_MEMORY(batch, lane);
+    uint16_t* pc = &(batch->pc[lane]);
+    uint16_t* index = &(batch->index[lane]);
+    uint16_t* sp = &(batch->sp[lane]);
+    uint16_t top, address;
+    uint8_t carry;
+
+    #define V(r) v[(r) * stride]
+    switch (instr.op) {
+        case OP_CLS:
+            for (int row = 0; row < DISPLAY_ROWS; row++) {
+                batch->display[row * stride + lane] = 0;
+            }
+            break;
+        case OP_RET:
+            *sp -= 2;
+            top = *sp & MEMORY_MASK;
+            *pc = (memory[top] << 8) | memory[(top + 1) & MEMORY_MASK];
+            break;
+        case OP_JP:
+            address = *pc - 2;
+            *pc = DECODED_NNN(instr);
+            if ((uint16_t) (address - *pc) <= 4 && !batch->group[lane]) {
+                // idle loops jump at most two instructions back; left still counts the
+                // jump, and the group skips its own
+                batch->left[lane] -= lockstep_lane_skip_idle(batch, lane, address, batch->left[lane] - 1);
+            }
+            break;
+        case OP_CALL:
+            top = *sp & MEMORY_MASK;
+            memory[top] = *pc >> 8;
+            memory[(top + 1) & MEMORY_MASK] = *pc & 0xff;
+            lockstep_mark_written(batch, top, 2);
+            *sp += 2;
+            *pc = DECODED_NNN(instr);
+            break;
+        case OP_SE_BYTE:
+            *pc += V(instr.x) == instr.kk ? 2 : 0;
+            break;
+        case OP_SNE_BYTE:
+            *pc += V(instr.x) != instr.kk ? 2 : 0;
+            break;
+        case OP_SE_REG:
+            *pc += V(instr.x) == V(instr.y) ? 2 : 0;
+            break;
+        case OP_LD_BYTE:
+            V(instr.x) = instr.kk;
+            break;
+        case OP_ADD_BYTE:
+            V(instr.x) += instr.kk;
+            break;
+        case OP_LD_REG:
+            V(instr.x) = V(instr.y);
+            break;
+        case OP_OR:
+            V(instr.x) |= V(instr.y);
+            V(0xF) = batch->quirks & QUIRK_VF_RESET ? 0 : V(0xF);
+            break;
+        case OP_AND:
+            V(instr.x) &= V(instr.y);
+            V(0xF) = batch->quirks & QUIRK_VF_RESET ? 0 : V(0xF);
+            break;
+        case OP_XOR:
+            V(instr.x) ^= V(instr.y);
+            V(0xF) = batch->quirks & QUIRK_VF_RESET ? 0 : V(0xF);
+            break;
+        case OP_ADD_REG:
+            carry = V(instr.x) + V(instr.y) > 0xFF;
+            V(instr.x) += V(instr.y);
+            V(0xF) = carry;
+            break;
+        case OP_SUB:
+            carry = V(instr.x) >= V(instr.y);
+            V(instr.x) -= V(instr.y);
+            V(0xF) = carry;
+            break;
+        case OP_SHR:
+            V(instr.x) = batch->quirks & QUIRK_SHIFT_VY ? V(instr.y) : V(instr.x);
+            carry = V(instr.x) & 1;
+            V(instr.x) >>= 1;
+            V(0xF) = carry;
+            break;
+        case OP_SUBN:
+            carry = V(instr.y) >= V(instr.x);
+            V(instr.x) = V(instr.y) - V(instr.x);
+            V(0xF) = carry;
+            break;
+        case OP_SHL:
+            V(instr.x) = batch->quirks & QUIRK_SHIFT_VY ? V(instr.y) : V(instr.x);
+            carry = V(instr.x) >> 7;
+            V(instr.x) <<= 1;
+            V(0xF) = carry;
+            break;
+        case OP_SNE_REG:
+            *pc += V(instr.x) != V(instr.y) ? 2 : 0;
+            break;
+        case OP_LD_I:
+            *index = DECODED_NNN(instr);
+            break;
+        case OP_JP_V0:
+            *pc = DECODED_NNN(instr) + V(batch->quirks & QUIRK_JUMP_VX ? instr.x : 0x0);
+            break;
+        case OP_RND:
+            V(instr.x) = instr.kk & rng_byte(&(batch->rng[lane]));
+            break;
+        case OP_DRW: {
+            uint8_t x = V(instr.x) % DISPLAY_WIDTH;
+            uint8_t y = V(instr.y) % DISPLAY_HEIGHT;
+            uint64_t collision = 0;
+            for (uint8_t row = 0; row < DECODED_N(instr) && y + row < DISPLAY_HEIGHT; row++) {
+                uint64_t sprite_row = ((uint64_t) memory[(*index + row) & MEMORY_MASK] << 56) >> x;
+                uint64_t* pixels = &(batch->display[(y + row) * stride + lane]);
+                collision |= *pixels & sprite_row;
+                *pixels ^= sprite_row;
+            }
+            V(0xF) = collision != 0;
+            break;
+        }
+        case OP_SKP:
+            *pc += batch->keys[(V(instr.x) & 0xF) * stride + lane] & 1 ? 2 : 0;
+            break;
+        case OP_SKNP:
+            *pc += batch->keys[(V(instr.x) & 0xF) * stride + lane] & 1 ? 0 : 2;
+            break;
+        case OP_LD_VX_DT:
+            V(instr.x) = batch->delay_timer[lane];
+            break;
+        case OP_LD_VX_K:
+            batch->key_wait_key[lane] = KEY_NONE;
+            batch->key_wait_register[lane] = instr.x;
+            batch->runnable[lane] = 0;
+            batch->converged = false;
+            batch->retired[lane] -= lockstep_lane_left(batch, lane) - 1; // the rest of the run was credited up front
+            break;
+        case OP_LD_DT_VX:
+            batch->delay_timer[lane] = V(instr.x);
+            break;
+        case OP_LD_ST_VX:
+            batch->sound_timer[lane] = V(instr.x);
+            break;
+        case OP_ADD_I_VX:
+            *index += V(instr.x);
+            break;
+        case OP_LD_F_VX:
+            *index = V(instr.x) * FONT_SIZE + FONTSET_OFFSET;
+            break;
+        case OP_LD_B_VX:
+            address = *index & MEMORY_MASK;
+            memory[(address + 2) & MEMORY_MASK] = V(instr.x) % 10;
+            memory[(address + 1) & MEMORY_MASK] = (V(instr.x) / 10) % 10;
+            memory[address] = (V(instr.x) / 100) % 10;
+            lockstep_mark_written(batch, address, 3);
+            break;
+        case OP_LD_MEM_VX:
+            for (int i = 0; i <= instr.x; i++) {
+                memory[(*index + i) & MEMORY_MASK] = V(i);
+            }
+            lockstep_mark_written(batch, *index & MEMORY_MASK, instr.x + 1);
+            *index += lockstep_index_step(batch, instr);
+            break;
+        case OP_LD_VX_MEM:
+            for (int i = 0; i <= instr.x; i++) {
+                V(i) = memory[(*index + i) & MEMORY_MASK];
+            }
+            *index += lockstep_index_step(batch, instr);
+            break;
+        default:
+            break;
+    }
+    #undef V
+}
+
+/*
+    Fetches, decodes and executes one instruction on one lane.
+*/
+static inline void lockstep_step_lane(lockstep_t* batch, size_t lane)
+{
+    uint16_t pc = batch->pc[lane];
+    decoded_instr_t instr = lockstep_fetch(batch, lane, pc);
+    batch->pc[lane] = pc + 2;
+    lockstep_exec_lane(batch, lane, instr);
+    batch->scalar_cycles++;
+}
+
+/*
+    Runs a lane outside the group on its own for the rest of its run, or until it
+    waits for a key. The 1nnn case of lockstep_exec_lane skips its idle loops.
+*/
+static void lockstep_run_lane(lockstep_t* batch, size_t lane)
+{
+    for (; batch->left[lane] > 0 && batch->runnable[lane]; batch->left[lane]--) {
+        lockstep_step_lane(batch, lane);
+    }
+}
+
+
+/*
+======================
+| Vector steps       |
+======================
+*/
+
+/*
+    Picks the group afresh: the runnable lanes with instructions left at the most
+    common pc, if there are at least LOCKSTEP_MIN_GROUP of them. Every other such
+    lane is parked where it is, to join the group if the group gets there, say
+    after the other side of a skip. Lanes are independent and each counts down its
+    own run, so the order they run in doesn't matter and joining late is fine.
+*/
+static void lockstep_regroup(lockstep_t* batch)
+{
+    uint32_t best = 0;
+    uint16_t best_pc = 0;
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        if (batch->group[lane]) {
+            batch->left[lane] = batch->stop[lane] - batch->clock;
+            batch->group[lane] = 0;
+        }
+        batch->parked[batch->pc[lane] & MEMORY_MASK] = 0;
+        if (batch->runnable[lane] && batch->left[lane] > 0) {
+            uint32_t count = ++batch->tally[batch->pc[lane] & MEMORY_MASK];
+            if (count > best) {
+                best = count;
+                best_pc = batch->pc[lane];
+            }
+        }
+    }
+    if (best < LOCKSTEP_MIN_GROUP) {
+        best = 0; // not worth a vector step, every lane goes scalar
+    }
+
+    size_t members = 0;
+    uint64_t next_stop = UINT64_MAX;
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        batch->tally[batch->pc[lane] & MEMORY_MASK] = 0;
+        if (!batch->runnable[lane] || batch->left[lane] == 0) {
+            continue;
+        }
+        if (best > 0 && batch->pc[lane] == best_pc) {
+            batch->group[lane] = 0xFF;
+            batch->stop[lane] = batch->clock + batch->left[lane];
+            next_stop = min(next_stop, batch->stop[lane]);
+            members++;
+        } else {
+            batch->parked[batch->pc[lane] & MEMORY_MASK]++;
+        }
+    }
+    batch->group_size = members;
+    batch->group_pc = best_pc;
+    batch->next_stop = next_stop;
+    batch->converged = true;
+}
+
+/*
+    After a step that sent the group different ways, keeps the lanes at the most
+    common pc as the group and parks the others, like lockstep_regroup but
+    looking only at the group. The lanes a skip left behind are the usual ones
+    to catch up again, a step later.
+*/
+static void lockstep_split(lockstep_t* batch)
+{
+    uint32_t best = 0;
+    uint16_t best_pc = 0;
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        if (batch->group[lane] && batch->runnable[lane]) {
+            uint32_t count = ++batch->tally[batch->pc[lane] & MEMORY_MASK];
+            if (count > best) {
+                best = count;
+                best_pc = batch->pc[lane];
+            }
+        }
+    }
+
+    uint64_t next_stop = UINT64_MAX;
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        if (!batch->group[lane]) {
+            continue;
+        }
+        batch->tally[batch->pc[lane] & MEMORY_MASK] = 0;
+        if (batch->runnable[lane] && batch->pc[lane] == best_pc) {
+            next_stop = min(next_stop, batch->stop[lane]);
+            continue;
+        }
+        batch->group[lane] = 0;
+        batch->group_size--;
+        batch->left[lane] = batch->runnable[lane] ? batch->stop[lane] - batch->clock : 0;
+        batch->parked[batch->pc[lane] & MEMORY_MASK] += batch->runnable[lane] ? 1 : 0;
+    }
+    batch->group_pc = best_pc;
+    batch->next_stop = next_stop;
+    batch->converged = true;
+    if (batch->group_size < LOCKSTEP_MIN_GROUP) {
+        batch->group_size = 0; // not worth a vector step any more
+    }
+}
+
+/*
+    Adds the lanes parked at the group's pc to the group.
+*/
+static void lockstep_rejoin(lockstep_t* batch)
+{
+    uint16_t pc = batch->group_pc;
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        if (!batch->group[lane] && batch->pc[lane] == pc && batch->runnable[lane] && batch->left[lane] > 0) {
+            batch->group[lane] = 0xFF;
+            batch->stop[lane] = batch->clock + batch->left[lane];
+            batch->next_stop = min(batch->next_stop, batch->stop[lane]);
+            batch->group_size++;
+        }
+    }
+    batch->parked[pc & MEMORY_MASK] = 0;
+}
+
+/*
+    Lets go of the group lanes whose run has ended by the group's clock. If too
+    few are left to be worth a vector step, the group breaks up.
+*/
+static void lockstep_drop_finished(lockstep_t* batch)
+{
+    uint64_t next_stop = UINT64_MAX;
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        if (!batch->group[lane]) {
+            continue;
+        }
+        if (batch->stop[lane] <= batch->clock) {
+            batch->group[lane] = 0;
+            batch->left[lane] = 0;
+            batch->group_size--;
+        } else {
+            next_stop = min(next_stop, batch->stop[lane]);
+        }
+    }
+    batch->next_stop = next_stop;
+    if (batch->group_size < LOCKSTEP_MIN_GROUP) {
+        batch->group_size = 0;
+    }
+}
+
+/*
+    Once the group is done, runs every lane with instructions left on its own to
+    the end of its run.
+*/
+static void lockstep_finish(lockstep_t* batch)
+{
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        if (batch->group[lane]) {
+            batch->left[lane] = batch->stop[lane] - batch->clock;
+            batch->group[lane] = 0;
+        }
+        batch->parked[batch->pc[lane] & MEMORY_MASK] = 0;
+        lockstep_run_lane(batch, lane);
+    }
+}
+
+
+/*
+    Moves every lane in group to target, or target + 2 where skip is set.
+*/
+static inline void lockstep_jump_group(lockstep_t* batch, uint8_t* group, uint16_t target, const uint8_t* skip)
+{
+    EACH_CHUNK(batch, chunk) {
+        lanes16_t next = (lanes16_t){ 0 } + target;
+        if (skip != NULL) {
+            next += WIDEN(LANES8(skip, chunk)) & 2;
+        }
+        LANES16(batch->pc, chunk) = BLEND(LANES16(batch->pc, chunk), next, WIDEN_MASK(LANES8(group, chunk)));
+    }
+}
+
+/*
+    Runs instr, fetched at pc, on every lane in group. Returns the pc the group
+    moves on to; ops that may send its lanes different ways also clear converged,
+    so the run regroups.
+*/
+static inline uint16_t lockstep_exec_group(lockstep_t* batch, uint8_t* group, decoded_instr_t instr, uint16_t pc)
+{
+    uint16_t next = pc + 2;
+    uint8_t* vx = REGISTER(batch, instr.x);
+    uint8_t* vy = REGISTER(batch, instr.y);
+    uint8_t* vf = REGISTER(batch, 0xF);
+    uint8_t skip[batch->stride] __attribute__((aligned(LOCKSTEP_ALIGN)));
+    uint8_t passing[batch->stride] __attribute__((aligned(LOCKSTEP_ALIGN)));
+
+    switch (instr.op) {
+        case OP_JP:
+            next = DECODED_NNN(instr);
+            break;
+        case OP_SE_BYTE:
+        case OP_SNE_BYTE:
+        case OP_SE_REG:
+        case OP_SNE_REG: {
+            bool unequal = instr.op == OP_SNE_BYTE || instr.op == OP_SNE_REG;
+            EACH_CHUNK(batch, chunk) {
+                lanes8_t mask = LANES8(group, chunk);
+                lanes8_t other = LANES8(vy, chunk);
+                if (instr.op == OP_SE_BYTE || instr.op == OP_SNE_BYTE) {
+                    other = (lanes8_t){ 0 } + instr.kk;
+                }
+                lanes8_t equal = (lanes8_t)(LANES8(vx, chunk) == other);
+                lanes8_t skipped = (unequal ? ~equal : equal) & mask;
+                LANES8(skip, chunk) = skipped;
+                LANES8(passing, chunk) = mask & ~skipped;
+            }
+            lockstep_jump_group(batch, group, next, skip);
+            if (!lanes_any(passing, batch->stride)) {
+                return next + 2;
+            }
+            if (lanes_any(skip, batch->stride)) {
+                batch->converged = false;
+            }
+            return next;
+        }
+        case OP_LD_BYTE:
+            EACH_CHUNK(batch, chunk) {
+                LANES8(vx, chunk) = BLEND(LANES8(vx, chunk), (lanes8_t){ 0 } + instr.kk, LANES8(group, chunk));
+            }
+            break;
+        case OP_ADD_BYTE:
+            EACH_CHUNK(batch, chunk) {
+                lanes8_t x = LANES8(vx, chunk);
+                LANES8(vx, chunk) = BLEND(x, x + instr.kk, LANES8(group, chunk));
+            }
+            break;
+        case OP_LD_REG:
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR: {
+            // a quirk is one branch per vector step, shared by the whole group
+            bool vf_reset = instr.op != OP_LD_REG && (batch->quirks & QUIRK_VF_RESET);
+            EACH_CHUNK(batch, chunk) {
+                lanes8_t x = LANES8(vx, chunk), y = LANES8(vy, chunk);
+                lanes8_t result = x ^ y;
+                if (instr.op == OP_LD_REG) {
+                    result = y;
+                } else if (instr.op == OP_OR) {
+                    result = x | y;
+                } else if (instr.op == OP_AND) {
+                    result = x & y;
+                }
+                LANES8(vx, chunk) = BLEND(x, result, LANES8(group, chunk));
+                if (vf_reset) {
+                    LANES8(vf, chunk) = BLEND(LANES8(vf, chunk), (lanes8_t){ 0 }, LANES8(group, chunk));
+                }
+            }
+            break;
+        }
+        case OP_ADD_REG:
+        case OP_SUB:
+        case OP_SUBN:
+        case OP_SHR:
+        case OP_SHL: {
+            // Vx is stored before VF, so with x == 0xF the flag wins as in opcodes.c
+            bool shift_vy = batch->quirks & QUIRK_SHIFT_VY;
+            EACH_CHUNK(batch, chunk) {
+                lanes8_t mask = LANES8(group, chunk);
+                lanes8_t x = LANES8(vx, chunk), y = LANES8(vy, chunk);
+                lanes8_t result, flag;
+                lanes8_t shifted = shift_vy ? y : x;
+                switch (instr.op) {
+                    case OP_ADD_REG:
+                        result = x + y;
+                        flag = (lanes8_t)(result < x) & 1;
+                        break;
+                    case OP_SUB:
+                        result = x - y;
+                        flag = (lanes8_t)(x >= y) & 1;
+                        break;
+                    case OP_SUBN:
+                        result = y - x;
+                        flag = (lanes8_t)(y >= x) & 1;
+                        break;
+                    case OP_SHR:
+                        result = shifted >> 1;
+                        flag = shifted & 1;
+                        break;
+                    default:
+                        result = shifted << 1;
+                        flag = shifted >> 7;
+                        break;
+                }
+                LANES8(vx, chunk) = BLEND(x, result, mask);
+                LANES8(vf, chunk) = BLEND(LANES8(vf, chunk), flag, mask);
+            }
+            break;
+        }
+        case OP_LD_I:
+            EACH_CHUNK(batch, chunk) {
+                LANES16(batch->index, chunk) = BLEND(LANES16(batch->index, chunk),
+                    (lanes16_t){ 0 } + DECODED_NNN(instr), WIDEN_MASK(LANES8(group, chunk)));
+            }
+            break;
+        case OP_ADD_I_VX:
+        case OP_LD_F_VX:
+            EACH_CHUNK(batch, chunk) {
+                lanes16_t index = LANES16(batch->index, chunk);
+                lanes16_t x = WIDEN(LANES8(vx, chunk));
+                lanes16_t result = index + x;
+                if (instr.op == OP_LD_F_VX) {
+                    result = x * FONT_SIZE + FONTSET_OFFSET;
+                }
+                LANES16(batch->index, chunk) = BLEND(index, result, WIDEN_MASK(LANES8(group, chunk)));
+            }
+            break;
+        case OP_LD_VX_DT:
+            EACH_CHUNK(batch, chunk) {
+                LANES8(vx, chunk) = BLEND(LANES8(vx, chunk), LANES8(batch->delay_timer, chunk),
+                    LANES8(group, chunk));
+            }
+            break;
+        case OP_LD_DT_VX:
+        case OP_LD_ST_VX: {
+            uint8_t* timer = instr.op == OP_LD_DT_VX ? batch->delay_timer : batch->sound_timer;
+            EACH_CHUNK(batch, chunk) {
+                LANES8(timer, chunk) = BLEND(LANES8(timer, chunk), LANES8(vx, chunk), LANES8(group, chunk));
+            }
+            break;
+        }
+        case OP_NOP:
+        case OP_UNDECODED:
+            break;
+        default:
+            // memory, the display, RND and the keys go lane by lane, with pc already past instr
+            lockstep_jump_group(batch, group, next, NULL);
+            for (size_t lane = 0; lane < batch->lanes; lane++) {
+                if (group[lane]) {
+                    lockstep_exec_lane(batch, lane, instr);
+                }
+            }
+            if (instr.op == OP_CALL) {
+                return DECODED_NNN(instr);
+            }
+            if (instr.op == OP_RET || instr.op == OP_JP_V0 || instr.op == OP_SKP || instr.op == OP_SKNP) {
+                batch->converged = false;
+            }
+            return next;
+    }
+    lockstep_jump_group(batch, group, next, NULL);
+    return next;
+}
+
+/*
+    The group's counterpart of skip_idle in state.c: called after the group took
+    the 1nnn at jump_pc to target, with remaining instructions left in the run.
+    Returns how many of those are whole idle iterations the group skips; lanes
+    that would skip a different number on their own leave the group and do so.
+*/
+static uint64_t lockstep_skip_idle(lockstep_t* batch, uint16_t jump_pc, uint16_t target, uint64_t remaining)
+{
+    uint8_t length;
+    decoded_instr_t poll, test;
+    if (target == jump_pc) {
+        length = IDLE_SELF_JUMP;
+    } else if (target + 4 == jump_pc && target + 6 <= DECODE_CACHE_SIZE * 2 &&
+        lockstep_shared_fetch(batch, target, &poll) && lockstep_shared_fetch(batch, target + 2, &test) &&
+        poll.op == OP_LD_VX_DT && test.op == OP_SE_BYTE && test.x == poll.x && test.kk == 0) {
+        length = IDLE_POLL_DT;
+    } else {
+        return 0;
+    }
+    uint64_t skipped = remaining - remaining % length;
+    uint64_t next_stop = UINT64_MAX;
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        if (!batch->group[lane]) {
+            continue;
+        }
+        // a lane that joined late has more of its run left, and skips as far as it would alone
+        uint64_t own = batch->stop[lane] - batch->clock;
+        uint64_t lane_skipped = own - own % length;
+        if (length == IDLE_POLL_DT && batch->delay_timer[lane] == 0) {
+            lane_skipped = 0; // the timer ran out, so the lane is about to leave the loop
+        }
+        if (lane_skipped > 0 && length == IDLE_POLL_DT) {
+            // the first skipped Fx07 might be the first to run since jumping in
+            batch->registers[poll.x * batch->stride + lane] = batch->delay_timer[lane];
+        }
+        batch->idle[lane] += lane_skipped;
+        batch->idle_cycles += lane_skipped;
+        if (lane_skipped == skipped) {
+            next_stop = min(next_stop, batch->stop[lane]);
+            continue;
+        }
+        batch->group[lane] = 0;
+        batch->group_size--;
+        batch->left[lane] = own - lane_skipped;
+        batch->parked[target & MEMORY_MASK] += batch->left[lane] > 0 ? 1 : 0;
+    }
+    batch->next_stop = next_stop;
+    if (batch->group_size < LOCKSTEP_MIN_GROUP) {
+        batch->group_size = 0;
+    }
+    return skipped;
+}
+
+
+/*
+======================
+| Public interface   |
+======================
+*/
+
+/*
+    Allocates a batch of at least the given number of lanes.
+*/
+lockstep_t* lockstep_new(size_t lanes)
+{
+    lockstep_t* batch = calloc(1, sizeof(lockstep_t));
+    if (batch == NULL || lanes == 0) {
+        fprintf(stderr, "error: unable to allocate memory for lockstep batch\n");
+        free(batch);
+        return NULL;
+    }
+    size_t stride = (lanes + LOCKSTEP_VECTOR - 1) / LOCKSTEP_VECTOR * LOCKSTEP_VECTOR;
+    batch->capacity = stride;
+    batch->stride = stride;
+    batch->registers = lockstep_alloc(0x10 * stride);
+    batch->index = lockstep_alloc(stride * sizeof(uint16_t));
+    batch->pc = lockstep_alloc(stride * sizeof(uint16_t));
+    batch->sp = lockstep_alloc(stride * sizeof(uint16_t));
+    batch->delay_timer = lockstep_alloc(stride);
+    batch->sound_timer = lockstep_alloc(stride);
+    batch->keys = lockstep_alloc(0x10 * stride);
+    batch->rng = lockstep_alloc(stride * sizeof(rng_t));
+    batch->key_wait_register = lockstep_alloc(stride);
+    batch->key_wait_key = lockstep_alloc(stride);
+    batch->display = lockstep_alloc(DISPLAY_ROWS * stride * sizeof(uint64_t));
+    batch->memory = lockstep_alloc(stride * (size_t)(MEMORY_MASK + 1));
+    batch->runnable = lockstep_alloc(stride);
+    batch->group = lockstep_alloc(stride);
+    batch->retired = lockstep_alloc(stride * sizeof(uint64_t));
+    batch->idle = lockstep_alloc(stride * sizeof(uint64_t));
+    batch->resting = lockstep_alloc(stride);
+    batch->left = lockstep_alloc(stride * sizeof(uint64_t));
+    batch->stop = lockstep_alloc(stride * sizeof(uint64_t));
+    if (batch->registers == NULL || batch->index == NULL || batch->pc == NULL || batch->sp == NULL ||
+        batch->delay_timer == NULL || batch->sound_timer == NULL || batch->keys == NULL ||
+        batch->rng == NULL || batch->key_wait_register == NULL || batch->key_wait_key == NULL ||
+        batch->display == NULL || batch->memory == NULL || batch->runnable == NULL || batch->group == NULL ||
+        batch->retired == NULL || batch->idle == NULL || batch->resting == NULL || batch->left == NULL || batch->stop == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for lockstep batch\n");
+        lockstep_delete(batch);
+        return NULL;
+    }
+    lockstep_init(batch, lanes);
+    return batch;
+}
+
+/*
+    Resets the first lanes lanes to a freshly initialized state, as state_init
+    does, and parks the rest. Every lane gets the default seed of 1.
+*/
+void lockstep_init(lockstep_t* batch, size_t lanes)
+{
+    size_t stride = batch->stride;
+    if (lanes > batch->capacity) {
+        fprintf(stderr, "error: batch has room for %zu lanes, not %zu\n", batch->capacity, lanes);
+        lanes = batch->capacity;
+    }
+    batch->lanes = lanes;
+    batch->profile = PROFILE_DEFAULT;
+    batch->quirks = QUIRKS_DEFAULT;
+    memset(batch->registers, 0, 0x10 * stride);
+    memset(batch->index, 0, stride * sizeof(uint16_t));
+    memset(batch->delay_timer, 0, stride);
+    memset(batch->sound_timer, 0, stride);
+    memset(batch->keys, 0, 0x10 * stride);
+    memset(batch->display, 0, DISPLAY_ROWS * stride * sizeof(uint64_t));
+    memset(batch->key_wait_register, KEY_NONE, stride);
+    memset(batch->key_wait_key, KEY_NONE, stride);
+    memset(batch->runnable, 0, stride);
+    memset(batch->group, 0, stride);
+    memset(batch->runnable, 0xFF, lanes);
+    memset(batch->retired, 0, stride * sizeof(uint64_t));
+    memset(batch->idle, 0, stride * sizeof(uint64_t));
+    memset(batch->resting, 0, stride);
+    memset(batch->left, 0, stride * sizeof(uint64_t));
+    for (size_t lane = 0; lane < stride; lane++) {
+        batch->pc[lane] = ROM_START;
+        batch->sp[lane] = STACK_OFFSET;
+        rng_seed(&(batch->rng[lane]), 1); // as state_init
+    }
+
+    memset(batch->image, 0, sizeof(batch->image));
+    memcpy(&(batch->image[FONTSET_OFFSET]), fontset, FONTSET_SIZE);
+    for (size_t lane = 0; lane < lanes; lane++) {
+        memcpy(LANE_MEMORY(batch, lane), batch->image, sizeof(batch->image));
+    }
+    memset(batch->written, 0, sizeof(batch->written));
+    memset(batch->decode_cache, OP_UNDECODED, sizeof(batch->decode_cache));
+    batch->group_size = 0;
+    memset(batch->parked, 0, sizeof(batch->parked));
+    batch->busy_lane = 0;
+    batch->converged = false;
+    batch->group_pc = ROM_START;
+    batch->vector_cycles = 0;
+    batch->scalar_cycles = 0;
+    batch->idle_cycles = 0;
+}
+
+/*
+    Loads the same ROM into every lane at ROM_START, see rom_to_mem.
+*/
+bool lockstep_load(lockstep_t* batch, const uint8_t* rom, size_t size)
+{
+    if (size > (size_t)(MEM_SIZE - ROM_START)) {
+        fprintf(stderr, "error: rom of %zu bytes doesn't fit at %03x\n", size, ROM_START);
+        return false;
+    }
+    memcpy(&(batch->image[ROM_START]), rom, size);
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        memcpy(LANE_MEMORY(batch, lane) + ROM_START, rom, size);
+    }
+    memset(batch->decode_cache, OP_UNDECODED, sizeof(batch->decode_cache));
+    return true;
+}
+
+void lockstep_delete(lockstep_t* batch)
+{
+    if (batch == NULL) {
+        return;
+    }
+    free(batch->registers);
+    free(batch->index);
+    free(batch->pc);
+    free(batch->sp);
+    free(batch->delay_timer);
+    free(batch->sound_timer);
+    free(batch->keys);
+    free(batch->rng);
+    free(batch->key_wait_register);
+    free(batch->key_wait_key);
+    free(batch->display);
+    free(batch->memory);
+    free(batch->runnable);
+    free(batch->group);
+    free(batch->retired);
+    free(batch->idle);
+    free(batch->resting);
+    free(batch->left);
+    free(batch->stop);
+    free(batch);
+}
+
+/*
+    Seeds one lane's RND generator, see state_seed.
+*/
+void lockstep_seed(lockstep_t* batch, size_t lane, uint64_t seed)
+{
+    rng_seed(&(batch->rng[lane]), seed);
+}
+
+/*
+    Presses or releases a key on one lane, completing its Fx0A like state_set_key.
+    Unlike state_set_key this isn't thread safe: call it between lockstep_runs.
+*/
+void lockstep_set_key(lockstep_t* batch, size_t lane, uint8_t key, bool down)
+{
+    if (key >= 0x10 || lane >= batch->lanes) {
+        return;
+    }
+    batch->keys[key * batch->stride + lane] = down;
+    if (batch->key_wait_register[lane] != KEY_NONE) {
+        if (down && batch->key_wait_key[lane] == KEY_NONE) {
+            batch->key_wait_key[lane] = key;
+        } else if (!down && key == batch->key_wait_key[lane]) {
+            batch->registers[batch->key_wait_register[lane] * batch->stride + lane] = key;
+            batch->key_wait_register[lane] = KEY_NONE;
+            batch->runnable[lane] = 0xFF;
+        }
+    }
+}
+
+/*
+    True while the lane is suspended at Fx0A.
+*/
+bool lockstep_waiting(lockstep_t* batch, size_t lane)
+{
+    return batch->key_wait_register[lane] != KEY_NONE;
+}
+
+/*
+    Runs the given number of instructions on every lane that isn't waiting for a
+    key; a lane that reaches Fx0A stops there for the rest of the run.
+    Returns CYCLE_KEY_WAIT if every lane ended up waiting, else CYCLE_SUCCESS.
+*/
+LOCKSTEP_TARGETS
+int lockstep_run(lockstep_t* batch, uint64_t cycles)
+{
+    if (batch == NULL) {
+        fprintf(stderr, "error: null batch\n");
+        return CYCLE_ERROR;
+    }
+    batch->clock = 0;
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        batch->group[lane] = 0;
+        batch->left[lane] = batch->runnable[lane] && !batch->resting[lane] ? cycles : 0;
+        batch->retired[lane] += batch->left[lane];
+        batch->resting[lane] = 0;
+    }
+    lockstep_regroup(batch);
+    while (batch->group_size > 0) {
+        decoded_instr_t instr;
+        if (!lockstep_shared_fetch(batch, batch->group_pc, &instr)) {
+            // some lane rewrote this code, so the group may not agree on what it is
+            batch->group_size = 0;
+            break;
+        }
+        uint16_t pc = batch->group_pc;
+        batch->vector_cycles += batch->group_size;
+        batch->group_pc = lockstep_exec_group(batch, batch->group, instr, pc);
+        batch->clock++;
+        if (instr.op == OP_JP) {
+            batch->clock += lockstep_skip_idle(batch, pc, batch->group_pc, batch->next_stop - batch->clock);
+        }
+        if (batch->clock >= batch->next_stop) {
+            lockstep_drop_finished(batch);
+        }
+        if (batch->group_size > 0 && !batch->converged) {
+            lockstep_split(batch);
+        }
+        if (batch->group_size > 0 && batch->parked[batch->group_pc & MEMORY_MASK] > 0) {
+            lockstep_rejoin(batch);
+        }
+    }
+    lockstep_finish(batch);
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        if (batch->runnable[lane]) {
+            return CYCLE_SUCCESS;
+        }
+    }
+    return batch->lanes > 0 ? CYCLE_KEY_WAIT : CYCLE_SUCCESS;
+}
+
+/*
+    Skips up to the given number of whole frames while every runnable lane is parked
+    in an idle loop at a frame boundary, returning how many were skipped. Each lane
+    ends up as state_skip_idle_frames would leave it, and every lane's timers tick
+    once per skipped frame, as lockstep_tick_timers would.
+*/
+uint64_t lockstep_skip_idle_frames(lockstep_t* batch, uint64_t frames, uint32_t instructions_per_frame)
+{
+    uint16_t start;
+    size_t busy = batch->busy_lane;
+    if (busy < batch->lanes && batch->runnable[busy] && lockstep_lane_idle_loop(batch, busy, &start) == 0) {
+        return 0; // usually still busy, which saves looking at every other lane
+    }
+    size_t idle = 0;
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        if (!batch->runnable[lane]) {
+            continue;
+        }
+        uint8_t length = lockstep_lane_idle_loop(batch, lane, &start);
+        if (length == 0 || instructions_per_frame < length) {
+            batch->busy_lane = lane;
+            return 0;
+        }
+        if (length == IDLE_POLL_DT) {
+            frames = min(frames, (uint64_t) batch->delay_timer[lane]);
+        }
+        idle++;
+    }
+    if (frames == 0) {
+        return 0;
+    }
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        if (!batch->runnable[lane]) {
+            continue;
+        }
+        uint8_t length = lockstep_lane_idle_loop(batch, lane, &start);
+        lockstep_lane_skip_frames(batch, lane, start, length, frames, instructions_per_frame);
+    }
+    for (size_t lane = 0; lane < batch->stride; lane++) {
+        batch->delay_timer[lane] = batch->delay_timer[lane] > frames ? batch->delay_timer[lane] - frames : 0;
+        batch->sound_timer[lane] = batch->sound_timer[lane] > frames ? batch->sound_timer[lane] - frames : 0;
+    }
+    batch->idle_cycles += idle * frames * instructions_per_frame;
+    return frames;
+}
+
+/*
+    Lets every runnable lane parked in an idle loop at a frame boundary skip the
+    coming frame, as state_skip_idle_frames would for it alone, when not every lane
+    is idle for lockstep_skip_idle_frames. Those lanes sit out the next lockstep_run,
+    which should be that frame, and lockstep_tick_timers ticks them as usual.
+*/
+void lockstep_rest_idle_lanes(lockstep_t* batch, uint32_t instructions_per_frame)
+{
+    for (size_t lane = 0; lane < batch->lanes; lane++) {
+        uint16_t start;
+        uint8_t length;
+        if (!batch->runnable[lane] || (length = lockstep_lane_idle_loop(batch, lane, &start)) == 0 ||
+            instructions_per_frame < length) {
+            continue;
+        }
+        lockstep_lane_skip_frames(batch, lane, start, length, 1, instructions_per_frame);
+        batch->resting[lane] = 0xFF;
+    }
+}
+
+/*
+    Counts both timers of every lane down by one, see state_tick_timers.
+*/
+LOCKSTEP_TARGETS
+void lockstep_tick_timers(lockstep_t* batch)
+{
+    EACH_CHUNK(batch, chunk) {
+        // lanes compare to -1 where nonzero, so adding the comparison counts down
+        lanes8_t delay = LANES8(batch->delay_timer, chunk);
+        lanes8_t sound = LANES8(batch->sound_timer, chunk);
+        LANES8(batch->delay_timer, chunk) = delay + (lanes8_t)(delay != 0);
+        LANES8(batch->sound_timer, chunk) = sound + (lanes8_t)(sound != 0);
+    }
+}
+
+/*
+    Copies one lane into state, which can then carry on with any engine.
+    Any JIT attached to state is invalidated by state_init first.
+*/
+void lockstep_extract(lockstep_t* batch, size_t lane, emu_state_t* state)
+{
+    size_t stride = batch->stride;
+    state_init(state);
+    uint16_t keys = 0;
+    for (int r = 0; r < 0x10; r++) {
+        state->registers[r] = batch->registers[r * stride + lane];
+        keys |= (batch->keys[r * stride + lane] & 1) << r;
+    }
+    state->keys = keys;
+    for (int row = 0; row < DISPLAY_ROWS; row++) {
+        state->display[row] = batch->display[row * stride + lane];
+    }
+    memcpy(state->memory, LANE_MEMORY(batch, lane), sizeof(state->memory));
+    state->index = batch->index[lane];
+    state->pc = batch->pc[lane];
+    state->sp = batch->sp[lane];
+    state->delay_timer = batch->delay_timer[lane];
+    state->sound_timer = batch->sound_timer[lane];
+    state->rng = batch->rng[lane];
+    state->key_wait_key = batch->key_wait_key[lane];
+    state->key_wait_register = batch->key_wait_register[lane];
+    state->idle_cycles = batch->idle[lane];
+    state_set_profile(state, batch->profile);
+}
+
+/*
+    Sets the quirk profile every lane runs, see state_set_profile. Call it after
+    lockstep_init. The kernels test the flags once per vector step rather than
+    being compiled per profile, since each test is shared by the whole group.
+*/
+void lockstep_set_profile(lockstep_t* batch, quirk_profile_t profile)
+{
+    batch->profile = profile;
+    batch->quirks = quirks_flags(profile);
+}
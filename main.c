@@ -2,27 +2,192 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <string.h>
+#include "includes/decode.h"
 #include "includes/emu.h"
-#include "includes/sdl_utils.h"
+#include "includes/jit.h"
+#include "includes/pack.h"
+#include "includes/profiler.h"
+#include "includes/quirks.h"
+#include "includes/rewind.h"
+#include "includes/scheduler.h"
+#include "includes/trace.h"
+#ifdef SDLMODE
+    #include <pthread.h>
+    #include "includes/present.h"
+    #include "includes/sdl_utils.h"
+    #define SDL_USAGE "[--palette mono|amber|green|lcd|RRGGBB,RRGGBB] [--mute] "
+#else
+    #define SDL_USAGE "" // no window or audio to set up
+#endif
 
 
 
+#ifdef SDLMODE
+/*
+    The emulation thread's share of the front end, and the flags it trades with
+    the SDL thread. Keys don't go through here: sdl_event_handler hands them
+    straight to the core with state_set_key.
+*/
+typedef struct emu_thread {
+    emu_state_t* state;
+    scheduler_t* scheduler;
+    rewind_t* rewind;
+    present_t present;  // finished frames, for the SDL thread to draw
+    Uint32 wake_event;  // pushed to the SDL thread when a frame is published
+    bool rewinding;     // set by the SDL thread while the rewind key is held
+    bool quit;          // set by the SDL thread to stop the core
+    bool done;          // set by the core when the ROM can't go on
+    bool wake_pending;  // a wake_event is queued and not handled yet, so another isn't needed
+} emu_thread_t;
+
+/*
+    Lets the SDL thread know there's something to draw, at most one event at a time.
+*/
+static void emu_thread_wake(emu_thread_t* emu)
+{
+    if (!__atomic_exchange_n(&(emu->wake_pending), true, __ATOMIC_ACQ_REL)) {
+        SDL_Event event = { .type = emu->wake_event };
+        SDL_PushEvent(&event);
+    }
+}
+
+/*
+    Runs frames on the scheduler's clock and publishes each one, never waiting
+    on the SDL thread: it takes frames when it's ready and skips any it missed.
+*/
+static void* emu_thread_run(void* arg)
+{
+    emu_thread_t* emu = arg;
+    emu_state_t* state = emu->state;
+    bool stopped = false;
+    while (!stopped && !__atomic_load_n(&(emu->quit), __ATOMIC_ACQUIRE)) {
+        bool rewinding = emu->rewind != NULL && __atomic_load_n(&(emu->rewinding), __ATOMIC_ACQUIRE);
+        if (state_waiting_for_key(state) && !rewinding && state->delay_timer == 0 && state->sound_timer == 0) {
+            // Fx0A with the timers stopped: nothing can change until a key comes in,
+            // so sleep until state_set_key (or state_wake, to quit or rewind) says so
+            state_wait_key(state, KEY_WAIT_IDLE_MS);
+            scheduler_resync(emu->scheduler);
+            continue;
+        }
+        // sleep until the frame's deadline instead of spinning on the clock
+        scheduler_wait(emu->scheduler);
+        int status = CYCLE_SUCCESS;
+        if (rewinding) {
+            // play the history backwards a frame per frame, holding at the oldest
+            rewind_step(emu->rewind, state);
+            scheduler_skip_frame(emu->scheduler);
+        } else {
+            status = scheduler_run_frame(emu->scheduler, state);
+            if (emu->rewind != NULL) {
+                rewind_record(emu->rewind, state);
+            }
+        }
+        present_publish(&(emu->present), state, emu->scheduler->frames);
+        stopped = status != CYCLE_SUCCESS && status != CYCLE_KEY_WAIT;
+        if (stopped) {
+            __atomic_store_n(&(emu->done), true, __ATOMIC_RELEASE);
+        }
+        emu_thread_wake(emu);
+    }
+    return NULL;
+}
+#endif
+
 
 int main(const int argc, char** argv)
 
 {
-    const int expected_arg_count = 2;
-    if (argc != expected_arg_count) {
-        fprintf(stderr, "usage: %s <rom file>\n", argv[0]);
+    char* rom = NULL;
+    int scale = SDL_SCALE;
+    long instructions_per_frame = DEFAULT_IPF;
+    bool ipf_set = false; // given with --ipf, rather than taken from the pack
+    long rewind_seconds = REWIND_DEFAULT_SECONDS;
+    uint64_t seed = time(NULL);
+    char* quirks_name = NULL;
+    char* profile_name = NULL;
+    char* trace_name = NULL;
+    char* pack_name = NULL;
+    #ifdef SDLMODE
+        char* palette_name = "mono";
+        bool mute = false;
+    #endif
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--scale") == 0 && arg + 1 < argc) {
+            scale = atoi(argv[++arg]);
+        #ifdef SDLMODE
+        } else if (strcmp(argv[arg], "--palette") == 0 && arg + 1 < argc) {
+            palette_name = argv[++arg];
+        } else if (strcmp(argv[arg], "--mute") == 0) {
+            mute = true;
+        #endif
+        } else if (strcmp(argv[arg], "--ipf") == 0 && arg + 1 < argc) {
+            instructions_per_frame = atol(argv[++arg]);
+            ipf_set = true;
+        } else if (strcmp(argv[arg], "--rewind") == 0 && arg + 1 < argc) {
+            rewind_seconds = atol(argv[++arg]);
+        } else if (strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc) {
+            seed = strtoull(argv[++arg], NULL, 0);
+        } else if (strcmp(argv[arg], "--quirks") == 0 && arg + 1 < argc) {
+            quirks_name = argv[++arg];
+        } else if (strcmp(argv[arg], "--profile") == 0 && arg + 1 < argc) {
+            profile_name = argv[++arg];
+        } else if (strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc) {
+            trace_name = argv[++arg];
+        } else if (strcmp(argv[arg], "--pack") == 0 && arg + 1 < argc) {
+            pack_name = argv[++arg];
+        } else if (rom == NULL && argv[arg][0] != '-') {
+            rom = argv[arg];
+        } else {
+            rom = NULL;
+            break;
+        }
+    }
+    if (rom == NULL || scale <= 0 || instructions_per_frame < 0 || rewind_seconds < 0) {
+        fprintf(stderr, "usage: %s [--scale N] " SDL_USAGE "[--ipf N|0] [--rewind SECONDS|0] [--seed N] [--quirks default|chip8|chip48|schip] [--profile FILE] [--trace FILE] [--pack FILE] <rom file>\n", argv[0]);
         exit(1);
     }
+    #ifndef PROFILER
+        if (profile_name != NULL) {
+            fprintf(stderr, "error: --profile needs a build with PROFILER=1\n");
+            exit(1);
+        }
+    #endif
+    #ifndef TRACE
+        if (trace_name != NULL) {
+            fprintf(stderr, "error: --trace needs a build with TRACE=1\n");
+            exit(1);
+        }
+    #endif
     emu_state_t* state = state_new();
     if (state == NULL) {
         exit(1);
     }
-    srand(time(NULL)); // seed rng for RND instruction
     state_init(state);
+    state_seed(state, seed); // seed rng for RND instruction
+    #ifdef JIT
+        jit_t* jit = jit_new();
+        if (jit == NULL) {
+            exit(1);
+        }
+        jit_attach(jit, state);
+    #endif
+    profiler_t* profiler = NULL;
+    if (profile_name != NULL) {
+        profiler = profiler_new();
+        if (profiler == NULL) {
+            exit(1);
+        }
+        profiler_attach(profiler, state);
+    }
+    trace_t* trace = NULL;
+    if (trace_name != NULL) {
+        trace = trace_open(trace_name);
+        if (trace == NULL) {
+            exit(1);
+        }
+        trace_attach(trace, state);
+    }
     #ifdef DEBUG
         setup_ncurses();
     #endif
@@ -36,7 +201,12 @@ int main(const int argc, char** argv)
 
 
     #ifdef SDLMODE
-        SDL_Window* window = sdl_create_window(argv[1]);
+        sdl_palette_t palette;
+        if (!sdl_parse_palette(palette_name, &palette)) {
+            fprintf(stderr, "error: unknown palette %s\n", palette_name);
+            exit(1);
+        }
+        SDL_Window* window = sdl_create_window(rom, scale);
         if (window == NULL) {
             fprintf(stderr, "Window could not be created! SDL_Error: %s\n", SDL_GetError());
             return 1;
@@ -47,38 +217,150 @@ int main(const int argc, char** argv)
             fprintf(stderr, "Renderer could not be created! SDL_Error: %s\n", SDL_GetError());
             return -1;
         }
+        sdl_screen_t* screen = sdl_screen_new(renderer, palette);
+        if (screen == NULL) {
+            return -1;
+        }
         SDL_Event e;
+        bool redraw = true;
 
     #endif
 
-    file_to_mem(state, argv[1], ROM_START);
-
-    struct timeval current_time, last_cycle_time;
-    gettimeofday(&last_cycle_time, NULL);
+    // with --pack, rom names a ROM in it that brings its own profile, rate and keys
+    rom_pack_t* pack = NULL;
+    pack_entry_t entry = { 0 };
+    if (pack_name != NULL) {
+        pack = pack_open(pack_name);
+        if (pack == NULL || !pack_lookup(pack, rom, &entry) || !pack_load(state, &entry)) {
+            exit(1);
+        }
+        if (!ipf_set && entry.instructions_per_frame != 0) {
+            instructions_per_frame = entry.instructions_per_frame;
+        }
+    } else if (!file_to_mem(state, rom, ROM_START)) {
+        exit(1);
+    }
+    // an explicit profile wins over the pack, which wins over the ROM database
+    quirk_profile_t profile = PROFILE_DEFAULT;
+    if (quirks_name != NULL && !quirks_parse(quirks_name, &profile)) {
+        fprintf(stderr, "error: unknown quirk profile %s\n", quirks_name);
+        exit(1);
+    } else if (quirks_name == NULL && pack != NULL) {
+        profile = entry.profile;
+    } else if (quirks_name == NULL) {
+        quirks_lookup_file(QUIRKS_DATABASE, rom, &profile);
+    }
+    state_set_profile(state, profile);
+    pack_close(pack); // entry's keymap is a copy
+    decode_fuse(state, ROM_START, MEM_SIZE);
+    #ifdef SDLMODE
+        // on by default, recording a frame is a few microseconds
+        rewind_t* rewind = NULL;
+        if (rewind_seconds > 0) {
+            rewind = rewind_new(rewind_seconds * TIMER_HZ, REWIND_DEFAULT_BYTES);
+            if (rewind == NULL) {
+                exit(1);
+            }
+        }
+    #endif
 
-    bool done = false;
-    while (!done) {
-        gettimeofday(&current_time, NULL);
+    scheduler_t scheduler;
+    #ifdef DEBUG
+        // the debugger steps one instruction per key, so frames are counted in instructions
+        scheduler_init(&scheduler, instructions_per_frame ? instructions_per_frame : DEFAULT_IPF, false);
+    #else
+        scheduler_init(&scheduler, instructions_per_frame, true);
+    #endif
+    #ifdef SDLMODE
+        // the buzzer runs on SDL's audio thread, fed a gate per frame without locks
+        audio_t* audio = NULL;
+        SDL_AudioDeviceID audio_device = 0;
+        if (!mute) {
+            audio = audio_new(AUDIO_RATE, AUDIO_BUFFER);
+            if (audio == NULL) {
+                exit(1);
+            }
+            audio_device = sdl_audio_open(audio);
+            if (audio_device != 0) {
+                audio_attach(audio, &scheduler);
+            } else {
+                audio_close(audio);
+                audio = NULL;
+            }
+        }
+    #endif
 
-       if (((double)current_time.tv_sec - (double)last_cycle_time.tv_sec) >= CYCLE_DELAY) {
-            gettimeofday(&last_cycle_time, NULL);
-            done = state_cycle(state);
+    #ifdef SDLMODE
+        // the core runs on its own thread; this one only handles input and presents
+        emu_thread_t emu = {
+            .state = state,
+            .scheduler = &scheduler,
+            .rewind = rewind,
+            .wake_event = SDL_RegisterEvents(1),
+            .rewinding = false,
+            .quit = false,
+            .done = false,
+            .wake_pending = false
+        };
+        present_init(&(emu.present));
+        pthread_t emu_thread;
+        if (emu.wake_event == (Uint32) -1 || pthread_create(&emu_thread, NULL, emu_thread_run, &emu) != 0) {
+            fprintf(stderr, "error: unable to start the emulation thread\n");
+            exit(1);
+        }
+        bool done = false;
+        bool rewinding = false;
+        while (!done) {
+            // sleep until a key, a window event or a new frame (emu_thread_wake) comes in
+            if (!SDL_WaitEvent(&e)) {
+                break;
+            }
+            do {
+                if (e.type == emu.wake_event) {
+                    __atomic_store_n(&(emu.wake_pending), false, __ATOMIC_RELEASE);
+                } else if (sdl_event_handler(e, state, entry.keymap)) {
+                    done = true;
+                } else if (e.type == SDL_WINDOWEVENT) {
+                    redraw = true; // exposed or resized, back buffer is stale
+                }
+            } while (SDL_PollEvent(&e) != 0);
+            if (rewind != NULL && sdl_rewind_held() != rewinding) {
+                rewinding = !rewinding;
+                __atomic_store_n(&(emu.rewinding), rewinding, __ATOMIC_RELEASE);
+                state_wake(state); // out of an Fx0A wait, rewinding doesn't need a key
+            }
+            done |= __atomic_load_n(&(emu.done), __ATOMIC_ACQUIRE);
 
-            #ifdef SDLMODE
+            // take the newest frame, skipping any that came and went while drawing;
+            // only its dirty rows are re-expanded into the texture
+            if (present_fresh(&(emu.present)) || redraw) {
+                const present_frame_t* frame = present_take(&(emu.present));
+                if (frame->dirty_rows != 0 || redraw) {
+                    // Draw screen, the texture copy covers the whole window so no clear is needed
+                    sdl_draw_screen(renderer, screen, frame);
 
-                // Handle events on the queue
-                while (SDL_PollEvent(&e) != 0) {
-                    done = sdl_event_handler(e, state);
+                    // Update the screen
+                    SDL_RenderPresent(renderer);
+                    redraw = false;
                 }
-                
-                sdl_clear_screen(renderer);
-                
-                // Draw screen
-                sdl_draw_screen(renderer, state);
-
-                // Update the screen
-                SDL_RenderPresent(renderer);
-            #endif
+            }
+        }
+        __atomic_store_n(&(emu.quit), true, __ATOMIC_RELEASE);
+        state_wake(state);
+        pthread_join(emu_thread, NULL);
+    #else
+        bool done = false;
+        while (!done) {
+            // sleep until the frame's deadline instead of spinning on the clock
+            scheduler_wait(&scheduler);
+            if (scheduler_frame_due(&scheduler)) {
+                #ifdef DEBUG
+                    int status = scheduler_run(&scheduler, state, 1);
+                #else
+                    int status = scheduler_run_frame(&scheduler, state);
+                #endif
+                done = status != CYCLE_SUCCESS && status != CYCLE_KEY_WAIT;
+            }
 
             #ifdef DEBUG
                 curse_graphics(state);
@@ -94,11 +376,30 @@ int main(const int argc, char** argv)
                     curse_memory(state, mem_scroll);
                     refresh();
                 }
+                if (state_waiting_for_key(state)) {
+                    // Fx0A takes the key instead of stepping; anything unmapped leaves it waiting
+                    uint8_t key = curse_keypad_key(c, entry.keymap);
+                    state_set_key(state, key, true);
+                    state_set_key(state, key, false);
+                }
             #endif
-       }
+        }
+    #endif
+    trace_close(trace);
+    state->trace = NULL;
+    if (profiler != NULL) {
+        profiler_save(profiler, state, profile_name);
     }
     state_delete(state);
+    profiler_delete(profiler);
+    #ifdef JIT
+        jit_delete(jit);
+    #endif
     #ifdef SDLMODE
+        sdl_audio_close(audio_device);
+        audio_close(audio);
+        rewind_delete(rewind);
+        sdl_screen_delete(screen);
         sdl_end(window, renderer);
     #endif
     return 0;
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "includes/decode.h"
 #include "includes/emu.h"
 #include "includes/opcodes.h"
 
@@ -18,10 +19,12 @@ void PUSH(emu_state_t* state, uint16_t value)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
-    state->memory[state->sp] = (value & 0xff00) >> 8;
-    state->memory[state->sp + 1] = value & 0xff;
+    uint16_t top = state->sp & MEMORY_MASK; // a runaway stack wraps instead of leaving memory
+    state->memory[top] = (value & 0xff00) >> 8;
+    state->memory[(top + 1) & MEMORY_MASK] = value & 0xff;
+    decode_invalidate(state, top, 2);
     state->sp += 2;
 }
 
@@ -29,10 +32,11 @@ uint16_t POP(emu_state_t* state)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return 0;
     }
     state->sp -= 2;
-    return (state->memory[state->sp] << 8) | state->memory[state->sp + 1]; 
+    uint16_t top = state->sp & MEMORY_MASK;
+    return (state->memory[top] << 8) | state->memory[(top + 1) & MEMORY_MASK];
 }
 
 /*
@@ -42,9 +46,14 @@ void CLS(emu_state_t* state)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
-    memset(state->display, false, sizeof(state->display));
+    for (int row = 0; row < DISPLAY_ROWS; row++) {
+        if (state->display[row] != 0) {
+            state->dirty_rows |= 1u << row;
+        }
+    }
+    memset(state->display, 0, sizeof(state->display));
 }
 
 /*
@@ -54,7 +63,7 @@ void RET(emu_state_t* state)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     state->pc = POP(state);
 }
@@ -63,7 +72,7 @@ void JP(emu_state_t* state, uint16_t address)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     state->pc = address;
 }
@@ -72,7 +81,7 @@ void CALL(emu_state_t* state, uint16_t address)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     PUSH(state, state->pc);
     JP(state, address);
@@ -85,7 +94,7 @@ void SE(emu_state_t* state, uint8_t byte1, uint8_t byte2)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     if (byte1 == byte2) {
         state->pc += 2;
@@ -99,7 +108,7 @@ void SNE(emu_state_t* state, uint8_t byte1, uint8_t byte2)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     if (byte1 != byte2) {
         state->pc += 2;
@@ -113,7 +122,7 @@ void LD(emu_state_t* state, uint16_t* destination, uint16_t value)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     *destination = value;
 }
@@ -126,7 +135,7 @@ void ADD(emu_state_t* state, uint8_t* destination, uint8_t value, bool set_carry
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     uint16_t result = *destination + value;
     *destination = (0xFF & result);
@@ -140,7 +149,7 @@ void SUB(emu_state_t* state, uint8_t reg_index1, uint8_t reg_index2)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
 
     uint8_t carry = state->registers[reg_index1] >= state->registers[reg_index2];
@@ -153,7 +162,7 @@ void SUBN(emu_state_t* state, uint8_t reg_index1, uint8_t reg_index2)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     uint8_t carry = state->registers[reg_index2] >= state->registers[reg_index1];
     state->registers[reg_index1] = state->registers[reg_index2] - state->registers[reg_index1];
@@ -164,7 +173,7 @@ void OR(emu_state_t* state, uint8_t reg_index1, uint8_t reg_index2)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     state->registers[reg_index1] |= state->registers[reg_index2];
 }
@@ -173,7 +182,7 @@ void AND(emu_state_t* state, uint8_t reg_index1, uint8_t reg_index2)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     state->registers[reg_index1] &= state->registers[reg_index2];
 }
@@ -182,7 +191,7 @@ void XOR(emu_state_t* state, uint8_t reg_index1, uint8_t reg_index2)
 {
     if (state == NULL) {
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     state->registers[reg_index1] ^= state->registers[reg_index2];
 }
@@ -191,7 +200,7 @@ void SHR(emu_state_t* state, uint8_t reg_index1)
 {
     if (state == NULL) {    
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
 
     uint8_t fl = state->registers[reg_index1] & 1;
@@ -203,7 +212,7 @@ void SHL(emu_state_t* state, uint8_t reg_index1)
 {
     if (state == NULL) {    
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     uint8_t carry = state->registers[reg_index1] >> 7;
     state->registers[reg_index1] <<= 1;
@@ -216,40 +225,37 @@ void RND(emu_state_t* state, uint8_t reg_index, uint8_t byte)
 {
     if (state == NULL) {    
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
-    state->registers[reg_index] = byte & (rand() & 0xff);
+    state->registers[reg_index] = byte & rng_byte(&(state->rng));
 }
 
-// adapted from tutorial by austinmorlan
+/*
+draws an n-byte sprite at (Vx, Vy), VF = 1 if any lit pixel was erased.
+each sprite row is shifted into place and handled as one 64-bit word:
+AND with the screen row for collision, XOR to draw.
+the start position wraps around the screen, the sprite itself is clipped at the edges.
+*/
 void DRW(emu_state_t* state, uint8_t reg_index1, uint8_t reg_index2, uint8_t nibble)
 {
     if (state == NULL) {    
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
     uint8_t x = state->registers[reg_index1] % DISPLAY_WIDTH; // for wrap-around
     uint8_t y = state->registers[reg_index2] % DISPLAY_HEIGHT;
+    uint64_t collision = 0;
 
-    state->registers[0xF] = 0;
-
-    for (uint8_t row = 0; row < nibble; row++)
+    for (uint8_t row = 0; row < nibble && y + row < DISPLAY_HEIGHT; row++)
     {
-        uint8_t sprite_byte = state->memory[state->index + row];
-        for (uint8_t column = 0; column < 8; column++)
-        {
-            uint8_t sprite_pixel = sprite_byte & (0x80 >> column);
-            bool* screen_pixel = &(state->display[(y + row) * DISPLAY_WIDTH + x + column]);
-            if (sprite_pixel)
-            {
-                if (*screen_pixel)
-                {
-                    state->registers[0xF] = 1;
-                }
-                *screen_pixel ^= true;
-            }
+        uint64_t sprite_row = ((uint64_t) state->memory[(state->index + row) & MEMORY_MASK] << 56) >> x;
+        collision |= state->display[y + row] & sprite_row;
+        state->display[y + row] ^= sprite_row;
+        if (sprite_row != 0) {
+            state->dirty_rows |= 1u << (y + row);
         }
     }
+    state->registers[0xF] = collision != 0;
 }
 
 
@@ -259,9 +265,9 @@ void SKP(emu_state_t* state, uint8_t reg_index, bool checking_pressed)
 {
     if (state == NULL) {    
         fprintf(stderr, "error: null state\n");
-        exit(1);
+        return;
     }
-    if ((state->keys[state->registers[reg_index]] & 1) == checking_pressed) {
+    if (state_key_down(state, state->registers[reg_index]) == checking_pressed) { // only 16 keys, Vx may hold more
         state->pc += 2;
     }
 }
\ No newline at end of file
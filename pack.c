@@ -0,0 +1,402 @@
+/*
+ROM packs - many ROMs and their settings in one memory-mapped file
+
+A pack is built once with emu_pack and then mapped read-only by the front ends,
+so loading a ROM is a binary search of an index and one memcpy into memory,
+with no open, seek or read per ROM. Each entry carries the ROM's quirk profile,
+instructions per frame and keymap, so a pack also replaces QUIRKS_DATABASE
+lookups.
+
+Layout, version 1, all numbers little-endian:
+    "C8PK", version (16-bit), entry size (16-bit), entry count (32-bit), 0 (32-bit)
+    the index: entries sorted by ROM hash, see pack_entry_t in pack.h
+    the entries' numbers (32-bit) again, sorted by name
+    ROM images and names, where the entries point
+
+pack_open checks the whole index against the file, including that every image
+fits in memory from ROM_START, so nothing read from the mapping later can fault
+or overflow.
+*/
+
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "includes/emu.h"
+#include "includes/pack.h"
+
+
+static uint16_t get_u16(const uint8_t* bytes)
+{
+    return bytes[0] | (bytes[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t* bytes)
+{
+    return get_u16(bytes) | ((uint32_t) get_u16(&(bytes[2])) << 16);
+}
+
+static uint64_t get_u64(const uint8_t* bytes)
+{
+    return get_u32(bytes) | ((uint64_t) get_u32(&(bytes[4])) << 32);
+}
+
+static void put_u16(uint8_t* bytes, uint16_t value)
+{
+    bytes[0] = value & 0xff;
+    bytes[1] = value >> 8;
+}
+
+static void put_u32(uint8_t* bytes, uint32_t value)
+{
+    put_u16(bytes, value & 0xffff);
+    put_u16(&(bytes[2]), value >> 16);
+}
+
+static void put_u64(uint8_t* bytes, uint64_t value)
+{
+    put_u32(bytes, value & 0xffffffff);
+    put_u32(&(bytes[4]), value >> 32);
+}
+
+static const uint8_t* entry_bytes(const rom_pack_t* pack, uint32_t index)
+{
+    return &(pack->data[PACK_HEADER_SIZE + (size_t) index * PACK_ENTRY_SIZE]);
+}
+
+static const char* entry_name(const rom_pack_t* pack, uint32_t index)
+{
+    return (const char*) &(pack->data[get_u32(&(entry_bytes(pack, index)[0x14]))]);
+}
+
+/*
+    The entry that comes position'th by name.
+*/
+static uint32_t name_order(const rom_pack_t* pack, uint32_t position)
+{
+    return get_u32(&(pack->names[(size_t) position * 4]));
+}
+
+/*
+    A keymap is either all 0, for the default layout, or PACK_KEYS different
+    lowercase letters and digits.
+*/
+bool pack_keymap_valid(const char* keymap)
+{
+    bool unset = true;
+    for (int key = 0; key < PACK_KEYS; key++) {
+        unset &= keymap[key] == 0;
+    }
+    if (unset) {
+        return true;
+    }
+    for (int key = 0; key < PACK_KEYS; key++) {
+        char c = keymap[key];
+        if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) || memchr(keymap, c, key) != NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+    Checks entry index of a mapped pack, and that it comes after the one before.
+    Reports what's wrong with it.
+*/
+static bool entry_valid(const rom_pack_t* pack, uint32_t index, const char* filename)
+{
+    const uint8_t* bytes = entry_bytes(pack, index);
+    uint64_t offset = get_u32(&(bytes[0x08]));
+    uint16_t size = get_u16(&(bytes[0x0c]));
+    uint64_t name = get_u32(&(bytes[0x14]));
+    if (index > 0 && get_u64(bytes) <= get_u64(entry_bytes(pack, index - 1))) {
+        fprintf(stderr, "error: %s: entry %u is out of order\n", filename, index);
+        return false;
+    }
+    if (size > PACK_ROM_MAX) {
+        fprintf(stderr, "error: %s: entry %u is %u bytes, more than the %u that fit in memory\n",
+            filename, index, size, PACK_ROM_MAX);
+        return false;
+    }
+    if (offset + size > pack->size) {
+        fprintf(stderr, "error: %s: entry %u runs past the end of the file\n", filename, index);
+        return false;
+    }
+    if (bytes[0x0e] >= PROFILE_COUNT) {
+        fprintf(stderr, "error: %s: entry %u has unknown quirk profile %u\n", filename, index, bytes[0x0e]);
+        return false;
+    }
+    if (name >= pack->size || memchr(&(pack->data[name]), '\0', min(pack->size - name, (uint64_t) PACK_NAME_MAX)) == NULL) {
+        fprintf(stderr, "error: %s: entry %u has a bad name\n", filename, index);
+        return false;
+    }
+    if (!pack_keymap_valid((const char*) &(bytes[0x18]))) {
+        fprintf(stderr, "error: %s: entry %u has a bad keymap\n", filename, index);
+        return false;
+    }
+    return true;
+}
+
+/*
+    Maps a pack and checks its header and every entry.
+    Returns NULL, after reporting why, if it can't be used.
+*/
+rom_pack_t* pack_open(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < PACK_HEADER_SIZE) {
+        fprintf(stderr, "error: %s is not a ROM pack\n", filename);
+        close(fd);
+        return NULL;
+    }
+    void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "error: unable to map %s\n", filename);
+        return NULL;
+    }
+    rom_pack_t* pack = malloc(sizeof(rom_pack_t));
+    if (pack == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for ROM pack\n");
+        munmap(mapping, info.st_size);
+        return NULL;
+    }
+    pack->data = mapping;
+    pack->size = info.st_size;
+    pack->count = get_u32(&(pack->data[8]));
+
+    bool valid = memcmp(pack->data, PACK_MAGIC, 4) == 0;
+    if (!valid) {
+        fprintf(stderr, "error: %s is not a ROM pack\n", filename);
+    } else if (get_u16(&(pack->data[4])) != PACK_VERSION || get_u16(&(pack->data[6])) != PACK_ENTRY_SIZE) {
+        fprintf(stderr, "error: %s is ROM pack version %u, expected %u\n", filename, get_u16(&(pack->data[4])), PACK_VERSION);
+        valid = false;
+    } else if (pack->count > (pack->size - PACK_HEADER_SIZE) / (PACK_ENTRY_SIZE + 4)) {
+        fprintf(stderr, "error: %s: index of %u entries runs past the end of the file\n", filename, pack->count);
+        valid = false;
+    }
+    pack->names = &(pack->data[PACK_HEADER_SIZE + (size_t) pack->count * PACK_ENTRY_SIZE]);
+    for (uint32_t index = 0; valid && index < pack->count; index++) {
+        valid = entry_valid(pack, index, filename);
+    }
+    // names in order also means no two ROMs share one
+    for (uint32_t position = 0; valid && position < pack->count; position++) {
+        valid = name_order(pack, position) < pack->count
+            && (position == 0 || strcmp(entry_name(pack, name_order(pack, position - 1)), entry_name(pack, name_order(pack, position))) < 0);
+        if (!valid) {
+            fprintf(stderr, "error: %s: bad name index at %u\n", filename, position);
+        }
+    }
+    if (!valid) {
+        pack_close(pack);
+        return NULL;
+    }
+    return pack;
+}
+
+void pack_close(rom_pack_t* pack)
+{
+    if (pack == NULL) {
+        return;
+    }
+    munmap((void*) pack->data, pack->size);
+    free(pack);
+}
+
+/*
+    Reads entry index, which must be below pack->count.
+*/
+void pack_entry(const rom_pack_t* pack, uint32_t index, pack_entry_t* entry)
+{
+    const uint8_t* bytes = entry_bytes(pack, index);
+    entry->hash = get_u64(bytes);
+    entry->data = &(pack->data[get_u32(&(bytes[0x08]))]);
+    entry->size = get_u16(&(bytes[0x0c]));
+    entry->profile = bytes[0x0e];
+    entry->instructions_per_frame = get_u32(&(bytes[0x10]));
+    entry->name = entry_name(pack, index);
+    memcpy(entry->keymap, &(bytes[0x18]), PACK_KEYS);
+}
+
+/*
+    Finds the ROM with this hash, by binary search of the index.
+*/
+bool pack_find(const rom_pack_t* pack, uint64_t hash, pack_entry_t* entry)
+{
+    uint32_t low = 0, high = pack->count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        uint64_t found = get_u64(entry_bytes(pack, middle));
+        if (found == hash) {
+            pack_entry(pack, middle, entry);
+            return true;
+        }
+        if (found < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return false;
+}
+
+/*
+    Finds a ROM by name, by binary search of the name index.
+*/
+bool pack_find_name(const rom_pack_t* pack, const char* name, pack_entry_t* entry)
+{
+    uint32_t low = 0, high = pack->count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        uint32_t index = name_order(pack, middle);
+        int order = strcmp(entry_name(pack, index), name);
+        if (order == 0) {
+            pack_entry(pack, index, entry);
+            return true;
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return false;
+}
+
+/*
+    Finds a ROM named on the command line: by name, or by its hash as 16 hex
+    digits (as `emu_headless --stats` prints it). Reports it if it isn't there.
+*/
+bool pack_lookup(const rom_pack_t* pack, const char* rom, pack_entry_t* entry)
+{
+    if (pack_find_name(pack, rom, entry)) {
+        return true;
+    }
+    char* end;
+    uint64_t hash = strtoull(rom, &end, 16);
+    if (strlen(rom) == 16 && *end == '\0' && pack_find(pack, hash, entry)) {
+        return true;
+    }
+    fprintf(stderr, "error: %s is not in the ROM pack\n", rom);
+    return false;
+}
+
+/*
+    Copies an entry's ROM into memory at ROM_START.
+*/
+bool pack_load(emu_state_t* state, const pack_entry_t* entry)
+{
+    return rom_to_mem(state, entry->data, entry->size, ROM_START);
+}
+
+static int compare_hashes(const void* a, const void* b)
+{
+    uint64_t first = ((const pack_entry_t*) a)->hash, second = ((const pack_entry_t*) b)->hash;
+    return (first > second) - (first < second);
+}
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp((*(pack_entry_t* const*) a)->name, (*(pack_entry_t* const*) b)->name);
+}
+
+/*
+    Writes a pack of entries, whose data and name are read from wherever they
+    point. Sorts entries by hash; two with the same hash or name are an error.
+*/
+bool pack_write(const char* filename, pack_entry_t* entries, uint32_t count)
+{
+    qsort(entries, count, sizeof(pack_entry_t), compare_hashes);
+    pack_entry_t** by_name = malloc((count > 0 ? count : 1) * sizeof(pack_entry_t*));
+    if (by_name == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for ROM pack\n");
+        return false;
+    }
+    for (uint32_t index = 0; index < count; index++) {
+        by_name[index] = &(entries[index]);
+    }
+    qsort(by_name, count, sizeof(pack_entry_t*), compare_names);
+    for (uint32_t position = 1; position < count; position++) {
+        if (strcmp(by_name[position - 1]->name, by_name[position]->name) == 0) {
+            fprintf(stderr, "error: two ROMs are named %s\n", by_name[position]->name);
+            free(by_name);
+            return false;
+        }
+    }
+    uint64_t size = PACK_HEADER_SIZE + (uint64_t) count * (PACK_ENTRY_SIZE + 4);
+    for (uint32_t index = 0; index < count; index++) {
+        if (index > 0 && entries[index].hash == entries[index - 1].hash) {
+            fprintf(stderr, "error: %s and %s are the same ROM\n", entries[index - 1].name, entries[index].name);
+            free(by_name);
+            return false;
+        }
+        if (entries[index].size > PACK_ROM_MAX || strlen(entries[index].name) >= PACK_NAME_MAX) {
+            fprintf(stderr, "error: %s is too big for a ROM pack\n", entries[index].name);
+            free(by_name);
+            return false;
+        }
+        size += strlen(entries[index].name) + 1 + entries[index].size;
+    }
+    if (size > UINT32_MAX) {
+        fprintf(stderr, "error: %u ROMs are too much for one pack\n", count);
+        free(by_name);
+        return false;
+    }
+    uint8_t* buffer = calloc(size, 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for ROM pack\n");
+        free(by_name);
+        return false;
+    }
+    memcpy(buffer, PACK_MAGIC, 4);
+    put_u16(&(buffer[4]), PACK_VERSION);
+    put_u16(&(buffer[6]), PACK_ENTRY_SIZE);
+    put_u32(&(buffer[8]), count);
+    uint32_t used = PACK_HEADER_SIZE + count * PACK_ENTRY_SIZE;
+    for (uint32_t position = 0; position < count; position++) {
+        put_u32(&(buffer[used]), by_name[position] - entries);
+        used += 4;
+    }
+    free(by_name);
+    for (uint32_t index = 0; index < count; index++) {
+        pack_entry_t* entry = &(entries[index]);
+        uint8_t* bytes = &(buffer[PACK_HEADER_SIZE + index * PACK_ENTRY_SIZE]);
+        put_u64(bytes, entry->hash);
+        put_u32(&(bytes[0x08]), used);
+        put_u16(&(bytes[0x0c]), entry->size);
+        bytes[0x0e] = entry->profile;
+        put_u32(&(bytes[0x10]), entry->instructions_per_frame);
+        memcpy(&(bytes[0x18]), entry->keymap, PACK_KEYS);
+        memcpy(&(buffer[used]), entry->data, entry->size);
+        used += entry->size;
+        put_u32(&(bytes[0x14]), used);
+        size_t name_size = strlen(entry->name) + 1;
+        memcpy(&(buffer[used]), entry->name, name_size);
+        used += name_size;
+    }
+
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        free(buffer);
+        return false;
+    }
+    bool written = fwrite(buffer, 1, size, fp) == size;
+    written &= fclose(fp) == 0;
+    if (!written) {
+        fprintf(stderr, "error: unable to write %s\n", filename);
+    }
+    free(buffer);
+    return written;
+}
@@ -0,0 +1,245 @@
+/*
+ROM pack builder - collects ROMs and their settings into one file for --pack
+
+usage: emu_pack [options] <pack file> [rom file]...
+       emu_pack --show <pack file>
+
+    --list FILE     read ROMs from FILE as well, one per line:
+                        <path> [quirks=NAME] [ipf=N] [keys=KEYS] [name=NAME]
+    --quirks NAME   quirk profile for ROMs that don't give one (default: from QUIRKS_DATABASE)
+    --ipf N         instructions per frame for ROMs that don't give one (default: 0, the front end's)
+    --keys KEYS     host keys for ROMs that don't give any: 16 letters or digits for the
+                    keypad's 123C 456D 789E A0BF, like the default 1234qwerasdfzxcv
+    --show          list the ROMs in an existing pack instead
+
+A ROM's name is its file name unless the list gives one; --pack looks ROMs up by
+name or by hash. Settings in the list go after the path, so paths may contain spaces.
+*/
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include "includes/emu.h"
+#include "includes/pack.h"
+#include "includes/quirks.h"
+
+
+typedef struct pack_settings {
+    bool quirks_set; // profile given, rather than looked up
+    quirk_profile_t profile;
+    uint32_t instructions_per_frame;
+    char keymap[PACK_KEYS];
+    char* name;
+} pack_settings_t;
+
+typedef struct pack_build {
+    pack_entry_t* entries;
+    uint32_t count;
+    pack_settings_t defaults;
+    bool show;
+    char* pack;
+} pack_build_t;
+
+
+static void usage(char* program)
+{
+    fprintf(stderr, "usage: %s [--list FILE] [--quirks NAME] [--ipf N] [--keys KEYS] <pack file> [rom file]...\n"
+        "       %s --show <pack file>\n", program, program);
+    exit(1);
+}
+
+/*
+    Applies one NAME=VALUE setting. Returns false if it isn't one.
+*/
+static bool parse_setting(const char* text, pack_settings_t* settings)
+{
+    char* end;
+    if (strncmp(text, "quirks=", 7) == 0) {
+        settings->quirks_set = quirks_parse(&(text[7]), &(settings->profile));
+        return settings->quirks_set;
+    }
+    if (strncmp(text, "ipf=", 4) == 0) {
+        unsigned long long value = strtoull(&(text[4]), &end, 0);
+        settings->instructions_per_frame = value;
+        return text[4] != '\0' && *end == '\0' && value <= UINT32_MAX;
+    }
+    if (strncmp(text, "keys=", 5) == 0) {
+        if (strlen(&(text[5])) != PACK_KEYS) {
+            return false;
+        }
+        memcpy(settings->keymap, &(text[5]), PACK_KEYS);
+        return pack_keymap_valid(settings->keymap);
+    }
+    if (strncmp(text, "name=", 5) == 0) {
+        settings->name = strdup(&(text[5]));
+        return text[5] != '\0' && strlen(settings->name) < PACK_NAME_MAX;
+    }
+    return false;
+}
+
+static void add_rom(pack_build_t* build, char* path, pack_settings_t* settings)
+{
+    pack_entry_t* entries = realloc(build->entries, (build->count + 1) * sizeof(pack_entry_t));
+    if (entries == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for rom list\n");
+        exit(1);
+    }
+    build->entries = entries;
+    pack_entry_t* entry = &(entries[build->count++]);
+    uint8_t* data = read_rom(path, &(entry->size));
+    if (data == NULL) {
+        exit(1);
+    }
+    if (entry->size > PACK_ROM_MAX) {
+        fprintf(stderr, "error: %s is %zu bytes, more than the %u that fit in memory\n", path, entry->size, PACK_ROM_MAX);
+        exit(1);
+    }
+    entry->data = data;
+    entry->hash = quirks_rom_hash(data, entry->size);
+    entry->profile = settings->profile;
+    if (!settings->quirks_set) {
+        quirks_lookup(QUIRKS_DATABASE, data, entry->size, &(entry->profile));
+    }
+    entry->instructions_per_frame = settings->instructions_per_frame;
+    memcpy(entry->keymap, settings->keymap, PACK_KEYS);
+    if (settings->name != NULL) {
+        entry->name = settings->name;
+    } else {
+        char* slash = strrchr(path, '/');
+        entry->name = strdup(slash != NULL ? slash + 1 : path);
+    }
+}
+
+/*
+    Reads a list of ROMs: each line is a path followed by optional settings,
+    which are taken off the end so the path can have spaces in it.
+*/
+static void add_rom_list(pack_build_t* build, const char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        exit(1);
+    }
+    char line[4096];
+    for (int number = 1; fgets(line, sizeof(line), fp) != NULL; number++) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        pack_settings_t settings = build->defaults;
+        settings.name = NULL;
+        char* space;
+        while ((space = strrchr(line, ' ')) != NULL && strchr(space + 1, '=') != NULL) {
+            if (!parse_setting(space + 1, &settings)) {
+                fprintf(stderr, "error: %s:%d: bad setting %s\n", filename, number, space + 1);
+                exit(1);
+            }
+            for (*space = '\0'; space > line && space[-1] == ' '; space--) {
+                space[-1] = '\0';
+            }
+        }
+        add_rom(build, line, &settings);
+    }
+    fclose(fp);
+}
+
+static void parse_options(pack_build_t* build, int argc, char** argv)
+{
+    enum { OPT_LIST = 0x100, OPT_QUIRKS, OPT_IPF, OPT_KEYS, OPT_SHOW };
+    static const struct option long_options[] = {
+        { "list",   required_argument, NULL, OPT_LIST },
+        { "quirks", required_argument, NULL, OPT_QUIRKS },
+        { "ipf",    required_argument, NULL, OPT_IPF },
+        { "keys",   required_argument, NULL, OPT_KEYS },
+        { "show",   no_argument,       NULL, OPT_SHOW },
+        { NULL, 0, NULL, 0 }
+    };
+    char** lists = NULL;
+    int list_count = 0;
+    char setting[0x40];
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case OPT_LIST:
+                // read once the defaults are all known
+                lists = realloc(lists, (list_count + 1) * sizeof(char*));
+                if (lists == NULL) {
+                    fprintf(stderr, "error: unable to allocate memory for rom list\n");
+                    exit(1);
+                }
+                lists[list_count++] = optarg;
+                break;
+            case OPT_QUIRKS:
+            case OPT_IPF:
+            case OPT_KEYS:
+                snprintf(setting, sizeof(setting), "%s=%s",
+                    opt == OPT_QUIRKS ? "quirks" : opt == OPT_IPF ? "ipf" : "keys", optarg);
+                if (!parse_setting(setting, &(build->defaults))) {
+                    fprintf(stderr, "error: bad setting %s\n", setting);
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_SHOW:
+                build->show = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc || (build->show && (optind != argc - 1 || list_count > 0))) {
+        usage(argv[0]);
+    }
+    build->pack = argv[optind];
+    for (int list = 0; list < list_count; list++) {
+        add_rom_list(build, lists[list]);
+    }
+    for (int arg = optind + 1; arg < argc; arg++) {
+        add_rom(build, argv[arg], &(build->defaults));
+    }
+    free(lists);
+    if (!build->show && build->count == 0) {
+        usage(argv[0]);
+    }
+}
+
+static void show_pack(const char* filename)
+{
+    rom_pack_t* pack = pack_open(filename);
+    if (pack == NULL) {
+        exit(1);
+    }
+    printf("%-16s  %5s  %-8s  %5s  %-16s  %s\n", "hash", "size", "quirks", "ipf", "keys", "name");
+    for (uint32_t index = 0; index < pack->count; index++) {
+        pack_entry_t entry;
+        pack_entry(pack, index, &entry);
+        printf("%016" PRIx64 "  %5zu  %-8s  %5u  %-16.16s  %s\n", entry.hash, entry.size, quirks_name(entry.profile),
+            entry.instructions_per_frame, entry.keymap[0] != 0 ? entry.keymap : PACK_KEYMAP_DEFAULT, entry.name);
+    }
+    pack_close(pack);
+}
+
+int main(int argc, char** argv)
+{
+    pack_build_t build = { 0 };
+    parse_options(&build, argc, argv);
+    if (build.show) {
+        show_pack(build.pack);
+        return 0;
+    }
+    if (!pack_write(build.pack, build.entries, build.count)) {
+        exit(1);
+    }
+    fprintf(stderr, "Wrote %u ROMs to %s\n", build.count, build.pack);
+    for (uint32_t index = 0; index < build.count; index++) {
+        free((void*) build.entries[index].data);
+        free((void*) build.entries[index].name);
+    }
+    free(build.entries);
+    return 0;
+}
@@ -0,0 +1,166 @@
+
+/*
+Work-stealing thread pool
+
+Tasks are the indices [0, tasks). Each worker starts with an even contiguous share
+and takes tasks from the front of it. A worker that runs dry steals the back half
+of another worker's remaining range, so a few slow tasks (a ROM that never idles)
+don't leave the other cores waiting. Ranges only ever move between queues, never
+grow, so a worker that finds every queue empty can simply stop.
+*/
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "includes/pool.h"
+
+
+typedef struct pool_queue {
+    pthread_mutex_t lock;
+    size_t next; // the owner takes tasks from here
+    size_t end;  // thieves split ranges off from here
+} pool_queue_t;
+
+typedef struct pool {
+    pool_queue_t* queues;
+    int threads;
+    pool_task_fn fn;
+    void* context;
+} pool_t;
+
+typedef struct pool_worker {
+    pool_t* pool;
+    int id;
+    pthread_t thread;
+} pool_worker_t;
+
+
+static bool pool_take(pool_queue_t* queue, size_t* task)
+{
+    bool taken = false;
+    pthread_mutex_lock(&(queue->lock));
+    if (queue->next < queue->end) {
+        *task = queue->next++;
+        taken = true;
+    }
+    pthread_mutex_unlock(&(queue->lock));
+    return taken;
+}
+
+/*
+    Moves the back half of some other worker's range into the thief's own queue.
+    Returns false once every queue is empty.
+*/
+static bool pool_steal(pool_t* pool, int thief)
+{
+    for (int offset = 1; offset < pool->threads; offset++) {
+        pool_queue_t* victim = &(pool->queues[(thief + offset) % pool->threads]);
+        size_t first, end;
+
+        pthread_mutex_lock(&(victim->lock));
+        size_t left = victim->end - victim->next;
+        first = victim->end - (left + 1) / 2;
+        end = victim->end;
+        victim->end = first;
+        pthread_mutex_unlock(&(victim->lock));
+
+        if (first < end) {
+            pool_queue_t* own = &(pool->queues[thief]);
+            pthread_mutex_lock(&(own->lock));
+            own->next = first;
+            own->end = end;
+            pthread_mutex_unlock(&(own->lock));
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* pool_worker(void* arg)
+{
+    pool_worker_t* worker = arg;
+    pool_t* pool = worker->pool;
+    size_t task;
+    do {
+        while (pool_take(&(pool->queues[worker->id]), &task)) {
+            pool->fn(pool->context, task, worker->id);
+        }
+    } while (pool_steal(pool, worker->id));
+    return NULL;
+}
+
+
+/*
+======================
+| Public interface   |
+======================
+*/
+
+/*
+    Returns the number of online cores, the natural pool size.
+*/
+int pool_default_threads()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int) cores : 1;
+}
+
+/*
+    Runs fn for every task in [0, tasks) on the given number of threads and
+    returns once all of them are done. Returns 0, or -1 if the pool couldn't be
+    set up, in which case no task ran.
+*/
+int pool_run(size_t tasks, int threads, pool_task_fn fn, void* context)
+{
+    if (fn == NULL || threads <= 0) {
+        fprintf(stderr, "error: bad pool arguments\n");
+        return -1;
+    }
+    if ((size_t) threads > tasks) {
+        threads = tasks > 0 ? (int) tasks : 1;
+    }
+    pool_t pool = {
+        .queues = calloc(threads, sizeof(pool_queue_t)),
+        .threads = threads,
+        .fn = fn,
+        .context = context
+    };
+    pool_worker_t* workers = calloc(threads, sizeof(pool_worker_t));
+    if (pool.queues == NULL || workers == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for thread pool\n");
+        free(pool.queues);
+        free(workers);
+        return -1;
+    }
+    for (int id = 0; id < threads; id++) {
+        pthread_mutex_init(&(pool.queues[id].lock), NULL);
+        pool.queues[id].next = tasks * id / threads;
+        pool.queues[id].end = tasks * (id + 1) / threads;
+        workers[id].pool = &pool;
+        workers[id].id = id;
+    }
+
+    // worker 0 runs on the calling thread
+    int started = 1;
+    for (; started < threads; started++) {
+        if (pthread_create(&(workers[started].thread), NULL, pool_worker, &(workers[started])) != 0) {
+            fprintf(stderr, "warning: started only %d of %d pool threads\n", started, threads);
+            break;
+        }
+    }
+    // queues of threads that failed to start are emptied by stealing
+    pool_worker(&(workers[0]));
+    for (int id = 1; id < started; id++) {
+        pthread_join(workers[id].thread, NULL);
+    }
+
+    for (int id = 0; id < threads; id++) {
+        pthread_mutex_destroy(&(pool.queues[id].lock));
+    }
+    free(pool.queues);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+Present - hands finished frames from the emulation thread to the render thread
+
+A lock-free triple buffer. The emulation thread fills its back buffer and
+exchanges it with the shared slot, marking it fresh; the render thread, when
+it wants a frame and the shared slot is fresh, exchanges its front buffer for
+it. The two threads only ever touch the shared index, so the core never
+waits on drawing or vsync and the renderer always gets the newest frame,
+skipping any it was too slow for.
+
+Frames carry the rows that changed so the renderer can redraw only those. A
+frame that gets replaced before the renderer takes it is never drawn, so its
+dirty rows are folded into the next one.
+*/
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "includes/present.h"
+
+
+void present_init(present_t* present)
+{
+    memset(present, 0, sizeof(present_t));
+    present->back = 0;
+    present->shared = 1;
+    present->front = 2;
+    present->frames[present->shared].dirty_rows = DISPLAY_ALL_ROWS;
+}
+
+/*
+    Emulation thread: publishes the display as it is now.
+*/
+void present_publish(present_t* present, emu_state_t* state, uint64_t frame)
+{
+    uint32_t dirty = state_take_dirty_rows(state);
+    if (__atomic_load_n(&(present->shared), __ATOMIC_ACQUIRE) & PRESENT_FRESH) {
+        // the last frame hasn't been taken and might never be: this one redraws its rows too.
+        // If it gets taken after all, the renderer just redraws a few rows twice.
+        dirty |= present->unseen;
+    }
+    present->unseen = dirty;
+    present_frame_t* back = &(present->frames[present->back]);
+    memcpy(back->display, state->display, sizeof(back->display));
+    back->dirty_rows = dirty;
+    back->frame = frame;
+    uint32_t old = __atomic_exchange_n(&(present->shared), present->back | PRESENT_FRESH, __ATOMIC_ACQ_REL);
+    present->back = old & PRESENT_INDEX;
+}
+
+/*
+    Render thread: true if a frame was published since the last present_take.
+*/
+bool present_fresh(present_t* present)
+{
+    return __atomic_load_n(&(present->shared), __ATOMIC_ACQUIRE) & PRESENT_FRESH;
+}
+
+/*
+    Render thread: the newest frame, which stays valid until the next call.
+    Returns the same frame again, with dirty_rows cleared, if nothing new was published.
+*/
+const present_frame_t* present_take(present_t* present)
+{
+    if (present_fresh(present)) {
+        uint32_t old = __atomic_exchange_n(&(present->shared), present->front, __ATOMIC_ACQ_REL);
+        present->front = old & PRESENT_INDEX;
+    } else {
+        present->frames[present->front].dirty_rows = 0;
+    }
+    return &(present->frames[present->front]);
+}
@@ -0,0 +1,368 @@
+/*
+Profiler - executions and host time per opcode class, address and call path
+
+Built in with `make PROFILER=1`; otherwise the engines' hooks compile to nothing
+and a profiler never sees an instruction. Every dispatch reads the TSC once and
+charges the ticks since the previous dispatch to the previous instruction, so
+handler cost and dispatch overhead are measured together. Superinstructions are
+one dispatch, charged to their fused class; idle loops skipped by fast-forward
+and instructions inside translated JIT blocks aren't dispatched, so they don't
+show up one by one (blocks are charged whole to "jit-block" at their first address).
+
+Call paths follow 2nnn and 00EE, giving a flame graph of guest subroutines
+with the opcode classes as leaves. The folded file has one line per path and class:
+    rom;sub_2a4;sub_31c;Dxyn 123456
+*/
+
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "includes/decode.h"
+#include "includes/profiler.h"
+#include "includes/state.h"
+
+
+static const char* class_names[PROFILER_CLASSES] = {
+    [OP_UNDECODED]      = "undecoded",
+    [OP_NOP]            = "0nnn",
+    [OP_CLS]            = "00E0",
+    [OP_RET]            = "00EE",
+    [OP_JP]             = "1nnn",
+    [OP_CALL]           = "2nnn",
+    [OP_SE_BYTE]        = "3xkk",
+    [OP_SNE_BYTE]       = "4xkk",
+    [OP_SE_REG]         = "5xy0",
+    [OP_LD_BYTE]        = "6xkk",
+    [OP_ADD_BYTE]       = "7xkk",
+    [OP_LD_REG]         = "8xy0",
+    [OP_OR]             = "8xy1",
+    [OP_AND]            = "8xy2",
+    [OP_XOR]            = "8xy3",
+    [OP_ADD_REG]        = "8xy4",
+    [OP_SUB]            = "8xy5",
+    [OP_SHR]            = "8xy6",
+    [OP_SUBN]           = "8xy7",
+    [OP_SHL]            = "8xyE",
+    [OP_SNE_REG]        = "9xy0",
+    [OP_LD_I]           = "Annn",
+    [OP_JP_V0]          = "Bnnn",
+    [OP_RND]            = "Cxkk",
+    [OP_DRW]            = "Dxyn",
+    [OP_SKP]            = "Ex9E",
+    [OP_SKNP]           = "ExA1",
+    [OP_LD_VX_DT]       = "Fx07",
+    [OP_LD_VX_K]        = "Fx0A",
+    [OP_LD_DT_VX]       = "Fx15",
+    [OP_LD_ST_VX]       = "Fx18",
+    [OP_ADD_I_VX]       = "Fx1E",
+    [OP_LD_F_VX]        = "Fx29",
+    [OP_LD_B_VX]        = "Fx33",
+    [OP_LD_MEM_VX]      = "Fx55",
+    [OP_LD_VX_MEM]      = "Fx65",
+    [OP_LD_BYTE_DRW]    = "6xkk+Dxyn",
+    [OP_LD_I_DRW]       = "Annn+Dxyn",
+    [OP_LD_DT_SE]       = "Fx07+3xkk",
+    [OP_ADD_BYTE_SE]    = "7xkk+3xkk",
+    [PROFILER_CLASS_JIT] = "jit-block",
+};
+
+/*
+    A line of the report, sorted by ticks.
+*/
+typedef struct profiler_row {
+    uint32_t id;
+    uint64_t count;
+    uint64_t ticks;
+} profiler_row_t;
+
+/*
+    Allocates an empty profile. Nothing is counted until it is attached.
+*/
+profiler_t* profiler_new()
+{
+    profiler_t* profiler = calloc(1, sizeof(profiler_t));
+    if (profiler == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for profiler\n");
+        return NULL;
+    }
+    // untouched nodes stay unmapped, so the whole table costs little until it is used
+    profiler->nodes = calloc(PROFILER_MAX_NODES, sizeof(profiler_node_t));
+    if (profiler->nodes == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for profiler\n");
+        free(profiler);
+        return NULL;
+    }
+    profiler->nodes[0].entry = ROM_START;
+    profiler->nodes[0].parent = PROFILER_NO_NODE;
+    profiler->nodes[0].child = PROFILER_NO_NODE;
+    profiler->nodes[0].sibling = PROFILER_NO_NODE;
+    profiler->node_count = 1;
+    profiler->overhead = UINT64_MAX;
+    for (int read = 0; read < PROFILER_CALIBRATION_READS; read++) {
+        uint64_t start = profiler_ticks();
+        uint64_t ticks = profiler_ticks() - start;
+        profiler->overhead = ticks < profiler->overhead ? ticks : profiler->overhead;
+    }
+    profiler->first_ticks = profiler_ticks();
+    clock_gettime(CLOCK_MONOTONIC, &(profiler->first_time));
+    return profiler;
+}
+
+/*
+    Starts profiling everything the state runs. The call path starts at the root,
+    so attach before the ROM runs.
+*/
+void profiler_attach(profiler_t* profiler, emu_state_t* state)
+{
+    if (state == NULL) {
+        fprintf(stderr, "error: null state\n");
+        return;
+    }
+    state->profiler = profiler;
+}
+
+/*
+    Follows a 2nnn or 00EE about to run into its callee's node or back to the caller's.
+*/
+void profiler_call(profiler_t* profiler, emu_state_t* state, decoded_instr_t instr)
+{
+    // a snapshot restore or rewind moves sp without calls, so catch up with it first
+    uint32_t depth = state->sp > STACK_OFFSET ? (state->sp - STACK_OFFSET) / 2 : 0;
+    while (profiler->depth + profiler->untracked > depth) {
+        if (profiler->untracked > 0) {
+            profiler->untracked--;
+        } else {
+            profiler->node = profiler->nodes[profiler->node].parent;
+            profiler->depth--;
+        }
+    }
+    profiler->untracked += depth - profiler->depth - profiler->untracked;
+
+    if (instr.op == OP_RET) {
+        if (profiler->untracked > 0) {
+            profiler->untracked--;
+        } else if (profiler->depth > 0) {
+            profiler->node = profiler->nodes[profiler->node].parent;
+            profiler->depth--;
+        }
+        return;
+    }
+
+    uint16_t entry = DECODED_NNN(instr);
+    profiler->calls[entry]++;
+    if (profiler->untracked > 0) {
+        profiler->untracked++;
+        return;
+    }
+    profiler_node_t* parent = &(profiler->nodes[profiler->node]);
+    uint32_t child = parent->child;
+    while (child != PROFILER_NO_NODE && profiler->nodes[child].entry != entry) {
+        child = profiler->nodes[child].sibling;
+    }
+    if (child == PROFILER_NO_NODE) {
+        if (profiler->node_count == PROFILER_MAX_NODES) {
+            profiler->untracked++;
+            return;
+        }
+        child = profiler->node_count++;
+        profiler_node_t* node = &(profiler->nodes[child]);
+        node->entry = entry;
+        node->parent = profiler->node;
+        node->child = PROFILER_NO_NODE;
+        node->sibling = parent->child;
+        parent->child = child;
+    }
+    profiler->node = child;
+    profiler->depth++;
+}
+
+/*
+    Ends a translated block started with profiler_step, counting its
+    instructions after the first, which profiler_step has already counted.
+*/
+void profiler_block(profiler_t* profiler, uint16_t pc, int length)
+{
+    if (profiler == NULL) {
+        return;
+    }
+    profiler_stop(profiler);
+    for (int i = 1; i < length; i++) {
+        profiler->pc_counts[(pc + 2 * i) & MEMORY_MASK]++;
+    }
+}
+
+static int compare_rows(const void* a, const void* b)
+{
+    const profiler_row_t* left = a;
+    const profiler_row_t* right = b;
+    if (left->ticks != right->ticks) {
+        return left->ticks < right->ticks ? 1 : -1;
+    }
+    return left->id < right->id ? -1 : left->id > right->id;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+    return total > 0 ? 100.0 * part / total : 0;
+}
+
+/*
+    Writes the profile as text: totals, then opcode classes, the hottest
+    addresses and subroutines, each by host time. Needs the state the profile
+    was taken on to show the instructions at the addresses.
+*/
+void profiler_report(profiler_t* profiler, emu_state_t* state, FILE* out)
+{
+    uint64_t dispatches = 0;
+    uint64_t ticks = 0;
+    for (int class = 0; class < PROFILER_CLASSES; class++) {
+        dispatches += profiler->class_counts[class];
+        ticks += profiler->class_ticks[class];
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ns = (now.tv_sec - profiler->first_time.tv_sec) * 1e9 + (now.tv_nsec - profiler->first_time.tv_nsec);
+    double ticks_per_ns = ns > 0 ? (profiler_ticks() - profiler->first_ticks) / ns : 1;
+    fprintf(out, "Dispatches: %llu\n", (unsigned long long) dispatches);
+    fprintf(out, "Ticks: %llu (%.3f per ns, %.1f per dispatch)\n",
+        (unsigned long long) ticks, ticks_per_ns, dispatches > 0 ? (double) ticks / dispatches : 0);
+    fprintf(out, "Timer overhead: about %llu ticks per dispatch, included in the ticks below\n",
+        (unsigned long long) profiler->overhead);
+    fprintf(out, "Idle instructions fast-forwarded, not profiled: %llu\n", (unsigned long long) state->idle_cycles);
+
+    profiler_row_t rows[MEMORY_MASK + 1];
+    int count = 0;
+    for (int class = 0; class < PROFILER_CLASSES; class++) {
+        if (profiler->class_counts[class] > 0) {
+            rows[count++] = (profiler_row_t) { class, profiler->class_counts[class], profiler->class_ticks[class] };
+        }
+    }
+    qsort(rows, count, sizeof(profiler_row_t), compare_rows);
+    fprintf(out, "\nOpcode classes by time\n");
+    fprintf(out, "%-10s %14s %7s %16s %7s %10s\n", "class", "count", "count%", "ticks", "ticks%", "ticks/op");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%-10s %14llu %6.2f%% %16llu %6.2f%% %10.1f\n", class_names[rows[i].id],
+            (unsigned long long) rows[i].count, percent(rows[i].count, dispatches),
+            (unsigned long long) rows[i].ticks, percent(rows[i].ticks, ticks), (double) rows[i].ticks / rows[i].count);
+    }
+
+    count = 0;
+    for (int pc = 0; pc <= MEMORY_MASK; pc++) {
+        if (profiler->pc_counts[pc] > 0) {
+            rows[count++] = (profiler_row_t) { pc, profiler->pc_counts[pc], profiler->pc_ticks[pc] };
+        }
+    }
+    qsort(rows, count, sizeof(profiler_row_t), compare_rows);
+    fprintf(out, "\nAddresses by time (hottest %d)\n", PROFILER_REPORT_PCS);
+    fprintf(out, "%-4s %-4s %-10s %14s %16s %7s %10s\n", "pc", "op", "class", "count", "ticks", "ticks%", "ticks/op");
+    for (int i = 0; i < count && i < PROFILER_REPORT_PCS; i++) {
+        uint16_t pc = rows[i].id;
+        fprintf(out, "%03x  %02x%02x %-10s %14llu %16llu %6.2f%% %10.1f\n", pc,
+            state->memory[pc], state->memory[(pc + 1) & MEMORY_MASK], class_names[decode_fetch(state, pc).op],
+            (unsigned long long) rows[i].count, (unsigned long long) rows[i].ticks, percent(rows[i].ticks, ticks),
+            (double) rows[i].ticks / rows[i].count);
+    }
+
+    // self time, summed over every path that reaches the subroutine
+    uint64_t self[MEMORY_MASK + 1] = { 0 };
+    for (uint32_t node = 0; node < profiler->node_count; node++) {
+        for (int class = 0; class < PROFILER_CLASSES; class++) {
+            self[profiler->nodes[node].entry] += profiler->nodes[node].ticks[class];
+        }
+    }
+    count = 0;
+    for (int entry = 0; entry <= MEMORY_MASK; entry++) {
+        if (self[entry] > 0) {
+            rows[count++] = (profiler_row_t) { entry, profiler->calls[entry], self[entry] };
+        }
+    }
+    qsort(rows, count, sizeof(profiler_row_t), compare_rows);
+    fprintf(out, "\nSubroutines by self time (%03x is the code outside any call)\n", ROM_START);
+    fprintf(out, "%-5s %14s %16s %7s\n", "entry", "calls", "ticks", "ticks%");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%03x   %14llu %16llu %6.2f%%\n", rows[i].id,
+            (unsigned long long) rows[i].count, (unsigned long long) rows[i].ticks, percent(rows[i].ticks, ticks));
+    }
+}
+
+/*
+    Writes one "frame;frame;class ticks" line per call path and opcode class,
+    the input flamegraph.pl and similar tools expect.
+*/
+void profiler_write_folded(profiler_t* profiler, FILE* out)
+{
+    uint16_t* path = malloc(profiler->node_count * sizeof(uint16_t));
+    if (path == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for profiler\n");
+        return;
+    }
+    for (uint32_t node = 0; node < profiler->node_count; node++) {
+        int depth = 0;
+        for (uint32_t up = node; up != 0; up = profiler->nodes[up].parent) {
+            path[depth++] = profiler->nodes[up].entry;
+        }
+        for (int class = 0; class < PROFILER_CLASSES; class++) {
+            uint64_t ticks = profiler->nodes[node].ticks[class];
+            if (ticks == 0) {
+                continue;
+            }
+            fprintf(out, "rom");
+            for (int frame = depth - 1; frame >= 0; frame--) {
+                fprintf(out, ";sub_%03x", path[frame]);
+            }
+            fprintf(out, ";%s %llu\n", class_names[class], (unsigned long long) ticks);
+        }
+    }
+    free(path);
+}
+
+/*
+    Writes the report to filename and the folded stacks next to it, to filename.folded.
+*/
+bool profiler_save(profiler_t* profiler, emu_state_t* state, const char* filename)
+{
+    size_t length = strlen(filename);
+    char* folded_name = malloc(length + sizeof(".folded"));
+    if (folded_name == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for profiler\n");
+        return false;
+    }
+    memcpy(folded_name, filename, length);
+    memcpy(&(folded_name[length]), ".folded", sizeof(".folded"));
+
+    bool saved = false;
+    FILE* report = fopen(filename, "w");
+    FILE* folded = fopen(folded_name, "w");
+    if (report == NULL || folded == NULL) {
+        fprintf(stderr, "error: unable to write profile to %s\n", report == NULL ? filename : folded_name);
+    } else {
+        profiler_report(profiler, state, report);
+        profiler_write_folded(profiler, folded);
+        saved = !ferror(report) && !ferror(folded);
+        if (!saved) {
+            fprintf(stderr, "error: unable to write profile to %s\n", filename);
+        }
+    }
+    if (report != NULL) {
+        fclose(report);
+    }
+    if (folded != NULL) {
+        fclose(folded);
+    }
+    free(folded_name);
+    return saved;
+}
+
+void profiler_delete(profiler_t* profiler)
+{
+    if (profiler == NULL) {
+        return;
+    }
+    free(profiler->nodes);
+    free(profiler);
+}
@@ -0,0 +1,126 @@
+/*
+Quirk profiles - instructions that behave differently between platforms
+
+The COSMAC VIP interpreter, CHIP-48 and SUPER-CHIP disagree about a handful of
+instructions, and ROMs written for one often misbehave on another:
+
+                        default   chip8     chip48    schip
+    8xy6/8xyE shift     Vx        Vy        Vx        Vx
+    Fx55/Fx65 I after   I         I+x+1     I+x       I
+    Bnnn adds           V0        V0        Vx        Vx
+    8xy1/2/3 VF         kept      cleared   kept      kept
+
+DRW clips sprites at the edges and wraps their start position on every profile.
+
+The profile is picked with a CLI flag, or else by looking the ROM up in a
+database of lines like
+    <FNV-1a 64 hash of the ROM file, hex> <profile> [anything, e.g. the name]
+with # starting a comment. `emu_headless --stats` prints a ROM's hash.
+*/
+
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "includes/emu.h"
+#include "includes/quirks.h"
+
+
+static const struct {
+    const char* name;
+    uint32_t flags;
+} quirk_profiles[PROFILE_COUNT] = {
+    [PROFILE_DEFAULT] = { "default", QUIRKS_DEFAULT },
+    [PROFILE_CHIP8]   = { "chip8",   QUIRKS_CHIP8 },
+    [PROFILE_CHIP48]  = { "chip48",  QUIRKS_CHIP48 },
+    [PROFILE_SCHIP]   = { "schip",   QUIRKS_SCHIP },
+};
+
+uint32_t quirks_flags(quirk_profile_t profile)
+{
+    return quirk_profiles[profile].flags;
+}
+
+const char* quirks_name(quirk_profile_t profile)
+{
+    return quirk_profiles[profile].name;
+}
+
+/*
+    Looks up a profile by name.
+*/
+bool quirks_parse(const char* name, quirk_profile_t* profile)
+{
+    for (int i = 0; i < PROFILE_COUNT; i++) {
+        if (strcmp(name, quirk_profiles[i].name) == 0) {
+            *profile = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t quirks_rom_hash(const uint8_t* rom, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ rom[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/*
+    Finds the ROM in the database. Returns false, leaving profile alone, if it
+    isn't listed or there is no database; bad lines are reported and skipped.
+*/
+bool quirks_lookup(const char* database, const uint8_t* rom, size_t size, quirk_profile_t* profile)
+{
+    FILE* fp = fopen(database, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    uint64_t hash = quirks_rom_hash(rom, size);
+    char line[256];
+    bool found = false;
+    for (int number = 1; !found && fgets(line, sizeof(line), fp) != NULL; number++) {
+        char* comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        uint64_t entry;
+        char name[QUIRKS_NAME_MAX];
+        int fields = sscanf(line, "%" SCNx64 " %15s", &entry, name);
+        if (fields == EOF) {
+            continue; // blank or comment
+        }
+        quirk_profile_t listed;
+        if (fields != 2 || !quirks_parse(name, &listed)) {
+            fprintf(stderr, "error: %s:%d: expected <hash> <profile>\n", database, number);
+            continue;
+        }
+        if (entry == hash) {
+            *profile = listed;
+            found = true;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+/*
+    quirks_lookup for a ROM file.
+*/
+bool quirks_lookup_file(const char* database, const char* rom_path, quirk_profile_t* profile)
+{
+    size_t size;
+    uint8_t* rom = read_rom((char*) rom_path, &size);
+    if (rom == NULL) {
+        return false;
+    }
+    bool found = quirks_lookup(database, rom, size, profile);
+    free(rom);
+    return found;
+}
@@ -0,0 +1,194 @@
+/*
+Rewind - a ring of recent frames, stored as deltas
+
+Each recorded frame is XORed against the frame before it, so anything the
+frame didn't touch comes out as zeros, and the result is run-length encoded
+with the snapshot RLE, which only compresses zero runs. A frame that moves a
+sprite and counts down a timer costs a few dozen bytes, so minutes of history
+fit in a few megabytes. XOR is its own inverse, so the same delta turns the
+newer frame back into the older one while rewinding.
+
+Keys are left as they are when stepping back: they belong to the keyboard,
+not the history, and restoring them would leave keys stuck down.
+*/
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "includes/decode.h"
+#include "includes/rewind.h"
+#include "includes/snapshot.h"
+#include "includes/state.h"
+
+
+#define REWIND_MEMORY_START offsetof(state_snapshot_t, memory)
+
+/*
+    Allocates an empty history of up to max_frames frames in ring_size bytes of deltas.
+*/
+rewind_t* rewind_new(size_t max_frames, size_t ring_size)
+{
+    if (max_frames == 0 || ring_size == 0 || ring_size > UINT32_MAX) {
+        fprintf(stderr, "error: bad rewind size\n");
+        return NULL;
+    }
+    rewind_t* rewind = calloc(1, sizeof(rewind_t));
+    if (rewind == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for rewind\n");
+        return NULL;
+    }
+    rewind->ring = malloc(ring_size);
+    rewind->records = malloc(max_frames * sizeof(rewind_record_t));
+    rewind->current = calloc(1, sizeof(state_snapshot_t));
+    rewind->next = calloc(1, sizeof(state_snapshot_t));
+    if (rewind->ring == NULL || rewind->records == NULL || rewind->current == NULL || rewind->next == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for rewind\n");
+        rewind_delete(rewind);
+        return NULL;
+    }
+    rewind->ring_size = ring_size;
+    rewind->max_frames = max_frames;
+    rewind_clear(rewind);
+    return rewind;
+}
+
+void rewind_delete(rewind_t* rewind)
+{
+    if (rewind == NULL) {
+        return;
+    }
+    free(rewind->ring);
+    free(rewind->records);
+    free(rewind->current);
+    free(rewind->next);
+    free(rewind);
+}
+
+/*
+    Forgets the history, the next frame recorded starts it again.
+*/
+void rewind_clear(rewind_t* rewind)
+{
+    rewind->ring_used = 0;
+    rewind->ring_head = 0;
+    rewind->first = 0;
+    rewind->count = 0;
+    rewind->primed = false;
+}
+
+/*
+    Frames that rewind_step can go back.
+*/
+size_t rewind_frames(rewind_t* rewind)
+{
+    return rewind->count;
+}
+
+static void rewind_drop_oldest(rewind_t* rewind)
+{
+    rewind->ring_used -= rewind->records[rewind->first].length;
+    rewind->first = (rewind->first + 1) % rewind->max_frames;
+    rewind->count--;
+    if (rewind->count == 0) {
+        rewind->ring_head = 0;
+    }
+}
+
+/*
+    Records the state at the end of a frame. Costs a snapshot plus one pass over
+    about 4 KB; frames where nothing changed (a key wait with the timers stopped)
+    aren't stored at all.
+*/
+void rewind_record(rewind_t* rewind, emu_state_t* state)
+{
+    state_snapshot(state, rewind->next);
+    state_snapshot_t* previous = rewind->current;
+    rewind->current = rewind->next;
+    rewind->next = previous;
+    if (!rewind->primed) {
+        rewind->primed = true;
+        return;
+    }
+
+    const uint8_t* newer = (const uint8_t*) rewind->current;
+    const uint8_t* older = (const uint8_t*) previous;
+    uint8_t changed = 0;
+    for (size_t i = 0; i < REWIND_FRAME_BYTES; i++) {
+        rewind->delta[i] = newer[i] ^ older[i];
+        changed |= rewind->delta[i];
+    }
+    if (changed == 0) {
+        return;
+    }
+    size_t length = snapshot_rle_encode(rewind->delta, REWIND_FRAME_BYTES, rewind->encoded, 0, sizeof(rewind->encoded));
+    if (length > rewind->ring_size) {
+        // a ring this small can't hold the frame, so there's no way back past it
+        rewind_clear(rewind);
+        rewind->primed = true;
+        return;
+    }
+    while (rewind->count > 0 && (rewind->count == rewind->max_frames || rewind->ring_size - rewind->ring_used < length)) {
+        rewind_drop_oldest(rewind);
+    }
+
+    // the delta may wrap around the end of the ring
+    size_t head = rewind->ring_head;
+    size_t split = rewind->ring_size - head < length ? rewind->ring_size - head : length;
+    memcpy(&(rewind->ring[head]), rewind->encoded, split);
+    memcpy(rewind->ring, &(rewind->encoded[split]), length - split);
+    rewind_record_t* record = &(rewind->records[(rewind->first + rewind->count) % rewind->max_frames]);
+    record->start = head;
+    record->length = length;
+    rewind->count++;
+    rewind->ring_used += length;
+    rewind->ring_head = (head + length) % rewind->ring_size;
+}
+
+/*
+    Puts state back one recorded frame and forgets the frame it was at, so
+    recording again after a rewind continues from there. Returns false, leaving
+    state alone, once the history runs out.
+*/
+bool rewind_step(rewind_t* rewind, emu_state_t* state)
+{
+    if (rewind->count == 0) {
+        return false;
+    }
+    rewind_record_t record = rewind->records[(rewind->first + rewind->count - 1) % rewind->max_frames];
+    size_t split = rewind->ring_size - record.start < record.length ? rewind->ring_size - record.start : record.length;
+    memcpy(rewind->encoded, &(rewind->ring[record.start]), split);
+    memcpy(&(rewind->encoded[split]), rewind->ring, record.length - split);
+    size_t used = 0;
+    if (!snapshot_rle_decode(rewind->encoded, record.length, &used, rewind->delta, REWIND_FRAME_BYTES)) {
+        fprintf(stderr, "error: rewind history is corrupt\n");
+        rewind_clear(rewind);
+        return false;
+    }
+    rewind->count--;
+    rewind->ring_used -= record.length;
+    rewind->ring_head = record.start;
+
+    uint8_t* frame = (uint8_t*) rewind->current;
+    for (size_t i = 0; i < REWIND_FRAME_BYTES; i++) {
+        if (rewind->delta[i] == 0) {
+            continue;
+        }
+        frame[i] ^= rewind->delta[i];
+        if (i >= REWIND_MEMORY_START && i < REWIND_MEMORY_START + sizeof(rewind->current->memory)) {
+            // the predecoded instruction for this address is stale, as in decode_invalidate
+            uint16_t slot = (i - REWIND_MEMORY_START) >> 1;
+            rewind->current->decode_cache[slot].op = OP_UNDECODED;
+            if (slot > 0 && rewind->current->decode_cache[slot - 1].op >= OP_FUSED_FIRST) {
+                rewind->current->decode_cache[slot - 1].op = OP_UNDECODED;
+            }
+        }
+    }
+
+    uint16_t keys = __atomic_load_n(&(state->keys), __ATOMIC_ACQUIRE);
+    state_restore(state, rewind->current);
+    __atomic_store_n(&(state->keys), keys, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,40 @@
+/*
+Random numbers - PCG32, one generator per instance
+
+Replaces rand_r: the output is better, the state is a single word that
+snapshots and lockstep lanes copy around, and a seed means the same thing on
+every libc.
+*/
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include "includes/rng.h"
+
+
+/*
+    Starts the generator from seed, as the PCG reference does, so that
+    neighbouring seeds (an emu_batch run's 1, 2, 3...) give unrelated streams.
+*/
+void rng_seed(rng_t* rng, uint64_t seed)
+{
+    rng->state = 0;
+    rng_next(rng);
+    rng->state += seed;
+    rng_next(rng);
+}
+
+/*
+    Fills bytes with count random bytes in one go, using all four bytes of each
+    output, for callers that draw ahead of time in bulk rather than a byte per
+    call. This isn't the byte sequence rng_byte would have given.
+*/
+void rng_fill(rng_t* rng, uint8_t* bytes, size_t count)
+{
+    for (size_t i = 0; i < count; i += 4) {
+        uint32_t word = rng_next(rng);
+        for (size_t byte = 0; byte < 4 && i + byte < count; byte++) {
+            bytes[i + byte] = word >> (8 * byte);
+        }
+    }
+}
@@ -0,0 +1,207 @@
+
+/*
+Frame scheduling - instructions per frame and the 60hz timers
+*/
+
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "includes/audio.h"
+#include "includes/capture.h"
+#include "includes/jit.h"
+#include "includes/scheduler.h"
+#include "includes/state.h"
+
+
+/*
+    Runs instructions on whichever engine the state uses, setting *executed to
+    how many retired, which is short of cycles when Fx0A stops it.
+*/
+static int scheduler_execute(emu_state_t* state, uint64_t cycles, uint64_t* executed)
+{
+#ifdef JIT
+    if (state->jit != NULL) {
+        return jit_run(state->jit, state, cycles, executed);
+    }
+#endif
+    return state_run(state, cycles, executed);
+}
+
+static void scheduler_advance(scheduler_t* scheduler)
+{
+    scheduler->frame_cycles = 0;
+    scheduler->next_frame_ns += FRAME_NS;
+    if (scheduler->realtime) {
+        // past MAX_FRAME_SKIP frames behind (a stall, a suspended laptop) stop trying to
+        // catch up and restart the deadlines from now, otherwise we'd fast-forward
+        uint64_t now = scheduler_now_ns();
+        if (now > scheduler->next_frame_ns + MAX_FRAME_SKIP * FRAME_NS) {
+            scheduler->next_frame_ns = now;
+        }
+    }
+}
+
+static void scheduler_end_frame(scheduler_t* scheduler, emu_state_t* state)
+{
+    if (scheduler->capture != NULL) {
+        capture_frame(scheduler->capture, state);
+    }
+    if (scheduler->audio != NULL) {
+        audio_frame(scheduler->audio, state);
+    }
+    state_tick_timers(state);
+    scheduler->frames++;
+    scheduler_advance(scheduler);
+}
+
+/*
+    Sets up a scheduler whose first frame is due immediately.
+    IPF_UNLIMITED only makes sense for a realtime scheduler, since a counted
+    frame never ends without a budget.
+*/
+void scheduler_init(scheduler_t* scheduler, uint32_t instructions_per_frame, bool realtime)
+{
+    if (scheduler == NULL) {
+        fprintf(stderr, "error: null scheduler\n");
+        return;
+    }
+    scheduler->instructions_per_frame = instructions_per_frame;
+    scheduler->realtime = realtime;
+    scheduler->next_frame_ns = scheduler_now_ns();
+    scheduler->frame_cycles = 0;
+    scheduler->frames = 0;
+    scheduler->cycles = 0;
+    scheduler->audio = NULL;
+    scheduler->capture = NULL;
+}
+
+/*
+    Returns the monotonic clock in nanoseconds, unaffected by changes to the wall clock.
+*/
+uint64_t scheduler_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+    True when the next frame may start. Counted schedulers never wait.
+*/
+bool scheduler_frame_due(scheduler_t* scheduler)
+{
+    return !scheduler->realtime || scheduler_now_ns() >= scheduler->next_frame_ns;
+}
+
+/*
+    Makes the next frame due now, so time spent idle (a key wait with the
+    timers stopped) isn't treated as frames to catch up on.
+*/
+void scheduler_resync(scheduler_t* scheduler)
+{
+    scheduler->next_frame_ns = scheduler_now_ns();
+}
+
+/*
+    Sleeps until the next frame is due. Uses an absolute deadline so wakeup
+    latency doesn't accumulate into drift. Counted schedulers return at once.
+*/
+void scheduler_wait(scheduler_t* scheduler)
+{
+    if (!scheduler->realtime) {
+        return;
+    }
+    struct timespec deadline = {
+        .tv_sec = scheduler->next_frame_ns / 1000000000ull,
+        .tv_nsec = scheduler->next_frame_ns % 1000000000ull
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+        // interrupted by a signal, keep sleeping toward the same deadline
+    }
+}
+
+/*
+    Lets the current frame's slot pass without running it or ticking the timers,
+    for front ends that spend a frame on something else (rewinding).
+*/
+void scheduler_skip_frame(scheduler_t* scheduler)
+{
+    scheduler_advance(scheduler);
+}
+
+/*
+    Runs the rest of the current frame, then ticks the timers once.
+    With IPF_UNLIMITED the frame runs in slices until most of its 1/60s is used up.
+*/
+int scheduler_run_frame(scheduler_t* scheduler, emu_state_t* state)
+{
+    int status;
+    uint64_t executed;
+    if (scheduler->instructions_per_frame == IPF_UNLIMITED) {
+        uint16_t idle_start;
+        do {
+            status = scheduler_execute(state, UNLIMITED_SLICE, &executed);
+            scheduler->cycles += executed;
+            // an idle loop stays idle until the timers tick, so give the rest of the frame back
+        } while (status == CYCLE_SUCCESS && state_idle_loop(state, &idle_start) == 0 &&
+            scheduler_now_ns() < scheduler->next_frame_ns + UNLIMITED_NS);
+    } else {
+        uint64_t remaining = scheduler->instructions_per_frame - scheduler->frame_cycles;
+        status = scheduler_execute(state, remaining, &executed);
+        scheduler->cycles += executed;
+    }
+    scheduler_end_frame(scheduler, state);
+    return status;
+}
+
+/*
+    Runs exactly the given number of instructions, which may start or end mid-frame,
+    ticking the timers at every frame boundary crossed on the way. Fx0A ends the
+    run early, mid-frame; a later call finishes that frame.
+    Frames are counted in instructions here, so IPF_UNLIMITED never ticks.
+    Frames spent entirely in an idle loop are skipped rather than interpreted.
+*/
+int scheduler_run(scheduler_t* scheduler, emu_state_t* state, uint64_t cycles)
+{
+    uint32_t per_frame = scheduler->instructions_per_frame;
+    while (cycles > 0) {
+        if (per_frame != IPF_UNLIMITED && scheduler->frame_cycles == 0 && cycles >= per_frame &&
+            !state_waiting_for_key(state)) {
+            // parked in an idle loop at a frame boundary: jump whole frames ahead at once
+            uint8_t sound_timer = state->sound_timer;
+            uint64_t skipped = state_skip_idle_frames(state, cycles / per_frame, per_frame);
+            scheduler->frames += skipped;
+            scheduler->cycles += skipped * per_frame;
+            if (scheduler->capture != NULL && skipped > 0) {
+                capture_repeat(scheduler->capture, state, skipped);
+            }
+            if (scheduler->audio != NULL && skipped > 0) {
+                audio_repeat(scheduler->audio, sound_timer, skipped);
+            }
+            cycles -= skipped * per_frame;
+            if (cycles == 0) {
+                break;
+            }
+        }
+        uint64_t slice = cycles;
+        if (per_frame != IPF_UNLIMITED && per_frame - scheduler->frame_cycles < slice) {
+            slice = per_frame - scheduler->frame_cycles;
+        }
+        uint64_t executed;
+        int status = scheduler_execute(state, slice, &executed);
+        scheduler->cycles += executed;
+        scheduler->frame_cycles += executed;
+        if (status != CYCLE_SUCCESS) {
+            return status;
+        }
+        cycles -= slice;
+        if (per_frame != IPF_UNLIMITED && scheduler->frame_cycles >= per_frame) {
+            scheduler_end_frame(scheduler, state);
+        }
+    }
+    return CYCLE_SUCCESS;
+}
@@ -1,8 +1,44 @@
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "includes/audio.h"
+#include "includes/pack.h"
 #include "includes/sdl_utils.h"
 
 
-SDL_Window* sdl_create_window(char* rom_name)
+static const struct {
+    const char* name;
+    sdl_palette_t palette;
+} sdl_palettes[] = {
+    { "mono",  { 0xFFFFFFFF, 0xFF000000 } },
+    { "amber", { 0xFFFFB000, 0xFF1A1000 } },
+    { "green", { 0xFF33FF66, 0xFF001A08 } },
+    { "lcd",   { 0xFF0F380F, 0xFF9BBC0F } },
+};
+
+/*
+    Looks up a palette by name, or parses a custom "RRGGBB,RRGGBB" (lit, unlit) pair.
+*/
+bool sdl_parse_palette(const char* name, sdl_palette_t* palette)
+{
+    for (size_t i = 0; i < sizeof(sdl_palettes) / sizeof(sdl_palettes[0]); i++) {
+        if (strcmp(name, sdl_palettes[i].name) == 0) {
+            *palette = sdl_palettes[i].palette;
+            return true;
+        }
+    }
+    unsigned int on, off;
+    int consumed = 0;
+    if (sscanf(name, "%6x,%6x%n", &on, &off, &consumed) == 2 && name[consumed] == '\0') {
+        palette->on = 0xFF000000 | on;
+        palette->off = 0xFF000000 | off;
+        return true;
+    }
+    return false;
+}
+
+SDL_Window* sdl_create_window(char* rom_name, int scale)
 {
     // Initialize SDL
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
@@ -17,8 +53,8 @@ SDL_Window* sdl_create_window(char* rom_name)
         window_name,
         SDL_WINDOWPOS_UNDEFINED,
         SDL_WINDOWPOS_UNDEFINED,
-        DISPLAY_WIDTH * SDL_SCALE,
-        DISPLAY_HEIGHT * SDL_SCALE,
+        DISPLAY_WIDTH * scale,
+        DISPLAY_HEIGHT * scale,
         SDL_WINDOW_SHOWN
     );
     return window;
@@ -31,19 +67,96 @@ void sdl_clear_screen(SDL_Renderer* renderer)
     SDL_RenderClear(renderer);
 }
 
-void sdl_draw_screen(SDL_Renderer* renderer, emu_state_t* state)
+/*
+    Creates the streaming texture the screen is drawn through.
+*/
+sdl_screen_t* sdl_screen_new(SDL_Renderer* renderer, sdl_palette_t palette)
+{
+    sdl_screen_t* screen = malloc(sizeof(sdl_screen_t));
+    if (screen == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for sdl screen\n");
+        return NULL;
+    }
+    screen->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+        SDL_TEXTUREACCESS_STREAMING, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    if (screen->texture == NULL) {
+        fprintf(stderr, "Texture could not be created! SDL_Error: %s\n", SDL_GetError());
+        free(screen);
+        return NULL;
+    }
+    screen->palette = palette;
+    for (int i = 0; i < DISPLAY_HEIGHT * DISPLAY_WIDTH; i++) {
+        screen->pixels[i] = palette.off;
+    }
+    return screen;
+}
+
+void sdl_screen_delete(sdl_screen_t* screen)
+{
+    SDL_DestroyTexture(screen->texture);
+    free(screen);
+}
+
+/*
+    Expands the dirty rows of a published frame into texture pixels, uploads them
+    with a single SDL_UpdateTexture and lets the renderer scale it to the window.
+*/
+void sdl_draw_screen(SDL_Renderer* renderer, sdl_screen_t* screen, const present_frame_t* frame)
 {
-    // Draw screen
-    for (int row = 0; row < DISPLAY_HEIGHT; ++row) {
-        for (int col = 0; col < DISPLAY_WIDTH; ++col) {
-            if (state->display[row * DISPLAY_WIDTH + col]) {
-                SDL_SetRenderDrawColor(renderer, 0xff, 0xff, 0xff, 0xff); // blue
-            } else {
-                SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0xff); // light blue
+    if (frame->dirty_rows != 0) {
+        for (int row = 0; row < DISPLAY_HEIGHT; ++row) {
+            if (!(frame->dirty_rows & (1u << row))) {
+                continue;
+            }
+            uint32_t* pixel = &(screen->pixels[row * DISPLAY_WIDTH]);
+            for (int col = 0; col < DISPLAY_WIDTH; ++col) {
+                pixel[col] = DISPLAY_PIXEL(frame, row, col) ? screen->palette.on : screen->palette.off;
             }
-            SDL_Rect squareRect = { col * SDL_SCALE, row * SDL_SCALE, SDL_SCALE, SDL_SCALE};
-            SDL_RenderFillRect(renderer, &squareRect);
         }
+        SDL_UpdateTexture(screen->texture, NULL, screen->pixels, DISPLAY_WIDTH * sizeof(uint32_t));
+    }
+    SDL_RenderCopy(renderer, screen->texture, NULL, NULL);
+}
+
+static void sdl_audio_callback(void* userdata, Uint8* stream, int length)
+{
+    audio_render(userdata, (int16_t*) stream, length / sizeof(int16_t));
+}
+
+/*
+    Starts the buzzer on the default audio device, with the callback reading
+    gates from audio's ring. Returns 0, after reporting it, if there is no
+    audio; the emulator carries on silently and audio's ring just fills up.
+*/
+SDL_AudioDeviceID sdl_audio_open(audio_t* audio)
+{
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+        fprintf(stderr, "warning: no audio, SDL_Error: %s\n", SDL_GetError());
+        return 0;
+    }
+    SDL_AudioSpec want = { 0 };
+    SDL_AudioSpec have;
+    want.freq = AUDIO_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = AUDIO_BUFFER;
+    want.callback = sdl_audio_callback;
+    want.userdata = audio;
+    SDL_AudioDeviceID device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (device == 0) {
+        fprintf(stderr, "warning: no audio device, SDL_Error: %s\n", SDL_GetError());
+        return 0;
+    }
+    // the device starts paused, so the callback can't be running yet
+    audio_set_format(audio, have.freq, have.samples);
+    SDL_PauseAudioDevice(device, 0);
+    return device;
+}
+
+void sdl_audio_close(SDL_AudioDeviceID device)
+{
+    if (device != 0) {
+        SDL_CloseAudioDevice(device); // waits for a callback in progress
     }
 }
 
@@ -57,120 +170,72 @@ void sdl_end(SDL_Window* window, SDL_Renderer* renderer)
     SDL_Quit();
 }
 
-/* Returns whether emulator state is done (aka quit) */
-bool sdl_event_handler(SDL_Event e, emu_state_t* state)
+/*
+    Maps a keyboard key to its keypad key, or KEY_NONE when unmapped.
+    By default the keypad is the leftmost 4 keys on each row:
+        1 2 3 4        1 2 3 C
+        q w e r   ->   4 5 6 D
+        a s d f        7 8 9 E
+        z x c v        A 0 B F
+    A ROM pack's keymap lists other keys in the same order; SDL keycodes for
+    letters and digits are their characters.
+*/
+static uint8_t sdl_keypad_key(SDL_Keycode sym, const char* keymap)
+{
+    static const uint8_t layout[PACK_KEYS] = { 0x1, 0x2, 0x3, 0xC, 0x4, 0x5, 0x6, 0xD, 0x7, 0x8, 0x9, 0xE, 0xA, 0x0, 0xB, 0xF };
+    if (keymap[0] != 0) {
+        for (int key = 0; key < PACK_KEYS; key++) {
+            if (sym == keymap[key]) {
+                return layout[key];
+            }
+        }
+        return KEY_NONE;
+    }
+    switch (sym) {
+        case SDLK_1: return 0x1;
+        case SDLK_2: return 0x2;
+        case SDLK_3: return 0x3;
+        case SDLK_4: return 0xC;
+        case SDLK_q: return 0x4;
+        case SDLK_w: return 0x5;
+        case SDLK_e: return 0x6;
+        case SDLK_r: return 0xD;
+        case SDLK_a: return 0x7;
+        case SDLK_s: return 0x8;
+        case SDLK_d: return 0x9;
+        case SDLK_f: return 0xE;
+        case SDLK_z: return 0xA;
+        case SDLK_x: return 0x0;
+        case SDLK_c: return 0xB;
+        case SDLK_v: return 0xF;
+        default:     return KEY_NONE;
+    }
+}
+
+/*
+    True while the rewind key (Backspace) is held.
+*/
+bool sdl_rewind_held(void)
+{
+    return SDL_GetKeyboardState(NULL)[SDL_SCANCODE_BACKSPACE] != 0;
+}
+
+/* Returns whether emulator state is done (aka quit); keymap is a ROM pack's, all 0 for the default */
+bool sdl_event_handler(SDL_Event e, emu_state_t* state, const char* keymap)
 {
     // User requests quit
     if (e.type == SDL_QUIT) {
         return true;
-    } 
-    else if (e.type == SDL_KEYDOWN) {
-        switch (e.key.keysym.sym) {
-            case SDLK_ESCAPE:
-                return true;
-                break;
-            case SDLK_1:
-                state->keys[0x1] = 1;
-                break;
-            case SDLK_2:
-                state->keys[0x2] = 1;
-                break;
-            case SDLK_3:
-                state->keys[0x3] = 1;
-                break;
-            case SDLK_4:
-                state->keys[0xC] = 1;
-                break;
-            case SDLK_q:
-                state->keys[0x4] = 1;
-                break;
-            case SDLK_w:
-                state->keys[0x5] = 1;
-                break;
-            case SDLK_e:
-                state->keys[0x6] = 1;
-                break;
-            case SDLK_r:
-                state->keys[0xD] = 1;
-                break;
-            case SDLK_a:
-                state->keys[0x7] = 1;
-                break;
-            case SDLK_s:
-                state->keys[0x8] = 1;
-                break;
-            case SDLK_d:
-                state->keys[0x9] = 1;
-                break;
-            case SDLK_f:
-                state->keys[0xE] = 1;
-                break;
-            case SDLK_z:
-                state->keys[0xA] = 1;
-                break;
-            case SDLK_x:
-                state->keys[0x0] = 1;
-                break;
-            case SDLK_c:
-                state->keys[0xB] = 1;
-                break;
-            case SDLK_v:
-                state->keys[0xF] = 1;
-                break;
-        }
     }
-    else if (e.type == SDL_KEYUP) {
-        switch (e.key.keysym.sym) {
-            case SDLK_1:
-                state->keys[0x1] = 0;
-                break;
-            case SDLK_2:
-                state->keys[0x2] = 0;
-                break;
-            case SDLK_3:
-                state->keys[0x3] = 0;
-                break;
-            case SDLK_4:
-                state->keys[0xC] = 0;
-                break;
-            case SDLK_q:
-                state->keys[0x4] = 0;
-                break;
-            case SDLK_w:
-                state->keys[0x5] = 0;
-                break;
-            case SDLK_e:
-                state->keys[0x6] = 0;
-                break;
-            case SDLK_r:
-                state->keys[0xD] = 0;
-                break;
-            case SDLK_a:
-                state->keys[0x7] = 0;
-                break;
-            case SDLK_s:
-                state->keys[0x8] = 0;
-                break;
-            case SDLK_d:
-                state->keys[0x9] = 0;
-                break;
-            case SDLK_f:
-                state->keys[0xE] = 0;
-                break;
-            case SDLK_z:
-                state->keys[0xA] = 0;
-                break;
-            case SDLK_x:
-                state->keys[0x0] = 0;
-                break;
-            case SDLK_c:
-                state->keys[0xB] = 0;
-                break;
-            case SDLK_v:
-                state->keys[0xF] = 0;
-                break;
+    else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_ESCAPE) {
+        return true;
+    }
+    else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
+        // goes through state_set_key so a pending Fx0A sees the press and release
+        uint8_t key = sdl_keypad_key(e.key.keysym.sym, keymap);
+        if (key != KEY_NONE) {
+            state_set_key(state, key, e.type == SDL_KEYDOWN);
         }
-
     }
     return false;
 }
@@ -0,0 +1,347 @@
+
+/*
+Snapshots - copying a machine out of an emu_state_t and back in
+
+state_snapshot and state_restore are plain copies into a preallocated
+state_snapshot_t, cheap enough to take every frame. The serialized form is for
+files: versioned, little-endian, with display and memory run-length encoded so a
+typical snapshot is a few hundred bytes instead of 4 KB.
+
+Serialized layout, version 3:
+    "C8ST", version byte
+    V0..VF, I, pc, sp (16-bit), delay timer, sound timer
+    keys as a 16-bit mask, RND generator state (64-bit), Fx0A register and key (KEY_NONE when idle)
+    quirk profile (quirk_profile_t)
+    display rows, 8 bytes each with column 0 first, then memory, both as RLE:
+        control byte c < 0x80:  c + 1 literal bytes follow
+        control byte c >= 0x80: (c & 0x7f) + 1 zero bytes
+*/
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "includes/decode.h"
+#include "includes/jit.h"
+#include "includes/snapshot.h"
+#include "includes/state.h"
+
+
+#define SNAPSHOT_HEADER_SIZE   0x2a // everything before the display
+#define SNAPSHOT_DISPLAY_BYTES (DISPLAY_ROWS * 8)
+#define SNAPSHOT_JIT_CHUNK     0x40 // bytes of memory compared at a time to find code a restore changes
+
+/*
+    Copies everything a ROM can observe out of state. Call it between runs, on the
+    thread running the core; keys may still arrive from other threads meanwhile.
+    The registers are copied under key_lock with the Fx0A fields, since the key
+    that completes a wait stores Vx from another thread.
+*/
+void state_snapshot(emu_state_t* state, state_snapshot_t* snapshot)
+{
+    memcpy(snapshot->memory, state->memory, sizeof(snapshot->memory));
+    snapshot->index = state->index;
+    snapshot->pc = state->pc;
+    snapshot->sp = state->sp;
+    snapshot->delay_timer = state->delay_timer;
+    snapshot->sound_timer = state->sound_timer;
+    snapshot->rng = state->rng;
+    snapshot->profile = state->profile;
+    memcpy(snapshot->display, state->display, sizeof(snapshot->display));
+    memcpy(snapshot->decode_cache, state->decode_cache, sizeof(snapshot->decode_cache));
+
+    pthread_mutex_lock(&(state->key_lock));
+    memcpy(snapshot->registers, state->registers, sizeof(snapshot->registers));
+    snapshot->keys = __atomic_load_n(&(state->keys), __ATOMIC_ACQUIRE);
+    snapshot->key_wait_register = state->key_wait_register;
+    snapshot->key_wait_key = state->key_wait_key;
+    pthread_mutex_unlock(&(state->key_lock));
+}
+
+/*
+    Puts state back exactly as it was when the snapshot was taken, RND and quirk
+    profile included, so the same inputs replay the same run. The whole display is
+    marked dirty.
+    Same threading rules as state_snapshot.
+*/
+void state_restore(emu_state_t* state, const state_snapshot_t* snapshot)
+{
+#ifdef JIT
+    if (state->jit != NULL) {
+        // only blocks over memory the restore actually changes need translating again
+        for (uint16_t chunk = 0; chunk <= MEMORY_MASK; chunk += SNAPSHOT_JIT_CHUNK) {
+            if (memcmp(&(state->memory[chunk]), &(snapshot->memory[chunk]), SNAPSHOT_JIT_CHUNK) != 0) {
+                jit_invalidate(state->jit, chunk, SNAPSHOT_JIT_CHUNK);
+            }
+        }
+    }
+#endif
+    if (state->profile != snapshot->profile) {
+        state_set_profile(state, snapshot->profile);
+    }
+    memcpy(state->memory, snapshot->memory, sizeof(state->memory));
+    state->index = snapshot->index;
+    state->pc = snapshot->pc;
+    state->sp = snapshot->sp;
+    state->delay_timer = snapshot->delay_timer;
+    state->sound_timer = snapshot->sound_timer;
+    state->rng = snapshot->rng;
+    memcpy(state->display, snapshot->display, sizeof(state->display));
+    memcpy(state->decode_cache, snapshot->decode_cache, sizeof(state->decode_cache));
+    state->dirty_rows = DISPLAY_ALL_ROWS;
+
+    pthread_mutex_lock(&(state->key_lock));
+    memcpy(state->registers, snapshot->registers, sizeof(state->registers));
+    __atomic_store_n(&(state->keys), snapshot->keys, __ATOMIC_RELEASE);
+    state->key_wait_key = snapshot->key_wait_key;
+    __atomic_store_n(&(state->key_wait_register), snapshot->key_wait_register, __ATOMIC_RELEASE);
+    if (snapshot->key_wait_register == KEY_NONE) {
+        pthread_cond_broadcast(&(state->key_released)); // a state_wait_key caller can go again
+    }
+    pthread_mutex_unlock(&(state->key_lock));
+}
+
+
+/*
+======================
+| Serialized form    |
+======================
+*/
+
+static void put16(uint8_t* out, uint16_t value)
+{
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+}
+
+static uint16_t get16(const uint8_t* in)
+{
+    return in[0] | (in[1] << 8);
+}
+
+static void put32(uint8_t* out, uint32_t value)
+{
+    put16(out, value & 0xffff);
+    put16(out + 2, value >> 16);
+}
+
+static uint32_t get32(const uint8_t* in)
+{
+    return get16(in) | ((uint32_t) get16(in + 2) << 16);
+}
+
+static void put64(uint8_t* out, uint64_t value)
+{
+    put32(out, value & 0xffffffff);
+    put32(out + 4, value >> 32);
+}
+
+static uint64_t get64(const uint8_t* in)
+{
+    return get32(in) | ((uint64_t) get32(in + 4) << 32);
+}
+
+/*
+    Appends data to out as RLE, see the top of the file. Zero runs are what
+    it compresses, so it also suits deltas (rewind.c).
+    Returns the new length of out, or 0 if it wouldn't fit in size.
+*/
+size_t snapshot_rle_encode(const uint8_t* data, size_t length, uint8_t* out, size_t used, size_t size)
+{
+    size_t in = 0;
+    while (in < length) {
+        size_t zeros = 0;
+        while (in + zeros < length && zeros < SNAPSHOT_RUN_MAX && data[in + zeros] == 0) {
+            zeros++;
+        }
+        if (zeros >= 2 || (zeros == 1 && in + 1 == length)) {
+            if (used + 1 > size) {
+                return 0;
+            }
+            out[used++] = 0x80 | (zeros - 1);
+            in += zeros;
+            continue;
+        }
+        // literals run until the next pair of zeros, which is cheaper as a zero run
+        size_t literal = 0;
+        while (in + literal < length && literal < SNAPSHOT_RUN_MAX &&
+            !(data[in + literal] == 0 && in + literal + 1 < length && data[in + literal + 1] == 0)) {
+            literal++;
+        }
+        if (used + 1 + literal > size) {
+            return 0;
+        }
+        out[used++] = literal - 1;
+        memcpy(&(out[used]), &(data[in]), literal);
+        used += literal;
+        in += literal;
+    }
+    return used;
+}
+
+/*
+    Expands exactly length bytes of RLE from in, starting at *used.
+    Returns false if the input ends early or a run would overflow data.
+*/
+bool snapshot_rle_decode(const uint8_t* in, size_t size, size_t* used, uint8_t* data, size_t length)
+{
+    size_t out = 0;
+    while (out < length) {
+        if (*used >= size) {
+            return false;
+        }
+        uint8_t control = in[(*used)++];
+        size_t run = (control & 0x7f) + 1;
+        if (out + run > length) {
+            return false;
+        }
+        if (control & 0x80) {
+            memset(&(data[out]), 0, run);
+        } else {
+            if (*used + run > size) {
+                return false;
+            }
+            memcpy(&(data[out]), &(in[*used]), run);
+            *used += run;
+        }
+        out += run;
+    }
+    return true;
+}
+
+/*
+    Writes the serialized form of snapshot into buffer. Returns its length, or 0
+    if size is too small; SNAPSHOT_SERIALIZED_MAX bytes are always enough.
+*/
+size_t snapshot_serialize(const state_snapshot_t* snapshot, uint8_t* buffer, size_t size)
+{
+    if (size < SNAPSHOT_HEADER_SIZE) {
+        return 0;
+    }
+    memcpy(buffer, SNAPSHOT_MAGIC, 4);
+    buffer[4] = SNAPSHOT_VERSION;
+    memcpy(&(buffer[5]), snapshot->registers, sizeof(snapshot->registers));
+    put16(&(buffer[0x15]), snapshot->index);
+    put16(&(buffer[0x17]), snapshot->pc);
+    put16(&(buffer[0x19]), snapshot->sp);
+    buffer[0x1b] = snapshot->delay_timer;
+    buffer[0x1c] = snapshot->sound_timer;
+    put16(&(buffer[0x1d]), snapshot->keys);
+    put64(&(buffer[0x1f]), snapshot->rng.state);
+    buffer[0x27] = snapshot->key_wait_register;
+    buffer[0x28] = snapshot->key_wait_key;
+    buffer[0x29] = snapshot->profile;
+    size_t used = SNAPSHOT_HEADER_SIZE;
+
+    uint8_t display[SNAPSHOT_DISPLAY_BYTES];
+    for (int row = 0; row < DISPLAY_ROWS; row++) {
+        for (int byte = 0; byte < 8; byte++) {
+            display[row * 8 + byte] = snapshot->display[row] >> (56 - 8 * byte);
+        }
+    }
+    used = snapshot_rle_encode(display, sizeof(display), buffer, used, size);
+    if (used == 0) {
+        return 0;
+    }
+    return snapshot_rle_encode(snapshot->memory, sizeof(snapshot->memory), buffer, used, size);
+}
+
+/*
+    Reads a serialized snapshot back, checking it field by field.
+    Predecoded instructions aren't serialized, so they're decoded again on demand.
+    Returns false, leaving snapshot undefined, if buffer isn't a valid snapshot
+    of a version this build understands.
+*/
+bool snapshot_deserialize(state_snapshot_t* snapshot, const uint8_t* buffer, size_t size)
+{
+    if (size < SNAPSHOT_HEADER_SIZE || memcmp(buffer, SNAPSHOT_MAGIC, 4) != 0) {
+        fprintf(stderr, "error: not a snapshot\n");
+        return false;
+    }
+    if (buffer[4] != SNAPSHOT_VERSION) {
+        fprintf(stderr, "error: snapshot version %u, expected %u\n", buffer[4], SNAPSHOT_VERSION);
+        return false;
+    }
+    memcpy(snapshot->registers, &(buffer[5]), sizeof(snapshot->registers));
+    snapshot->index = get16(&(buffer[0x15]));
+    snapshot->pc = get16(&(buffer[0x17]));
+    snapshot->sp = get16(&(buffer[0x19]));
+    snapshot->delay_timer = buffer[0x1b];
+    snapshot->sound_timer = buffer[0x1c];
+    snapshot->keys = get16(&(buffer[0x1d]));
+    snapshot->rng.state = get64(&(buffer[0x1f]));
+    snapshot->key_wait_register = buffer[0x27];
+    snapshot->key_wait_key = buffer[0x28];
+    snapshot->profile = buffer[0x29];
+    size_t used = SNAPSHOT_HEADER_SIZE;
+    if ((snapshot->key_wait_register >= 0x10 && snapshot->key_wait_register != KEY_NONE) ||
+        (snapshot->key_wait_key >= 0x10 && snapshot->key_wait_key != KEY_NONE)) {
+        fprintf(stderr, "error: snapshot has a bad key wait\n");
+        return false;
+    }
+    if (buffer[0x29] >= PROFILE_COUNT) {
+        fprintf(stderr, "error: snapshot has unknown quirk profile %u\n", buffer[0x29]);
+        return false;
+    }
+
+    uint8_t display[SNAPSHOT_DISPLAY_BYTES];
+    if (!snapshot_rle_decode(buffer, size, &used, display, sizeof(display)) ||
+        !snapshot_rle_decode(buffer, size, &used, snapshot->memory, sizeof(snapshot->memory))) {
+        fprintf(stderr, "error: snapshot is truncated or corrupt\n");
+        return false;
+    }
+    if (used != size) {
+        fprintf(stderr, "error: %zu stray bytes after snapshot\n", size - used);
+        return false;
+    }
+    for (int row = 0; row < DISPLAY_ROWS; row++) {
+        snapshot->display[row] = 0;
+        for (int byte = 0; byte < 8; byte++) {
+            snapshot->display[row] = (snapshot->display[row] << 8) | display[row * 8 + byte];
+        }
+    }
+    memset(snapshot->decode_cache, OP_UNDECODED, sizeof(snapshot->decode_cache));
+    return true;
+}
+
+/*
+    Writes the serialized snapshot to a file.
+*/
+bool snapshot_save(const state_snapshot_t* snapshot, const char* filename)
+{
+    uint8_t buffer[SNAPSHOT_SERIALIZED_MAX];
+    size_t size = snapshot_serialize(snapshot, buffer, sizeof(buffer));
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        return false;
+    }
+    bool written = fwrite(buffer, 1, size, fp) == size;
+    if (fclose(fp) != 0 || !written) {
+        fprintf(stderr, "error: unable to write %s\n", filename);
+        return false;
+    }
+    return true;
+}
+
+/*
+    Reads a serialized snapshot from a file.
+*/
+bool snapshot_load(state_snapshot_t* snapshot, const char* filename)
+{
+    uint8_t buffer[SNAPSHOT_SERIALIZED_MAX + 1]; // one over, so an oversized file is caught
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        return false;
+    }
+    size_t size = fread(buffer, 1, sizeof(buffer), fp);
+    fclose(fp);
+    if (size > SNAPSHOT_SERIALIZED_MAX) {
+        fprintf(stderr, "error: %s is too large to be a snapshot\n", filename);
+        return false;
+    }
+    return snapshot_deserialize(snapshot, buffer, size);
+}
@@ -7,7 +7,12 @@ State handling funcs
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include "includes/decode.h"
+#include "includes/jit.h"
 #include "includes/opcodes.h"
+#include "includes/profiler.h"
+#include "includes/trace.h"
 #include "includes/state.h"
 
 
@@ -41,7 +46,16 @@ emu_state_t* state_new()
         fprintf(stderr, "error: unable to allocate memory for emu state\n");
         return NULL;
     }
-    /* ... */
+    state->jit = NULL;
+    state->profiler = NULL;
+    state->trace = NULL;
+    state->key_wake = false;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // state_wait_key timeouts ignore wall clock changes
+    pthread_mutex_init(&(state->key_lock), NULL);
+    pthread_cond_init(&(state->key_released), &attr);
+    pthread_condattr_destroy(&attr);
     return state;
 }
 
@@ -51,9 +65,32 @@ emu_state_t* state_new()
 */
 void state_init(emu_state_t* state)
 {
+    // everything a ROM can observe starts at zero, so runs don't depend on what malloc left
+    memset(state->registers, 0, sizeof(state->registers));
+    memset(state->memory, 0, sizeof(state->memory));
+    __atomic_store_n(&(state->keys), 0, __ATOMIC_RELAXED);
+    memset(state->display, 0, sizeof(state->display));
+    state->index = 0;
+    state->delay_timer = 0;
+    state->sound_timer = 0;
     state->pc = ROM_START;
     state->sp = STACK_OFFSET;
     memcpy(&(state->memory[FONTSET_OFFSET]), fontset, FONTSET_SIZE);
+    memset(state->decode_cache, OP_UNDECODED, sizeof(state->decode_cache));
+#ifdef JIT
+    if (state->jit != NULL) {
+        jit_invalidate(state->jit, 0, MEMORY_MASK + 1); // a reused state may have run another ROM
+    }
+#endif
+    memset(state->fusions, 0, sizeof(state->fusions));
+    state->skip_idle = true;
+    state->idle_cycles = 0;
+    state->dirty_rows = DISPLAY_ALL_ROWS; // first frame draws everything
+    state->key_wait_register = KEY_NONE;
+    state->key_wait_key = KEY_NONE;
+    rng_seed(&(state->rng), 1); // fixed default, front ends reseed with state_seed
+    state->profile = PROFILE_DEFAULT;
+    state->quirks = QUIRKS_DEFAULT;
 }
 
 /*
@@ -61,175 +98,711 @@ void state_init(emu_state_t* state)
 */
 void state_delete(emu_state_t* state)
 {
-    /* ... */
+    pthread_mutex_destroy(&(state->key_lock));
+    pthread_cond_destroy(&(state->key_released));
     free(state);
 }
 
+/*
+    Returns the rows changed since the last call and clears them.
+    Front ends use this to skip redrawing rows (or whole frames) that didn't change.
+*/
+uint32_t state_take_dirty_rows(emu_state_t* state)
+{
+    uint32_t dirty = state->dirty_rows;
+    state->dirty_rows = 0;
+    return dirty;
+}
 
 /*
-    Performs fetch -> decode -> execute.
+    Presses or releases a keypad key. Safe to call from another thread than the
+    one running the core, which sees the key at its next Ex9E/ExA1: the keypad
+    is a bitmask updated with one atomic operation, so this only takes the lock
+    while Fx0A is waiting. Completes a pending Fx0A once the first key pressed
+    during the wait is released, storing it in Vx and waking state_wait_key.
 */
-int state_cycle(emu_state_t* state)
+void state_set_key(emu_state_t* state, uint8_t key, bool down)
 {
-    if (state == NULL) {
-        fprintf(stderr, "error: null state\n");
-        exit(1);
+    if (key >= 0x10) {
+        return;
     }
-    uint16_t instruction = (state->memory[state->pc] << 8) | (state->memory[state->pc + 1]) ;
-    state->pc += 2;
+    if (down) {
+        __atomic_fetch_or(&(state->keys), 1u << key, __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(&(state->keys), ~(1u << key), __ATOMIC_RELEASE);
+    }
+    if (!state_waiting_for_key(state)) {
+        return;
+    }
+    pthread_mutex_lock(&(state->key_lock));
+    if (state->key_wait_register != KEY_NONE) {
+        if (down && state->key_wait_key == KEY_NONE) {
+            state->key_wait_key = key;
+        } else if (!down && key == state->key_wait_key) {
+            state->registers[state->key_wait_register] = key;
+            __atomic_store_n(&(state->key_wait_register), KEY_NONE, __ATOMIC_RELEASE);
+            pthread_cond_broadcast(&(state->key_released));
+        }
+    }
+    pthread_mutex_unlock(&(state->key_lock));
+}
+
+/*
+    Blocks until a pending Fx0A completes or timeout_ms passes, for front ends
+    that feed keys from another thread. Returns true if the core can run again.
+*/
+bool state_wait_key(emu_state_t* state, uint32_t timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&(state->key_lock));
+    int status = 0;
+    while (state->key_wait_register != KEY_NONE && !state->key_wake && status == 0) {
+        status = pthread_cond_timedwait(&(state->key_released), &(state->key_lock), &deadline);
+    }
+    state->key_wake = false;
+    bool resumed = state->key_wait_register == KEY_NONE;
+    pthread_mutex_unlock(&(state->key_lock));
+    return resumed;
+}
+
+/*
+    Returns a state_wait_key caller early, with Fx0A still pending, for a front
+    end that needs the core's thread for something else (quitting, rewinding).
+    If nobody is waiting, the next state_wait_key returns at once.
+*/
+void state_wake(emu_state_t* state)
+{
+    pthread_mutex_lock(&(state->key_lock));
+    state->key_wake = true;
+    pthread_cond_broadcast(&(state->key_released));
+    pthread_mutex_unlock(&(state->key_lock));
+}
+
+/*
+    Seeds the instance's RND generator. Instances never share generator state,
+    so a given seed reproduces the same run on any thread.
+*/
+void state_seed(emu_state_t* state, uint64_t seed)
+{
+    rng_seed(&(state->rng), seed);
+}
+
+/*
+    Switches the instructions that differ between platforms to those of profile.
+    Call it after state_init, which resets to PROFILE_DEFAULT.
+*/
+void state_set_profile(emu_state_t* state, quirk_profile_t profile)
+{
+    state->profile = profile;
+    state->quirks = quirks_flags(profile);
+#ifdef JIT
+    if (state->jit != NULL) {
+        jit_invalidate(state->jit, 0, MEMORY_MASK + 1); // blocks are translated for one profile
+    }
+#endif
+}
+
+/*
+    Counts both timers down by one. Called once per 60hz frame by the scheduler,
+    never per instruction, so timer speed doesn't depend on instruction speed.
+*/
+void state_tick_timers(emu_state_t* state)
+{
+    if (state->delay_timer > 0) {
+        state->delay_timer--;
+    }
+    if (state->sound_timer > 0) {
+        state->sound_timer--;
+    }
+}
+
+
+/*
+==============================
+| Predecoded op handlers     |
+==============================
+
+Handlers for instructions that differ between profiles take the QUIRK_* flags,
+and are always inlined, so each copy of the interpreter has them as constants.
+*/
+
+#define QUIRK_HANDLER static inline __attribute__((always_inline))
+
+static inline void exec_nop(emu_state_t* state, decoded_instr_t instr)
+{
+    (void) state;
+    (void) instr;
+}
+
+static inline void exec_cls(emu_state_t* state, decoded_instr_t instr)
+{
+    (void) instr;
+    CLS(state);
+}
+
+static inline void exec_ret(emu_state_t* state, decoded_instr_t instr)
+{
+    (void) instr;
+    RET(state);
+}
+
+static inline void exec_jp(emu_state_t* state, decoded_instr_t instr)
+{
+    JP(state, DECODED_NNN(instr));
+}
+
+static inline void exec_call(emu_state_t* state, decoded_instr_t instr)
+{
+    CALL(state, DECODED_NNN(instr));
+}
+
+static inline void exec_se_byte(emu_state_t* state, decoded_instr_t instr)
+{
+    SE(state, state->registers[instr.x], instr.kk);
+}
+
+static inline void exec_sne_byte(emu_state_t* state, decoded_instr_t instr)
+{
+    SNE(state, state->registers[instr.x], instr.kk);
+}
+
+static inline void exec_se_reg(emu_state_t* state, decoded_instr_t instr)
+{
+    SE(state, state->registers[instr.x], state->registers[instr.y]);
+}
+
+static inline void exec_ld_byte(emu_state_t* state, decoded_instr_t instr)
+{
+    state->registers[instr.x] = instr.kk;
+}
+
+static inline void exec_add_byte(emu_state_t* state, decoded_instr_t instr)
+{
+    ADD(state, &(state->registers[instr.x]), instr.kk, false);
+}
+
+static inline void exec_ld_reg(emu_state_t* state, decoded_instr_t instr)
+{
+    state->registers[instr.x] = state->registers[instr.y];
+}
+
+QUIRK_HANDLER void exec_or(emu_state_t* state, decoded_instr_t instr, uint32_t quirks)
+{
+    OR(state, instr.x, instr.y);
+    if (quirks & QUIRK_VF_RESET) {
+        state->registers[0xF] = 0;
+    }
+}
+
+QUIRK_HANDLER void exec_and(emu_state_t* state, decoded_instr_t instr, uint32_t quirks)
+{
+    AND(state, instr.x, instr.y);
+    if (quirks & QUIRK_VF_RESET) {
+        state->registers[0xF] = 0;
+    }
+}
+
+QUIRK_HANDLER void exec_xor(emu_state_t* state, decoded_instr_t instr, uint32_t quirks)
+{
+    XOR(state, instr.x, instr.y);
+    if (quirks & QUIRK_VF_RESET) {
+        state->registers[0xF] = 0;
+    }
+}
+
+static inline void exec_add_reg(emu_state_t* state, decoded_instr_t instr)
+{
+    ADD(state, &(state->registers[instr.x]), state->registers[instr.y], true);
+}
+
+static inline void exec_sub(emu_state_t* state, decoded_instr_t instr)
+{
+    SUB(state, instr.x, instr.y);
+}
+
+QUIRK_HANDLER void exec_shr(emu_state_t* state, decoded_instr_t instr, uint32_t quirks)
+{
+    if (quirks & QUIRK_SHIFT_VY) {
+        state->registers[instr.x] = state->registers[instr.y];
+    }
+    SHR(state, instr.x);
+}
+
+static inline void exec_subn(emu_state_t* state, decoded_instr_t instr)
+{
+    SUBN(state, instr.x, instr.y);
+}
+
+QUIRK_HANDLER void exec_shl(emu_state_t* state, decoded_instr_t instr, uint32_t quirks)
+{
+    if (quirks & QUIRK_SHIFT_VY) {
+        state->registers[instr.x] = state->registers[instr.y];
+    }
+    SHL(state, instr.x);
+}
+
+static inline void exec_sne_reg(emu_state_t* state, decoded_instr_t instr)
+{
+    SNE(state, state->registers[instr.x], state->registers[instr.y]);
+}
+
+static inline void exec_ld_i(emu_state_t* state, decoded_instr_t instr)
+{
+    LD(state, &(state->index), DECODED_NNN(instr));
+}
+
+QUIRK_HANDLER void exec_jp_v0(emu_state_t* state, decoded_instr_t instr, uint32_t quirks)
+{
+    JP(state, DECODED_NNN(instr) + state->registers[(quirks & QUIRK_JUMP_VX) ? instr.x : 0x0]);
+}
+
+static inline void exec_rnd(emu_state_t* state, decoded_instr_t instr)
+{
+    RND(state, instr.x, instr.kk);
+}
+
+static inline void exec_drw(emu_state_t* state, decoded_instr_t instr)
+{
+    DRW(state, instr.x, instr.y, DECODED_N(instr));
+}
+
+static inline void exec_skp(emu_state_t* state, decoded_instr_t instr)
+{
+    SKP(state, instr.x, true);
+}
+
+static inline void exec_sknp(emu_state_t* state, decoded_instr_t instr)
+{
+    SKP(state, instr.x, false);
+}
+
+static inline void exec_ld_vx_dt(emu_state_t* state, decoded_instr_t instr)
+{
+    state->registers[instr.x] = state->delay_timer;
+}
+
+/*
+    Suspends the core until a key is pressed and released, see state_set_key.
+    pc already points past Fx0A, so execution resumes after it once Vx is set.
+*/
+static inline void exec_ld_vx_k(emu_state_t* state, decoded_instr_t instr)
+{
+    pthread_mutex_lock(&(state->key_lock));
+    state->key_wait_key = KEY_NONE;
+    __atomic_store_n(&(state->key_wait_register), instr.x, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&(state->key_lock));
+}
+
+static inline void exec_ld_dt_vx(emu_state_t* state, decoded_instr_t instr)
+{
+    state->delay_timer = state->registers[instr.x];
+}
+
+static inline void exec_ld_st_vx(emu_state_t* state, decoded_instr_t instr)
+{
+    state->sound_timer = state->registers[instr.x];
+}
+
+static inline void exec_add_i_vx(emu_state_t* state, decoded_instr_t instr)
+{
+    state->index += state->registers[instr.x];
+}
+
+static inline void exec_ld_f_vx(emu_state_t* state, decoded_instr_t instr)
+{
+    state->index = state->registers[instr.x] * FONT_SIZE + FONTSET_OFFSET;
+}
+
+static inline void exec_ld_b_vx(emu_state_t* state, decoded_instr_t instr)
+{
+    uint16_t address = state->index & MEMORY_MASK;
+    state->memory[(address + 2) & MEMORY_MASK] = state->registers[instr.x] % 10;
+    state->memory[(address + 1) & MEMORY_MASK] = (state->registers[instr.x] / 10) % 10;
+    state->memory[address] = (state->registers[instr.x] / 100) % 10;
+    decode_invalidate(state, address, 3);
+}
+
+/*
+    Where Fx55/Fx65 leave I, by profile.
+*/
+QUIRK_HANDLER void index_after_memory(emu_state_t* state, decoded_instr_t instr, uint32_t quirks)
+{
+    if (quirks & QUIRK_INDEX_INCREMENT) {
+        state->index += instr.x + 1;
+    } else if (quirks & QUIRK_INDEX_ADD_X) {
+        state->index += instr.x;
+    }
+}
+
+QUIRK_HANDLER void exec_ld_mem_vx(emu_state_t* state, decoded_instr_t instr, uint32_t quirks)
+{
+    for (int i = 0; i <= instr.x; i++) {
+        state->memory[(state->index + i) & MEMORY_MASK] = state->registers[i];
+    }
+    decode_invalidate(state, state->index & MEMORY_MASK, instr.x + 1);
+    index_after_memory(state, instr, quirks);
+}
+
+QUIRK_HANDLER void exec_ld_vx_mem(emu_state_t* state, decoded_instr_t instr, uint32_t quirks)
+{
+    for (int i = 0; i <= instr.x; i++) {
+        state->registers[i] = state->memory[(state->index + i) & MEMORY_MASK];
+    }
+    index_after_memory(state, instr, quirks);
+}
+
+/*
+======================
+| Idle loops         |
+======================
+
+Loops whose iterations can't change anything before the next frame boundary,
+since timers only tick between runs and neither loop reads the keys:
+    1nnn jumping to itself
+    Fx07 / 3x00 / 1nnn back to the Fx07, polling a nonzero delay timer
+Every iteration leaves the state exactly as it found it, so whole iterations
+can be skipped without being interpreted.
+*/
+
+/*
+    True if memory at start holds the Fx07 / 3x00 / 1nnn delay timer poll.
+    Fx07 may be the first half of a fused Fx07 + 3xkk slot.
+*/
+static inline bool is_delay_poll(emu_state_t* state, uint16_t start)
+{
+    if (start + 6 > DECODE_CACHE_SIZE * 2) {
+        return false;
+    }
+    decoded_instr_t poll = decode_fetch(state, start);
+    decoded_instr_t test = decode_fetch(state, start + 2);
+    decoded_instr_t jump = decode_fetch(state, start + 4);
+    return (poll.op == OP_LD_VX_DT || poll.op == OP_LD_DT_SE) &&
+        test.op == OP_SE_BYTE && test.x == poll.x && test.kk == 0 &&
+        jump.op == OP_JP && DECODED_NNN(jump) == start;
+}
+
+/*
+    Called for a 1nnn at jump_pc about to go to target, with remaining instructions
+    left in the run after it. Returns how many of those are whole idle iterations
+    that can be skipped.
+*/
+static inline uint64_t skip_idle(emu_state_t* state, uint16_t jump_pc, uint16_t target, uint64_t remaining)
+{
+    uint8_t length;
+    if (!state->skip_idle) {
+        return 0;
+    } else if (target == jump_pc) {
+        length = IDLE_SELF_JUMP;
+    } else if (target + 4 == jump_pc && state->delay_timer != 0 && is_delay_poll(state, target)) {
+        length = IDLE_POLL_DT;
+    } else {
+        return 0;
+    }
+    uint64_t skipped = remaining - remaining % length;
+    if (skipped > 0 && length == IDLE_POLL_DT) {
+        // the first skipped Fx07 might be the first to run since jumping in
+        state->registers[decode_fetch(state, target).x] = state->delay_timer;
+    }
+    state->idle_cycles += skipped;
+    return skipped;
+}
+
+/*
+    Entry point to skip_idle for engines outside this file (the JIT), which
+    must check the instruction at jump_pc is a 1nnn first. Returns 0 otherwise.
+*/
+uint64_t state_skip_idle(emu_state_t* state, uint16_t jump_pc, uint64_t remaining)
+{
+    decoded_instr_t jump = decode_fetch(state, jump_pc);
+    if (jump.op != OP_JP) {
+        return 0;
+    }
+    return skip_idle(state, jump_pc, DECODED_NNN(jump), remaining);
+}
 
-    uint8_t first_nibble = (instruction & 0xf000) >> 12;
-    uint8_t second_nibble = (instruction & 0xf00) >> 8;
-    uint8_t third_nibble = (instruction & 0xf0) >> 4;
-    uint8_t fourth_nibble = (instruction & 0xf);
-    uint8_t keypress;
-
-    // decode instruction
-    switch (first_nibble) {
-        case 0x0:
-            switch (instruction) {
-                case 0x00E0:
-                    CLS(state);
-                    break;
-                case 0x0EE:
-                    RET(state);
-                    break;
-                default:
-                    break;
+/*
+    Returns the length in instructions of the idle loop pc is parked in, storing
+    its first address in start, or 0 if the core isn't idle.
+*/
+uint8_t state_idle_loop(emu_state_t* state, uint16_t* start)
+{
+    uint16_t pc = state->pc;
+    if (pc + 2 > DECODE_CACHE_SIZE * 2) {
+        return 0;
+    }
+    decoded_instr_t instr = decode_fetch(state, pc);
+    if (instr.op == OP_JP && DECODED_NNN(instr) == pc) {
+        *start = pc;
+        return IDLE_SELF_JUMP;
+    }
+    if (state->delay_timer == 0) {
+        return 0;
+    }
+    for (uint16_t phase = 0; phase < IDLE_POLL_DT && phase * 2 <= pc; phase++) {
+        uint16_t base = pc - phase * 2;
+        if (is_delay_poll(state, base)) {
+            // parked on the 3x00 with a zero register, the jump back gets skipped
+            if (phase == 1 && state->registers[decode_fetch(state, base).x] == 0) {
+                return 0;
             }
+            *start = base;
+            return IDLE_POLL_DT;
+        }
+    }
+    return 0;
+}
+
+/*
+    Skips up to the given number of whole frames while the core is parked in an
+    idle loop at a frame boundary, returning how many were skipped. Leaves the state
+    exactly as if they had been interpreted: pc at the same point in the loop, the
+    polled register holding the last delay timer value read and both timers ticked
+    once per frame. A delay timer poll only stays idle until the timer reaches 0.
+*/
+uint64_t state_skip_idle_frames(emu_state_t* state, uint64_t frames, uint32_t instructions_per_frame)
+{
+    uint16_t start;
+    uint8_t length = state_idle_loop(state, &start);
+    if (!state->skip_idle || length == 0 || instructions_per_frame < length) {
+        return 0;
+    }
+    if (length == IDLE_POLL_DT) {
+        if (frames > state->delay_timer) {
+            frames = state->delay_timer;
+        }
+        if (frames == 0) {
+            return 0;
+        }
+        state->registers[decode_fetch(state, start).x] = state->delay_timer - frames + 1;
+    }
+    uint64_t phase = (state->pc - start) / 2;
+    state->pc = start + 2 * ((phase + frames * instructions_per_frame) % length);
+    state->delay_timer = state->delay_timer > frames ? state->delay_timer - frames : 0;
+    state->sound_timer = state->sound_timer > frames ? state->sound_timer - frames : 0;
+    state->idle_cycles += frames * instructions_per_frame;
+    return frames;
+}
+
+/*
+    Runs both halves of a superinstruction, two instructions.
+    pc must already point past the first half.
+*/
+QUIRK_HANDLER void exec_fused(emu_state_t* state, decoded_instr_t instr, uint32_t quirks)
+{
+    decoded_instr_t second = decode_fetch(state, state->pc);
+    state->pc += 2;
+    switch (instr.op) {
+        case OP_LD_BYTE_DRW:
+            exec_ld_byte(state, instr);
+            exec_drw(state, second);
             break;
-        case 0x1:
-            JP(state, instruction & 0x0fff);
-            break;
-        case 0x2:
-            CALL(state, instruction & 0x0fff);
-            break;
-        case 0x3:
-            SE(state, state->registers[second_nibble], (uint8_t)(instruction & 0xff));
-            break;
-        case 0x4:
-            SNE(state, state->registers[second_nibble], (uint8_t)(instruction & 0xff));
-            break;
-        case 0x5:
-            SE(state, state->registers[second_nibble], state->registers[third_nibble]);
-            break;
-        case 0x6:
-            state->registers[second_nibble] = (uint8_t)(instruction & 0xff);
-            break;
-        case 0x7:
-            ADD(state, &(state->registers[second_nibble]), (uint8_t)(instruction & 0xff), false);
-            break;
-        case 0x8:
-            switch (fourth_nibble) {
-                case 0x0:
-                    state->registers[second_nibble] = state->registers[third_nibble];
-                    break;
-                case 0x1:
-                    OR(state, second_nibble, third_nibble);
-                    break;
-                case 0x2:
-                    AND(state, second_nibble, third_nibble);
-                    break;
-                case 0x3:
-                    XOR(state, second_nibble, third_nibble);
-                    break;
-                case 0x4:
-                    ADD(state, &(state->registers[second_nibble]), state->registers[third_nibble], true);
-                    break;
-                case 0x5:
-                    SUB(state, second_nibble, third_nibble);
-                    break;
-                case 0x6:
-                    SHR(state, second_nibble);
-                    break;
-                case 0x7:
-                    SUBN(state, second_nibble, third_nibble);
-                    break;
-                case 0xE:
-                    SHL(state, second_nibble);
-                    break;
-            }
+        case OP_LD_I_DRW:
+            exec_ld_i(state, instr);
+            exec_drw(state, second);
             break;
-        case 0x9:
-            SNE(state, state->registers[second_nibble], state->registers[third_nibble]);
+        case OP_LD_DT_SE:
+            exec_ld_vx_dt(state, instr);
+            exec_se_byte(state, second);
             break;
-        case 0xA:
-            LD(state, &(state->index), instruction & 0x0fff);
+        case OP_ADD_BYTE_SE:
+            exec_add_byte(state, instr);
+            exec_se_byte(state, second);
             break;
-        case 0xB:
-            JP(state, (instruction & 0x0fff) + state->registers[0x0]);
+    }
+    state->fusions[instr.op - OP_FUSED_FIRST]++;
+    (void) quirks; // no superinstruction has a quirk yet
+}
+
+QUIRK_HANDLER void exec_decoded(emu_state_t* state, decoded_instr_t instr, uint32_t quirks)
+{
+    switch (instr.op) {
+        case OP_CLS:
+            exec_cls(state, instr);
             break;
-        case 0xC:
-            RND(state, second_nibble, (uint8_t) (instruction & 0xff));
+        case OP_RET:
+            exec_ret(state, instr);
             break;
-        case 0xD:
-            DRW(state, second_nibble, third_nibble, fourth_nibble);
+        case OP_JP:
+            exec_jp(state, instr);
             break;
-        case 0xE:
-            switch (third_nibble) {
-                case 0x9:
-                    SKP(state, second_nibble, true);
-                    break;
-                case 0xA:
-                    SKP(state, second_nibble, false);
-                    break;
-            }
+        case OP_CALL:
+            exec_call(state, instr);
             break;
-        case 0xF:
-            switch (instruction & 0xff) {
-                case 0x07:
-                    state->registers[second_nibble] = state->delay_timer;
-                    break;
-                case 0x0A:
-                    keypress = 0; // TODO - update this
-                    for (int k = 0; k < 0x10; k++) {
-                        if (state->keys[k]) {
-                            keypress = k;
-                            break;
-                        }
-                    } 
-                    // stop all execution until keypress
-                    // then store value in Vx
-                    state->registers[second_nibble] = keypress;
-                    break;
-                case 0x15:
-                    state->delay_timer = state->registers[second_nibble];
-                    break;
-                case 0x18:
-                    state->sound_timer = state->registers[second_nibble];
-                    break;
-                case 0x1E:
-                    state->index += state->registers[second_nibble];
-                    break;
-                case 0x29:
-                    state->index = state->registers[second_nibble] * FONT_SIZE + FONTSET_OFFSET;
-                    break;
-                case 0x33:
-                    state->memory[state->index + 2] = state->registers[second_nibble] % 10;
-                    state->memory[state->index + 1] = (state->registers[second_nibble] / 10) % 10;
-                    state->memory[state->index] = (state->registers[second_nibble] / 100) % 10;
-                    break;
-                case 0x55:
-                    for (int i = 0; i <= second_nibble; i++) {
-                        state->memory[state->index + i] = state->registers[i];
-                    }
-                    break;
-                case 0x65:
-                    for (int i = 0; i <= second_nibble; i++) {
-                        state->registers[i] = state->memory[state->index + i];
-                    }
-                    break;
-            }
+        case OP_SE_BYTE:
+            exec_se_byte(state, instr);
+            break;
+        case OP_SNE_BYTE:
+            exec_sne_byte(state, instr);
+            break;
+        case OP_SE_REG:
+            exec_se_reg(state, instr);
+            break;
+        case OP_LD_BYTE:
+            exec_ld_byte(state, instr);
+            break;
+        case OP_ADD_BYTE:
+            exec_add_byte(state, instr);
+            break;
+        case OP_LD_REG:
+            exec_ld_reg(state, instr);
+            break;
+        case OP_OR:
+            exec_or(state, instr, quirks);
+            break;
+        case OP_AND:
+            exec_and(state, instr, quirks);
+            break;
+        case OP_XOR:
+            exec_xor(state, instr, quirks);
+            break;
+        case OP_ADD_REG:
+            exec_add_reg(state, instr);
+            break;
+        case OP_SUB:
+            exec_sub(state, instr);
+            break;
+        case OP_SHR:
+            exec_shr(state, instr, quirks);
+            break;
+        case OP_SUBN:
+            exec_subn(state, instr);
+            break;
+        case OP_SHL:
+            exec_shl(state, instr, quirks);
+            break;
+        case OP_SNE_REG:
+            exec_sne_reg(state, instr);
+            break;
+        case OP_LD_I:
+            exec_ld_i(state, instr);
+            break;
+        case OP_JP_V0:
+            exec_jp_v0(state, instr, quirks);
+            break;
+        case OP_RND:
+            exec_rnd(state, instr);
+            break;
+        case OP_DRW:
+            exec_drw(state, instr);
+            break;
+        case OP_SKP:
+            exec_skp(state, instr);
+            break;
+        case OP_SKNP:
+            exec_sknp(state, instr);
+            break;
+        case OP_LD_VX_DT:
+            exec_ld_vx_dt(state, instr);
+            break;
+        case OP_LD_VX_K:
+            exec_ld_vx_k(state, instr);
+            break;
+        case OP_LD_DT_VX:
+            exec_ld_dt_vx(state, instr);
+            break;
+        case OP_LD_ST_VX:
+            exec_ld_st_vx(state, instr);
+            break;
+        case OP_ADD_I_VX:
+            exec_add_i_vx(state, instr);
+            break;
+        case OP_LD_F_VX:
+            exec_ld_f_vx(state, instr);
+            break;
+        case OP_LD_B_VX:
+            exec_ld_b_vx(state, instr);
             break;
-    } 
+        case OP_LD_MEM_VX:
+            exec_ld_mem_vx(state, instr, quirks);
+            break;
+        case OP_LD_VX_MEM:
+            exec_ld_vx_mem(state, instr, quirks);
+            break;
+        // superinstructions run their first half alone when stepped one cycle at a time
+        case OP_LD_BYTE_DRW:
+            exec_ld_byte(state, instr);
+            break;
+        case OP_LD_I_DRW:
+            exec_ld_i(state, instr);
+            break;
+        case OP_LD_DT_SE:
+            exec_ld_vx_dt(state, instr);
+            break;
+        case OP_ADD_BYTE_SE:
+            exec_add_byte(state, instr);
+            break;
+        default:
+            exec_nop(state, instr);
+            break;
+    }
+}
 
 
-    if (state->delay_timer > 0) {
-        state->delay_timer--;
+
+/*
+======================
+| Engines            |
+======================
+
+One copy of the interpreter per quirk profile, from includes/dispatch.h.
+state_run picks a copy once per call, and inside a copy every quirk is a constant.
+*/
+
+#define QUIRKS   QUIRKS_DEFAULT
+#define RUN_NAME run_default
+#include "includes/dispatch.h"
+
+#define QUIRKS   QUIRKS_CHIP8
+#define RUN_NAME run_chip8
+#include "includes/dispatch.h"
+
+#define QUIRKS   QUIRKS_CHIP48
+#define RUN_NAME run_chip48
+#include "includes/dispatch.h"
+
+#define QUIRKS   QUIRKS_SCHIP
+#define RUN_NAME run_schip
+#include "includes/dispatch.h"
+
+static int (* const profile_runs[PROFILE_COUNT])(emu_state_t* state, uint64_t cycles, uint64_t* executed) = {
+    [PROFILE_DEFAULT] = run_default,
+    [PROFILE_CHIP8]   = run_chip8,
+    [PROFILE_CHIP48]  = run_chip48,
+    [PROFILE_SCHIP]   = run_schip,
+};
+
+/*
+    Runs the given number of cycles back to back on the state's profile, taking
+    superinstructions whole when at least two cycles remain.
+    Sets *executed to the instructions retired, idle-loop skips included; fewer
+    than cycles only when stopped by Fx0A.
+*/
+int state_run(emu_state_t* state, uint64_t cycles, uint64_t* executed)
+{
+    *executed = 0;
+    if (state == NULL) {
+        fprintf(stderr, "error: null state\n");
+        return CYCLE_ERROR;
     }
-    if (state->sound_timer > 0) {
-        state->sound_timer--;
+    if (state_waiting_for_key(state)) {
+        return CYCLE_KEY_WAIT;
     }
+    return profile_runs[state->profile](state, cycles, executed);
+}
 
-    return CYCLE_SUCCESS;
+/*
+    Performs fetch -> decode -> execute.
+    Decoding is cached per address, see decode.c.
+*/
+int state_cycle(emu_state_t* state)
+{
+    uint64_t executed;
+    return state_run(state, 1, &executed);
 }
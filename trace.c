@@ -0,0 +1,304 @@
+/*
+Trace - a compact record of every executed instruction, streamed to a file
+
+Built in with `make TRACE=1`; otherwise the engines' hooks compile to nothing.
+A trace is a header (magic, version, V0-VF and I when tracing started) and then
+one record per dispatch, see the TRACE_* flags in trace.h. Records only hold
+what can't be inferred: the pc when it didn't follow on from the previous
+record, the cycle count when instructions were fast-forwarded, and the V
+registers and I that changed, with their new values. A straight-line
+instruction that writes one register is 6 bytes.
+
+The engine fills one buffer while a writer thread writes the other, so tracing
+costs the encoding and a copy, not a system call per record.
+*/
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "includes/trace.h"
+
+
+static void* trace_writer(void* arg)
+{
+    trace_t* trace = arg;
+    pthread_mutex_lock(&(trace->lock));
+    while (true) {
+        while (trace->full == 0 && !trace->closing) {
+            pthread_cond_wait(&(trace->changed), &(trace->lock));
+        }
+        if (trace->full == 0) {
+            break; // closing, and everything is written
+        }
+        // the engine never touches the full buffer, so write it without the lock
+        uint8_t* buffer = trace->buffers[!trace->filling];
+        size_t size = trace->full;
+        pthread_mutex_unlock(&(trace->lock));
+        bool written = fwrite(buffer, 1, size, trace->fp) == size;
+        pthread_mutex_lock(&(trace->lock));
+        trace->failed |= !written;
+        trace->full = 0;
+        pthread_cond_broadcast(&(trace->changed));
+    }
+    pthread_mutex_unlock(&(trace->lock));
+    return NULL;
+}
+
+/*
+    Creates the trace file and starts its writer thread.
+*/
+trace_t* trace_open(const char* filename)
+{
+    trace_t* trace = calloc(1, sizeof(trace_t));
+    if (trace == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for trace\n");
+        return NULL;
+    }
+    trace->buffers[0] = malloc(TRACE_BUFFER_SIZE);
+    trace->buffers[1] = malloc(TRACE_BUFFER_SIZE);
+    if (trace->buffers[0] == NULL || trace->buffers[1] == NULL) {
+        fprintf(stderr, "error: unable to allocate memory for trace\n");
+        free(trace->buffers[0]);
+        free(trace->buffers[1]);
+        free(trace);
+        return NULL;
+    }
+    trace->fp = fopen(filename, "wb");
+    if (trace->fp == NULL) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        free(trace->buffers[0]);
+        free(trace->buffers[1]);
+        free(trace);
+        return NULL;
+    }
+    pthread_mutex_init(&(trace->lock), NULL);
+    pthread_cond_init(&(trace->changed), NULL);
+    if (pthread_create(&(trace->writer), NULL, trace_writer, trace) != 0) {
+        fprintf(stderr, "error: unable to start the trace writer\n");
+        fclose(trace->fp);
+        pthread_mutex_destroy(&(trace->lock));
+        pthread_cond_destroy(&(trace->changed));
+        free(trace->buffers[0]);
+        free(trace->buffers[1]);
+        free(trace);
+        return NULL;
+    }
+    trace->next_pc = UINT16_MAX; // the first record always carries its pc
+    return trace;
+}
+
+/*
+    Starts tracing everything the state runs, from its current registers.
+*/
+void trace_attach(trace_t* trace, emu_state_t* state)
+{
+    if (state == NULL) {
+        fprintf(stderr, "error: null state\n");
+        return;
+    }
+    uint8_t* out = trace->buffers[trace->filling];
+    memcpy(out, TRACE_MAGIC, 4);
+    out[4] = TRACE_VERSION;
+    memcpy(&(out[5]), state->registers, sizeof(state->registers));
+    out[0x15] = state->index & 0xff;
+    out[0x16] = state->index >> 8;
+    trace->used = TRACE_HEADER_SIZE;
+    memcpy(trace->registers, state->registers, sizeof(trace->registers));
+    trace->index = state->index;
+    trace->idle_cycles = state->idle_cycles;
+    state->trace = trace;
+}
+
+/*
+    Hands the filled buffer to the writer and carries on in the other one,
+    waiting only if the writer hasn't finished with it yet.
+*/
+void trace_handoff(trace_t* trace)
+{
+    pthread_mutex_lock(&(trace->lock));
+    while (trace->full != 0) {
+        pthread_cond_wait(&(trace->changed), &(trace->lock));
+    }
+    trace->full = trace->used;
+    trace->filling = !trace->filling;
+    trace->used = 0;
+    pthread_cond_broadcast(&(trace->changed));
+    pthread_mutex_unlock(&(trace->lock));
+}
+
+/*
+    Writes out what's buffered, stops the writer and closes the file, once the
+    state it is attached to has stopped running. Returns false if any of it failed to write.
+*/
+bool trace_close(trace_t* trace)
+{
+    if (trace == NULL) {
+        return true;
+    }
+    if (trace->used > 0) {
+        trace_handoff(trace);
+    }
+    pthread_mutex_lock(&(trace->lock));
+    trace->closing = true;
+    pthread_cond_broadcast(&(trace->changed));
+    pthread_mutex_unlock(&(trace->lock));
+    pthread_join(trace->writer, NULL);
+
+    bool written = !trace->failed;
+    written &= fclose(trace->fp) == 0;
+    if (!written) {
+        fprintf(stderr, "error: unable to write the trace\n");
+    }
+    pthread_mutex_destroy(&(trace->lock));
+    pthread_cond_destroy(&(trace->changed));
+    free(trace->buffers[0]);
+    free(trace->buffers[1]);
+    free(trace);
+    return written;
+}
+
+
+
+/*
+======================
+| Reader             |
+======================
+*/
+
+/*
+    Opens a trace and checks its header.
+*/
+bool trace_reader_open(trace_reader_t* reader, const char* filename)
+{
+    reader->fp = fopen(filename, "rb");
+    if (reader->fp == NULL) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        return false;
+    }
+    uint8_t header[TRACE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), reader->fp) != sizeof(header) || memcmp(header, TRACE_MAGIC, 4) != 0) {
+        fprintf(stderr, "error: %s is not a trace\n", filename);
+        fclose(reader->fp);
+        return false;
+    }
+    if (header[4] != TRACE_VERSION) {
+        fprintf(stderr, "error: %s is trace version %d, expected %d\n", filename, header[4], TRACE_VERSION);
+        fclose(reader->fp);
+        return false;
+    }
+    memcpy(reader->registers, &(header[5]), sizeof(reader->registers));
+    reader->index = header[0x15] | (header[0x16] << 8);
+    reader->cycle = 0;
+    reader->next_pc = UINT16_MAX;
+    return true;
+}
+
+static bool read_bytes(trace_reader_t* reader, uint8_t* bytes, size_t count)
+{
+    return fread(bytes, 1, count, reader->fp) == count;
+}
+
+static bool read_count(trace_reader_t* reader, uint64_t* count)
+{
+    *count = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(reader->fp);
+        if (byte == EOF) {
+            return false;
+        }
+        *count |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int trace_truncated(trace_reader_t* reader)
+{
+    fprintf(stderr, "error: trace cut off after cycle %llu\n", (unsigned long long) reader->cycle);
+    return -1;
+}
+
+/*
+    Decodes the next record. Returns 1 for a record, 0 at the end of the trace
+    and -1, after reporting it, if the trace is cut off or corrupt.
+*/
+int trace_read(trace_reader_t* reader, trace_record_t* record)
+{
+    int flags = fgetc(reader->fp);
+    if (flags == EOF) {
+        return 0;
+    }
+    uint8_t bytes[0x10];
+    uint64_t count;
+    record->pc = reader->next_pc;
+    if (flags & TRACE_JUMP) {
+        if (!read_bytes(reader, bytes, 2)) {
+            return trace_truncated(reader);
+        }
+        record->pc = bytes[0] | (bytes[1] << 8);
+    }
+    record->skipped = 0;
+    if ((flags & TRACE_SKIPPED) && !read_count(reader, &(record->skipped))) {
+        return trace_truncated(reader);
+    }
+    reader->cycle += record->skipped;
+    record->cycle = reader->cycle;
+    if (!read_bytes(reader, bytes, 2)) {
+        return trace_truncated(reader);
+    }
+    record->opcodes[0] = (bytes[0] << 8) | bytes[1];
+    record->opcodes[1] = 0;
+    record->count = 1;
+    if (flags & TRACE_FUSED) {
+        if (!read_bytes(reader, bytes, 2)) {
+            return trace_truncated(reader);
+        }
+        record->opcodes[1] = (bytes[0] << 8) | bytes[1];
+        record->count = 2;
+    }
+    if (flags & TRACE_BLOCK) {
+        if (!read_count(reader, &count) || count == 0 || count > UINT32_MAX) {
+            return trace_truncated(reader);
+        }
+        record->count = count;
+    }
+    record->changed = 0;
+    if (flags & TRACE_REGS) {
+        if (!read_bytes(reader, bytes, 2)) {
+            return trace_truncated(reader);
+        }
+        record->changed = bytes[0] | (bytes[1] << 8);
+        int changed = __builtin_popcount(record->changed);
+        if (!read_bytes(reader, bytes, changed)) {
+            return trace_truncated(reader);
+        }
+        for (int i = 0, value = 0; i < 0x10; i++) {
+            if (record->changed & (1 << i)) {
+                reader->registers[i] = bytes[value++];
+            }
+        }
+    }
+    record->index_changed = (flags & TRACE_INDEX) != 0;
+    if (record->index_changed) {
+        if (!read_bytes(reader, bytes, 2)) {
+            return trace_truncated(reader);
+        }
+        reader->index = bytes[0] | (bytes[1] << 8);
+    }
+    memcpy(record->registers, reader->registers, sizeof(record->registers));
+    record->index = reader->index;
+    reader->cycle += record->count;
+    reader->next_pc = record->pc + 2 * record->count;
+    return 1;
+}
+
+void trace_reader_close(trace_reader_t* reader)
+{
+    fclose(reader->fp);
+}
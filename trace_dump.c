@@ -0,0 +1,144 @@
+/*
+Trace reader - prints a trace written by --trace, one line per record
+
+usage: emu_trace [options] <trace file>
+
+    --from ADDR     only records with pc >= ADDR
+    --to ADDR       only records with pc <= ADDR
+    --cycles A-B    only records whose cycle is in [A, B]
+    --registers     print all of V0-VF and I after each record, not just what changed
+
+Each line is the cycle the record starts at, its pc and opcode, then the
+registers it changed with their new values. A superinstruction shows both
+opcodes; a translated JIT block shows its first opcode and its length.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "includes/trace.h"
+
+
+typedef struct dump_options {
+    uint16_t from;
+    uint16_t to;
+    uint64_t first_cycle;
+    uint64_t last_cycle;
+    bool registers;
+    char* trace;
+} dump_options_t;
+
+
+static void usage(char* program)
+{
+    fprintf(stderr, "usage: %s [--from ADDR] [--to ADDR] [--cycles A-B] [--registers] <trace file>\n", program);
+    exit(1);
+}
+
+static uint64_t parse_number(char* program, const char* text, char** end)
+{
+    unsigned long long value = strtoull(text, end, 0);
+    if (*end == text) {
+        fprintf(stderr, "error: expected a number, got '%s'\n", text);
+        usage(program);
+    }
+    return value;
+}
+
+static dump_options_t parse_options(int argc, char** argv)
+{
+    enum { OPT_FROM = 0x100, OPT_TO, OPT_CYCLES, OPT_REGISTERS };
+    static const struct option long_options[] = {
+        { "from",      required_argument, NULL, OPT_FROM },
+        { "to",        required_argument, NULL, OPT_TO },
+        { "cycles",    required_argument, NULL, OPT_CYCLES },
+        { "registers", no_argument,       NULL, OPT_REGISTERS },
+        { NULL, 0, NULL, 0 }
+    };
+    dump_options_t options = {
+        .from = 0,
+        .to = UINT16_MAX,
+        .first_cycle = 0,
+        .last_cycle = UINT64_MAX,
+        .registers = false,
+        .trace = NULL
+    };
+    char* end;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case OPT_FROM:
+                options.from = parse_number(argv[0], optarg, &end);
+                break;
+            case OPT_TO:
+                options.to = parse_number(argv[0], optarg, &end);
+                break;
+            case OPT_CYCLES:
+                options.first_cycle = parse_number(argv[0], optarg, &end);
+                if (*end != '-') {
+                    fprintf(stderr, "error: expected a cycle range A-B, got '%s'\n", optarg);
+                    usage(argv[0]);
+                }
+                options.last_cycle = parse_number(argv[0], end + 1, &end);
+                break;
+            case OPT_REGISTERS:
+                options.registers = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    options.trace = argv[optind];
+    return options;
+}
+
+static void print_record(trace_record_t* record, bool registers)
+{
+    printf("%12llu  %03x  %04x", (unsigned long long) record->cycle, record->pc, record->opcodes[0]);
+    if (record->count == 2 && record->opcodes[1] != 0) {
+        printf(" %04x", record->opcodes[1]);
+    } else if (record->count > 1) {
+        printf(" +%u", record->count - 1); // the rest of a translated block
+    } else {
+        printf("     ");
+    }
+    if (record->skipped > 0) {
+        printf("  (%llu idle skipped before)", (unsigned long long) record->skipped);
+    }
+    for (int i = 0; i < 0x10; i++) {
+        if (registers || (record->changed & (1 << i))) {
+            printf("  V%X=%02x", i, record->registers[i]);
+        }
+    }
+    if (registers || record->index_changed) {
+        printf("  I=%03x", record->index);
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+    dump_options_t options = parse_options(argc, argv);
+    trace_reader_t reader;
+    if (!trace_reader_open(&reader, options.trace)) {
+        exit(1);
+    }
+    trace_record_t record;
+    int status;
+    while ((status = trace_read(&reader, &record)) == 1) {
+        if (record.cycle > options.last_cycle) {
+            break;
+        }
+        if (record.cycle >= options.first_cycle && record.pc >= options.from && record.pc <= options.to) {
+            print_record(&record, options.registers);
+        }
+    }
+    trace_reader_close(&reader);
+    return status < 0;
+}